@@ -1,333 +1,7635 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <numbers>
+#include <optional>
 #include <queue>
+#include <random>
 #include <set>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <unordered_set>
 
 #include <curl/curl.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "json.hpp"
 
 // ================= BEGIN boring mechanical stuff ============================
 
+std::string const kApiBase = "https://api-v3.mbta.com/";
+
 void crash(std::string s)
 {
   std::cerr << s << std::endl;
   exit(1);
 }
 
-// (from my file_io.cc bag of tricks; probably came from stackoverflow years ago)
-// trims any trailing newlines (does include other trailing whitespace).
-std::string readStringFile(std::string path)
+// (from my file_io.cc bag of tricks; probably came from stackoverflow years ago)
+// trims any trailing newlines (does include other trailing whitespace).
+std::string readStringFile(std::string path)
+{
+  std::ifstream t(path);
+  std::string s((std::istreambuf_iterator<char>(t)),
+                     std::istreambuf_iterator<char>());
+  while (!s.empty() && s.back() == '\n')
+    s.pop_back();
+  return s;
+}
+
+std::string apiKey()
+{
+  // to avoid static init order fiasco - obviously overkill here, but it's the
+  // type of thing you want to just have a blanket policy for. Read once (the
+  // parallel fetchers and the reload thread all get here), and warned about
+  // once.
+  static std::string const* key = []
+  {
+    auto ret = new std::string;
+    try
+    {
+      *ret = readStringFile("api_key.txt");
+    }
+    catch(const std::exception& e) {} // should still work even without a key
+    if (ret->empty())
+      std::cerr << "Couldn't read api_key.txt. That's ok; we'll just be rate limited." << std::endl;
+    return ret;
+  }();
+  return *key;
+}
+
+static size_t curlWriteCallback(void* data, size_t size, size_t nmemb, void* usr)
+{
+  ((std::string*)usr)->append((char*)data, size * nmemb);
+  return size * nmemb;
+}
+
+// Returns "--name=value" or "--name value" from argv, or default_value if the
+// flag isn't there. A bare "--name" gives "true".
+std::string flagValue(int argc, char** argv, std::string name,
+                      std::string default_value = "")
+{
+  std::string prefix = "--" + name;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg.rfind(prefix + "=", 0) == 0)
+      return arg.substr(prefix.size() + 1);
+    if (arg == prefix)
+    {
+      if (i + 1 < argc && std::string(argv[i + 1]).rfind("--", 0) != 0)
+        return argv[i + 1];
+      return "true";
+    }
+  }
+  return default_value;
+}
+
+bool hasFlag(int argc, char** argv, std::string name)
+{
+  return !flagValue(argc, argv, name).empty();
+}
+
+// The value of --name as a whole number in [min, max], or default_value if
+// the flag isn't there. Anything else (including a bare --name) is fatal.
+uint64_t numberFlag(int argc, char** argv, std::string name, uint64_t default_value,
+                    uint64_t min = 0, uint64_t max = INT_MAX)
+{
+  std::string value = flagValue(argc, argv, name);
+  if (value.empty())
+    return default_value;
+  char* end;
+  errno = 0;
+  unsigned long long parsed = std::strtoull(value.c_str(), &end, 10);
+  if (!std::isdigit((unsigned char)value[0]) || *end || errno == ERANGE || parsed < min || parsed > max)
+    crash("--" + name + " must be a whole number from " + std::to_string(min) + " to " +
+          std::to_string(max) + ", not '" + value + "'");
+  return parsed;
+}
+
+// Every heap allocation bumps its thread's counter, so a benchmark can report
+// allocations per query. It's a thread_local increment on top of malloc.
+thread_local uint64_t t_allocations = 0;
+
+// Heap accounting by subsystem, for --memstats and /memstats. An allocation
+// is charged to whatever MemoryScope its thread is in, and a 16 byte header
+// in front of it remembers which, so that freeing it (on any thread) gets
+// credited back to the same one. mmapped engine files aren't heap, so they
+// don't show up here. It's off unless --memstats is given: the counters are
+// shared by every thread, and the headers would inflate what's measured.
+enum class MemTag : uint8_t
+{
+  kOther, kHttp, kJson, kTopology, kEngine, kCache, kScratch, kCount
+};
+char const* const kMemTagNames[] = {"other", "http bodies", "json", "topology", "engines",
+                                    "plan cache", "query scratch"};
+
+struct MemCounters
+{
+  std::atomic<int64_t> live_bytes;
+  std::atomic<int64_t> live_allocations;
+  std::atomic<int64_t> peak_bytes;
+  std::atomic<uint64_t> allocations;
+  std::atomic<uint64_t> allocated_bytes;
+};
+// Zero-initialized before any constructor runs, so it's safe for allocations
+// made during static initialization.
+MemCounters g_mem_counters[(size_t)MemTag::kCount];
+thread_local MemTag t_mem_tag = MemTag::kOther;
+
+class MemoryScope
+{
+public:
+  explicit MemoryScope(MemTag tag) : previous_(t_mem_tag) { t_mem_tag = tag; }
+  MemoryScope(MemoryScope const&) = delete;
+  MemoryScope& operator=(MemoryScope const&) = delete;
+  ~MemoryScope() { t_mem_tag = previous_; }
+
+private:
+  MemTag previous_;
+};
+
+// Whether --memstats is on the command line. Every block's layout depends on
+// it, so it has to be settled by the first allocation, long before main()
+// sees argv; this reads /proc/self/cmdline (NUL-separated arguments) with
+// plain syscalls instead, which don't allocate.
+bool memoryAccountingEnabled()
+{
+  static bool const enabled = []
+  {
+    static char const kFlag[] = "--memstats";
+    int fd = ::open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return false;
+    bool found = false;
+    int matched = 0; // of kFlag, in the current argument; -1 once it can't match
+    char buf[4096];
+    for (ssize_t n; !found && (n = read(fd, buf, sizeof(buf))) > 0; )
+      for (ssize_t i = 0; i < n && !found; i++)
+      {
+        if (matched == sizeof(kFlag) - 1 && (buf[i] == '\0' || buf[i] == '='))
+          found = true;
+        else if (buf[i] == '\0')
+          matched = 0;
+        else if (matched >= 0 && matched < (int)sizeof(kFlag) - 1 && buf[i] == kFlag[matched])
+          matched++;
+        else
+          matched = -1;
+      }
+    close(fd);
+    return found;
+  }();
+  return enabled;
+}
+
+struct alignas(16) AllocationHeader // keeps what follows 16-byte aligned, as malloc's was
+{
+  size_t size;
+  MemTag tag;
+};
+
+// (noinline keeps gcc from pairing the inlined free() with new and warning.)
+__attribute__((noinline)) void* operator new(size_t size)
+{
+  t_allocations++;
+  if (!memoryAccountingEnabled())
+  {
+    if (void* p = malloc(size == 0 ? 1 : size))
+      return p;
+    throw std::bad_alloc();
+  }
+  if (size > SIZE_MAX - sizeof(AllocationHeader))
+    throw std::bad_alloc();
+  auto* header = (AllocationHeader*)malloc(sizeof(AllocationHeader) + size);
+  if (!header)
+    throw std::bad_alloc();
+  header->size = size;
+  header->tag = t_mem_tag;
+  MemCounters& counters = g_mem_counters[(size_t)header->tag];
+  counters.allocations.fetch_add(1, std::memory_order_relaxed);
+  counters.allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  counters.live_allocations.fetch_add(1, std::memory_order_relaxed);
+  int64_t live = counters.live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+  for (int64_t peak = counters.peak_bytes.load(std::memory_order_relaxed);
+       live > peak && !counters.peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed); ) {}
+  return header + 1;
+}
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+  if (!p)
+    return;
+  if (!memoryAccountingEnabled())
+  {
+    free(p);
+    return;
+  }
+  AllocationHeader* header = (AllocationHeader*)p - 1;
+  MemCounters& counters = g_mem_counters[(size_t)header->tag];
+  counters.live_allocations.fetch_sub(1, std::memory_order_relaxed);
+  counters.live_bytes.fetch_sub(header->size, std::memory_order_relaxed);
+  free(header);
+}
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept { operator delete(p); }
+
+// Per subsystem: live bytes and allocations, peak live bytes, and totals
+// ever allocated. Plus the process's resident set, for comparison (the
+// difference is malloc overhead, stacks, mmapped files and non-C++ heap like
+// curl's). Without --memstats, just the resident set.
+nlohmann::json memoryStats()
+{
+  nlohmann::json ret = nlohmann::json::object();
+  if (!memoryAccountingEnabled())
+    ret["accounting"] = "off (start with --memstats)";
+  else
+    for (size_t tag = 0; tag < (size_t)MemTag::kCount; tag++)
+    {
+      MemCounters const& counters = g_mem_counters[tag];
+      ret[kMemTagNames[tag]] = {{"live_bytes", counters.live_bytes.load()},
+                                {"live_allocations", counters.live_allocations.load()},
+                                {"peak_bytes", counters.peak_bytes.load()},
+                                {"allocations", counters.allocations.load()},
+                                {"allocated_bytes", counters.allocated_bytes.load()}};
+    }
+  std::ifstream status("/proc/self/status");
+  for (std::string line; std::getline(status, line); )
+    if (line.rfind("VmRSS:", 0) == 0 || line.rfind("VmHWM:", 0) == 0)
+      ret[line.substr(0, 5) == "VmRSS" ? "rss_bytes" : "peak_rss_bytes"] =
+          std::strtoull(line.c_str() + 6, nullptr, 10) * 1024;
+  return ret;
+}
+
+void printMemoryStats()
+{
+  nlohmann::json stats = memoryStats();
+  std::fprintf(stderr, "%-16s %12s %12s %12s %12s %14s\n", "heap", "live MB", "live allocs",
+               "peak MB", "allocs", "allocated MB");
+  for (char const* name : kMemTagNames)
+  {
+    nlohmann::json const& tag = stats[name];
+    std::fprintf(stderr, "%-16s %12.2f %12lld %12.2f %12llu %14.2f\n", name,
+                 tag["live_bytes"].get<int64_t>() / 1e6, (long long)tag["live_allocations"].get<int64_t>(),
+                 tag["peak_bytes"].get<int64_t>() / 1e6, (unsigned long long)tag["allocations"].get<uint64_t>(),
+                 tag["allocated_bytes"].get<uint64_t>() / 1e6);
+  }
+  std::fprintf(stderr, "resident: %.2f MB now, %.2f MB at peak\n", stats.value("rss_bytes", 0ull) / 1e6,
+               stats.value("peak_rss_bytes", 0ull) / 1e6);
+}
+
+// Startup tracing (--timings, --trace F). While enabled, scoped phases and
+// every API request (with curl's DNS/connect/TLS/TTFB breakdown) are
+// recorded; finish() prints a per-phase breakdown and writes a Chrome
+// trace-event file for chrome://tracing or Perfetto. Disabled, a phase costs
+// one relaxed atomic load.
+class Tracer
+{
+public:
+  struct Event
+  {
+    std::string name;
+    char const* category;
+    int64_t start_us; // since the tracer was created
+    int64_t duration_us;
+    uint32_t thread;
+    nlohmann::json args;
+  };
+
+  static Tracer& global()
+  {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  void enable() { enabled_.store(true, std::memory_order_relaxed); }
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  int64_t nowMicros() const
+  {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - epoch_).count();
+  }
+
+  // Small, stable per-thread IDs for the trace viewer.
+  static uint32_t threadId()
+  {
+    static std::atomic<uint32_t> next = 1;
+    static thread_local uint32_t id = next++;
+    return id;
+  }
+
+  void record(Event event)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    events_.push_back(std::move(event));
+  }
+
+  // Stops recording. Writes the trace to 'trace_path' (if not empty) and, if
+  // 'print', the breakdown to stderr.
+  void finish(std::string const& trace_path, bool print)
+  {
+    enabled_.store(false, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::sort(events_.begin(), events_.end(),
+              [](Event const& a, Event const& b) { return a.start_us < b.start_us; });
+    if (!trace_path.empty())
+    {
+      nlohmann::json trace_events = nlohmann::json::array();
+      for (Event const& event : events_)
+        trace_events.push_back({{"name", event.name}, {"cat", event.category}, {"ph", "X"},
+                                {"ts", event.start_us}, {"dur", event.duration_us}, {"pid", 1},
+                                {"tid", event.thread}, {"args", event.args.is_null() ? nlohmann::json::object() : event.args}});
+      std::ofstream out(trace_path);
+      out << nlohmann::json{{"traceEvents", trace_events}, {"displayTimeUnit", "ms"}}.dump();
+      if (!out)
+        std::cerr << "couldn't write the trace to " << trace_path << std::endl;
+    }
+    if (print)
+      printBreakdown();
+  }
+
+private:
+  Tracer() : epoch_(std::chrono::steady_clock::now()) {}
+
+  void printBreakdown() const
+  {
+    struct Phase
+    {
+      std::string name;
+      size_t count = 0;
+      int64_t total_us = 0, max_us = 0;
+    };
+    std::vector<Phase> phases; // in order of first appearance
+    std::unordered_map<std::string, size_t> phase_of;
+    for (Event const& event : events_)
+    {
+      std::string key = std::string(event.category) + ": " +
+                        (strcmp(event.category, "http") == 0 ? "GET" : event.name);
+      auto [it, inserted] = phase_of.emplace(key, phases.size());
+      if (inserted)
+        phases.push_back(Phase{key});
+      Phase& phase = phases[it->second];
+      phase.count++;
+      phase.total_us += event.duration_us;
+      phase.max_us = std::max(phase.max_us, event.duration_us);
+    }
+    std::fprintf(stderr, "%-40s %6s %11s %10s\n", "phase", "count", "total ms", "max ms");
+    for (Phase const& phase : phases)
+      std::fprintf(stderr, "%-40s %6zu %11.1f %10.1f\n", phase.name.c_str(), phase.count,
+                   phase.total_us / 1e3, phase.max_us / 1e3);
+
+    std::fprintf(stderr, "\n%8s %8s %8s %8s %9s %9s %9s  %s\n", "dns ms", "conn ms", "tls ms",
+                 "ttfb ms", "xfer ms", "total ms", "bytes", "request");
+    for (Event const& event : events_)
+      if (strcmp(event.category, "http") == 0)
+        std::fprintf(stderr, "%8.1f %8.1f %8.1f %8.1f %9.1f %9.1f %9lld  %s\n",
+                     event.args.value("dns_ms", 0.0), event.args.value("connect_ms", 0.0),
+                     event.args.value("tls_ms", 0.0), event.args.value("ttfb_ms", 0.0),
+                     event.args.value("transfer_ms", 0.0), event.duration_us / 1e3,
+                     (long long)event.args.value("bytes", 0), event.name.c_str());
+  }
+
+  std::chrono::steady_clock::time_point epoch_;
+  std::atomic<bool> enabled_ = false;
+  std::mutex mutex_;
+  std::vector<Event> events_;
+};
+
+// Records its own lifetime as a trace event, if tracing is on. Add to 'args'
+// anything worth seeing in the trace viewer.
+class ScopedPhase
+{
+public:
+  explicit ScopedPhase(char const* name, char const* category = "phase")
+      : name_(name), category_(category),
+        start_us_(Tracer::global().enabled() ? Tracer::global().nowMicros() : -1) {}
+  ScopedPhase(ScopedPhase const&) = delete;
+  ScopedPhase& operator=(ScopedPhase const&) = delete;
+  ~ScopedPhase()
+  {
+    if (start_us_ >= 0)
+      Tracer::global().record(Tracer::Event{name_, category_, start_us_,
+                                            Tracer::global().nowMicros() - start_us_,
+                                            Tracer::threadId(), std::move(args)});
+  }
+
+  nlohmann::json args;
+
+private:
+  char const* name_;
+  char const* category_;
+  int64_t start_us_;
+};
+
+// Prometheus text exposition (format 0.0.4), for --metrics-port. Metrics are
+// plain relaxed atomics, so recording never takes a lock, and a scrape only
+// loads them and never gets in a query's way.
+void appendPromHeader(std::string* out, char const* name, char const* type, char const* help)
+{
+  *out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+}
+
+void appendPromSample(std::string* out, std::string_view name, std::string_view labels, double value)
+{
+  char number[32];
+  if (std::isinf(value))
+    std::snprintf(number, sizeof(number), "%s", value > 0 ? "+Inf" : "-Inf");
+  else
+    std::snprintf(number, sizeof(number), "%.10g", value);
+  out->append(name);
+  if (!labels.empty())
+    *out += "{" + std::string(labels) + "}";
+  *out += " " + std::string(number) + "\n";
+}
+
+// A Prometheus histogram: fixed upper bounds, plus an implicit +Inf.
+class PromHistogram
+{
+public:
+  explicit PromHistogram(std::vector<double> bounds) : bounds_(std::move(bounds)), buckets_(bounds_.size() + 1) {}
+
+  void observe(double value)
+  {
+    size_t bucket = std::lower_bound(bounds_.begin(), bounds_.end(), value) - bounds_.begin();
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  void render(std::string* out, char const* name, char const* help) const
+  {
+    appendPromHeader(out, name, "histogram", help);
+    uint64_t cumulative = 0;
+    char le[48];
+    for (size_t i = 0; i <= bounds_.size(); i++)
+    {
+      cumulative += buckets_[i].load(std::memory_order_relaxed);
+      if (i < bounds_.size())
+        std::snprintf(le, sizeof(le), "le=\"%g\"", bounds_[i]);
+      else
+        std::snprintf(le, sizeof(le), "le=\"+Inf\"");
+      appendPromSample(out, std::string(name) + "_bucket", le, cumulative);
+    }
+    appendPromSample(out, std::string(name) + "_sum", "", sum_.load(std::memory_order_relaxed));
+    appendPromSample(out, std::string(name) + "_count", "", cumulative);
+  }
+
+private:
+  std::vector<double> bounds_;
+  std::vector<std::atomic<uint64_t>> buckets_;
+  std::atomic<double> sum_ = 0;
+};
+
+// What curlMBTA() has done, for /metrics: requests by outcome, bytes,
+// latency, and the rate limit the API last told us about (x-ratelimit-*
+// headers; -1 until we've seen them).
+struct ApiMetrics
+{
+  static ApiMetrics& global()
+  {
+    static ApiMetrics* metrics = new ApiMetrics; // outlives any fetching thread
+    return *metrics;
+  }
+
+  std::atomic<uint64_t> ok = 0;
+  std::atomic<uint64_t> rate_limited = 0; // 429s, which we back off and retry
+  std::atomic<uint64_t> http_errors = 0;
+  std::atomic<uint64_t> transport_errors = 0; // curl couldn't get a response at all
+  std::atomic<uint64_t> bytes = 0;
+  PromHistogram seconds{{0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30}};
+  std::atomic<int64_t> ratelimit_limit = -1;
+  std::atomic<int64_t> ratelimit_remaining = -1;
+  std::atomic<int64_t> ratelimit_reset = -1; // unix time when 'remaining' refills
+
+  void render(std::string* out) const
+  {
+    appendPromHeader(out, "mbta_api_requests_total", "counter", "MBTA API requests, by outcome.");
+    appendPromSample(out, "mbta_api_requests_total", "outcome=\"ok\"", ok.load());
+    appendPromSample(out, "mbta_api_requests_total", "outcome=\"rate_limited\"", rate_limited.load());
+    appendPromSample(out, "mbta_api_requests_total", "outcome=\"http_error\"", http_errors.load());
+    appendPromSample(out, "mbta_api_requests_total", "outcome=\"transport_error\"", transport_errors.load());
+    appendPromHeader(out, "mbta_api_response_bytes_total", "counter", "MBTA API response body bytes.");
+    appendPromSample(out, "mbta_api_response_bytes_total", "", bytes.load());
+    seconds.render(out, "mbta_api_request_duration_seconds", "MBTA API request latency.");
+    appendPromHeader(out, "mbta_api_ratelimit_limit", "gauge", "Requests allowed per rate limit window (-1: not seen yet).");
+    appendPromSample(out, "mbta_api_ratelimit_limit", "", ratelimit_limit.load());
+    appendPromHeader(out, "mbta_api_ratelimit_remaining", "gauge", "Requests left in the current rate limit window (-1: not seen yet).");
+    appendPromSample(out, "mbta_api_ratelimit_remaining", "", ratelimit_remaining.load());
+    appendPromHeader(out, "mbta_api_ratelimit_reset_timestamp_seconds", "gauge", "When the rate limit window resets (-1: not seen yet).");
+    appendPromSample(out, "mbta_api_ratelimit_reset_timestamp_seconds", "", ratelimit_reset.load());
+  }
+};
+
+// Picks the x-ratelimit-* headers out of an API response into ApiMetrics.
+static size_t curlHeaderCallback(char* data, size_t size, size_t nitems, void*)
+{
+  std::string_view line(data, size * nitems);
+  size_t colon = line.find(':');
+  if (colon != std::string_view::npos)
+  {
+    std::string name(line.substr(0, colon));
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    int64_t value = std::strtoll(std::string(line.substr(colon + 1)).c_str(), nullptr, 10);
+    ApiMetrics& metrics = ApiMetrics::global();
+    if (name == "x-ratelimit-limit")
+      metrics.ratelimit_limit.store(value, std::memory_order_relaxed);
+    else if (name == "x-ratelimit-remaining")
+      metrics.ratelimit_remaining.store(value, std::memory_order_relaxed);
+    else if (name == "x-ratelimit-reset")
+      metrics.ratelimit_reset.store(value, std::memory_order_relaxed);
+  }
+  return size * nitems;
+}
+
+struct curl_slist* mbtaHeaders(std::string accept)
+{
+  struct curl_slist* list = NULL;
+  list = curl_slist_append(list, ("Accept: " + accept).c_str());
+  if (!apiKey().empty())
+    list = curl_slist_append(list, ("Authorization: " + apiKey()).c_str());
+  return list;
+}
+
+std::string curlMBTA(std::string url)
+{
+  MemoryScope memory(MemTag::kHttp);
+  std::string response_body;
+  // Without an API key we get 20 requests a minute, which the all-modes load
+  // blows through; so on 429 Too Many Requests, back off and retry.
+  for (int attempt = 0, backoff_seconds = 2; ; attempt++, backoff_seconds *= 2)
+  {
+    CURL* curl = curl_easy_init();
+    if (!curl)
+      crash("curl_easy_init() in curlMBTA() failed!");
+
+    struct curl_slist* list = mbtaHeaders("application/json");
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlWriteCallback);
+    response_body.clear();
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_body);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curlHeaderCallback);
+    int64_t start_us = Tracer::global().enabled() ? Tracer::global().nowMicros() : -1;
+    auto start = std::chrono::steady_clock::now();
+    CURLcode res = curl_easy_perform(curl);
+    long http_code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    ApiMetrics& metrics = ApiMetrics::global();
+    metrics.seconds.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    metrics.bytes.fetch_add(response_body.size(), std::memory_order_relaxed);
+    if (res != CURLE_OK)
+      metrics.transport_errors.fetch_add(1, std::memory_order_relaxed);
+    else if (http_code == 429)
+      metrics.rate_limited.fetch_add(1, std::memory_order_relaxed);
+    else if (http_code >= 400)
+      metrics.http_errors.fetch_add(1, std::memory_order_relaxed);
+    else
+      metrics.ok.fetch_add(1, std::memory_order_relaxed);
+    if (start_us >= 0)
+    {
+      // curl's times are all cumulative from the start of the request.
+      curl_off_t dns = 0, connect = 0, tls = 0, first_byte = 0, total = 0;
+      curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+      curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+      curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+      curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+      curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+      nlohmann::json args = {{"url", url}, {"status", http_code}, {"bytes", response_body.size()},
+                             {"dns_ms", dns / 1e3}, {"connect_ms", std::max<curl_off_t>(0, connect - dns) / 1e3},
+                             {"tls_ms", tls ? std::max<curl_off_t>(0, tls - connect) / 1e3 : 0.0},
+                             {"ttfb_ms", first_byte / 1e3},
+                             {"transfer_ms", std::max<curl_off_t>(0, total - first_byte) / 1e3}};
+      Tracer::global().record(Tracer::Event{url.substr(url.find('/', url.find("//") + 2) + 1), "http",
+                                            start_us, Tracer::global().nowMicros() - start_us,
+                                            Tracer::threadId(), std::move(args)});
+    }
+    curl_easy_cleanup(curl);
+    curl_slist_free_all(list);
+
+    if (res != CURLE_OK)
+      std::cerr << "curlMBTA(" << url << "): " << curl_easy_strerror(res) << std::endl;
+    if (http_code != 429 || attempt >= 6)
+      break;
+    std::this_thread::sleep_for(std::chrono::seconds(backoff_seconds));
+  }
+  return response_body;
+}
+
+// For long-running callers that would rather carry on than crash(): nullopt
+// if the response isn't a JSON:API document with a "data" member.
+std::optional<nlohmann::json> tryQueryAndParse(std::string url)
+{
+  std::string response_body = curlMBTA(url);
+  try
+  {
+    ScopedPhase phase("parse JSON", "json");
+    MemoryScope memory(MemTag::kJson);
+    nlohmann::json ret = nlohmann::json::parse(response_body);
+    if (ret.contains("data"))
+      return ret;
+  }
+  catch(const std::exception& e) {}
+  std::cerr << "bad response from " << url << ": " << response_body.substr(0, 500) << std::endl;
+  return std::nullopt;
+}
+
+nlohmann::json queryAndParse(std::string url)
+{
+  std::string response_body = curlMBTA(url);
+  nlohmann::json ret;
+  try
+  {
+    ScopedPhase phase("parse JSON", "json");
+    MemoryScope memory(MemTag::kJson);
+    ret = nlohmann::json::parse(response_body);
+  }
+  catch(const std::exception& e)
+  {
+    crash("failed to parse queryAndParse() JSON response: " + response_body);
+  }
+  return ret;
+}
+
+// Calls fn(i) for every i in [0, n), spread over up to num_threads threads.
+// Work is handed out one index at a time, so uneven items balance themselves.
+// The workers charge their allocations to the caller's MemoryScope.
+void parallelFor(size_t n, int num_threads, std::function<void(size_t)> fn)
+{
+  num_threads = std::max(1, std::min<int>(num_threads, n));
+  std::atomic<size_t> next = 0;
+  MemTag tag = t_mem_tag;
+  auto worker = [&]()
+  {
+    MemoryScope memory(tag);
+    for (size_t i = next++; i < n; i = next++)
+      fn(i);
+  };
+  std::vector<std::thread> threads;
+  for (int t = 1; t < num_threads; t++)
+    threads.emplace_back(worker);
+  worker();
+  for (auto& thread : threads)
+    thread.join();
+}
+
+int hardwareThreads()
+{
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Collects output and write()s it in big chunks, instead of paying for a
+// flush (and a syscall) per line like std::endl does.
+class BufferedWriter
+{
+public:
+  explicit BufferedWriter(int fd, size_t capacity = 1 << 20) : fd_(fd), capacity_(capacity)
+  {
+    buffer_.reserve(capacity);
+  }
+  ~BufferedWriter() { flush(); }
+
+  void append(std::string_view bytes)
+  {
+    if (buffer_.size() + bytes.size() > capacity_)
+      flush();
+    if (bytes.size() >= capacity_)
+      writeAll(bytes);
+    else
+      buffer_.append(bytes);
+  }
+
+  void flush()
+  {
+    writeAll(buffer_);
+    buffer_.clear();
+  }
+
+  uint64_t bytesWritten() const { return bytes_written_ + buffer_.size(); }
+
+private:
+  void writeAll(std::string_view bytes)
+  {
+    while (!bytes.empty())
+    {
+      ssize_t n = write(fd_, bytes.data(), bytes.size());
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        crash("BufferedWriter: write() failed");
+      bytes.remove_prefix(n);
+      bytes_written_ += n;
+    }
+  }
+
+  int fd_;
+  size_t capacity_;
+  std::string buffer_;
+  uint64_t bytes_written_ = 0;
+};
+
+void appendJsonString(std::string* out, std::string_view s)
+{
+  *out += '"';
+  for (char c : s)
+  {
+    if (c == '"' || c == '\\')
+    {
+      *out += '\\';
+      *out += c;
+    }
+    else if ((unsigned char)c < 0x20)
+    {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      *out += escaped;
+    }
+    else
+      *out += c;
+  }
+  *out += '"';
+}
+
+void appendCsvField(std::string* out, std::string_view s)
+{
+  if (s.find_first_of(",\"\r\n") == std::string_view::npos)
+  {
+    *out += s;
+    return;
+  }
+  *out += '"';
+  for (char c : s)
+  {
+    if (c == '"')
+      *out += '"';
+    *out += c;
+  }
+  *out += '"';
+}
+
+template<typename T>
+void appendBinary(std::string* out, T value)
+{
+  out->append((char const*)&value, sizeof(value));
+}
+
+// A read-only mmap of a whole file, unmapped on destruction.
+class MappedFile
+{
+public:
+  static std::unique_ptr<MappedFile> open(std::string const& path, std::string* error)
+  {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      *error = "can't open " + path;
+      return nullptr;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    void* data = st.st_size > 0 ? mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+      *error = "can't mmap " + path;
+      return nullptr;
+    }
+    return std::unique_ptr<MappedFile>(new MappedFile(data, st.st_size));
+  }
+
+  MappedFile(MappedFile const&) = delete;
+  MappedFile& operator=(MappedFile const&) = delete;
+  ~MappedFile() { munmap(data_, size_); }
+
+  uint8_t const* data() const { return (uint8_t const*)data_; }
+  size_t size() const { return size_; }
+
+private:
+  MappedFile(void* data, size_t size) : data_(data), size_(size) {}
+  void* data_;
+  size_t size_;
+};
+
+// Writes via a temp file + rename, so 'path' never holds a torn file.
+bool writeFileAtomically(std::string const& path, void const* data, size_t size)
+{
+  std::string tmp = path + ".tmp";
+  std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+  out.write((char const*)data, size);
+  out.close();
+  return out && rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+// HDR-style log-linear histogram: values are bucketed by power of two, and
+// each power of two is split into 16 linear sub-buckets, so a percentile is
+// accurate to within ~6%. Fixed size, no allocation. Only the owning thread
+// records; other threads may read (and merge) at any time.
+class LogHistogram
+{
+public:
+  void record(uint64_t value)
+  {
+    bump(counts_[index(value)], 1);
+    bump(count_, 1);
+    bump(sum_, value);
+    if (value > max_.load(std::memory_order_relaxed))
+      max_.store(value, std::memory_order_relaxed);
+  }
+
+  void mergeInto(std::vector<uint64_t>* counts, uint64_t* count, uint64_t* sum, uint64_t* max) const
+  {
+    counts->resize(kBuckets);
+    for (size_t i = 0; i < kBuckets; i++)
+      (*counts)[i] += counts_[i].load(std::memory_order_relaxed);
+    *count += count_.load(std::memory_order_relaxed);
+    *sum += sum_.load(std::memory_order_relaxed);
+    *max = std::max(*max, max_.load(std::memory_order_relaxed));
+  }
+
+  // Adds our counts to `other`; the caller must be `other`'s only writer.
+  void addTo(LogHistogram* other) const
+  {
+    for (size_t i = 0; i < kBuckets; i++)
+      bump(other->counts_[i], counts_[i].load(std::memory_order_relaxed));
+    bump(other->count_, count_.load(std::memory_order_relaxed));
+    bump(other->sum_, sum_.load(std::memory_order_relaxed));
+    if (max_.load(std::memory_order_relaxed) > other->max_.load(std::memory_order_relaxed))
+      other->max_.store(max_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+
+  // {count, mean, p50, p90, p99, p999, max} of merged counts.
+  static nlohmann::json summarize(std::vector<uint64_t> const& counts, uint64_t count, uint64_t sum,
+                                  uint64_t max, double scale = 1)
+  {
+    nlohmann::json ret = {{"count", count}};
+    if (count == 0)
+      return ret;
+    ret["mean"] = sum * scale / count;
+    for (auto [name, fraction] : {std::pair{"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}})
+    {
+      uint64_t rank = std::max<uint64_t>(1, fraction * count + 0.5), seen = 0;
+      size_t i = 0;
+      while (i + 1 < counts.size() && (seen += counts[i]) < rank)
+        i++;
+      ret[name] = std::min(lowerBound(i), max) * scale;
+    }
+    ret["max"] = max * scale;
+    return ret;
+  }
+
+private:
+  static int constexpr kSubBits = 4;
+  static size_t constexpr kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+  static size_t index(uint64_t value)
+  {
+    if (value < (1u << kSubBits))
+      return value;
+    int shift = 63 - __builtin_clzll(value) - kSubBits;
+    return ((shift + 1) << kSubBits) + ((value >> shift) & ((1u << kSubBits) - 1));
+  }
+  static uint64_t lowerBound(size_t i)
+  {
+    if (i < (1u << kSubBits))
+      return i;
+    int shift = (i >> kSubBits) - 1;
+    return (uint64_t)((1u << kSubBits) + (i & ((1u << kSubBits) - 1))) << shift;
+  }
+  // Single writer, so a relaxed load + store is enough (and is a plain add).
+  static void bump(std::atomic<uint64_t>& counter, uint64_t by)
+  {
+    counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> counts_[kBuckets] = {};
+  std::atomic<uint64_t> count_ = 0, sum_ = 0, max_ = 0;
+};
+
+// ================= END boring mechanical stuff =============================
+
+// ================= BEGIN live streaming =====================================
+
+// Incremental text/event-stream parser: feed() it bytes as they arrive (in
+// whatever chunks curl feels like), and it calls on_event(event_name, data) for
+// each complete event. Only the event and data fields matter for the MBTA API.
+class SSEParser
+{
+public:
+  explicit SSEParser(std::function<void(std::string const&, std::string const&)> on_event)
+  : on_event_(on_event) {}
+
+  void feed(char const* bytes, size_t len)
+  {
+    buffer_.append(bytes, len);
+    size_t line_start = 0;
+    size_t newline;
+    while ((newline = buffer_.find('\n', line_start)) != std::string::npos)
+    {
+      size_t line_end = newline;
+      if (line_end > line_start && buffer_[line_end - 1] == '\r')
+        line_end--;
+      handleLine(std::string_view(buffer_).substr(line_start, line_end - line_start));
+      line_start = newline + 1;
+    }
+    buffer_.erase(0, line_start);
+  }
+
+private:
+  void handleLine(std::string_view line)
+  {
+    if (line.empty()) // blank line ends the event
+    {
+      if (have_data_)
+        on_event_(event_.empty() ? "message" : event_, data_);
+      event_.clear();
+      data_.clear();
+      have_data_ = false;
+      return;
+    }
+    if (line[0] == ':') // comment; the server uses these as keepalives
+      return;
+    size_t colon = line.find(':');
+    std::string_view field = line.substr(0, colon);
+    std::string_view value;
+    if (colon != std::string_view::npos)
+    {
+      value = line.substr(colon + 1);
+      if (!value.empty() && value[0] == ' ')
+        value.remove_prefix(1);
+    }
+    if (field == "event")
+      event_ = value;
+    else if (field == "data")
+    {
+      if (have_data_)
+        data_ += '\n';
+      data_ += value;
+      have_data_ = true;
+    }
+  }
+
+  std::function<void(std::string const&, std::string const&)> on_event_;
+  std::string buffer_; // holds any incomplete trailing line
+  std::string event_;
+  std::string data_;
+  bool have_data_ = false;
+};
+
+// Local mirror of a streamed MBTA resource collection (vehicles, predictions...),
+// keyed by type + id. The stream opens with a "reset" carrying the full list,
+// then sends "add", "update" and "remove" for individual resources.
+// Thread-safe: the streaming thread applies events while others read.
+class LiveStateStore
+{
+public:
+  // Returns false if the event type isn't one we know, or its data isn't the
+  // resource (or for "reset", the array of them) it should be; either way
+  // it's ignored, and the store is left as it was.
+  bool applyEvent(std::string const& event, nlohmann::json const& data)
+  {
+    if (event == "reset")
+    {
+      if (!data.is_array())
+        return false;
+      std::unordered_map<std::string, nlohmann::json> resources;
+      for (auto const& item : data)
+      {
+        std::optional<std::string> item_key = key(item);
+        if (!item_key)
+          return false;
+        resources[*item_key] = item;
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      resources_.swap(resources);
+      version_++;
+      return true;
+    }
+    if (event != "add" && event != "update" && event != "remove")
+      return false;
+    std::optional<std::string> data_key = key(data);
+    if (!data_key)
+      return false;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (event == "remove")
+      resources_.erase(*data_key);
+    else
+      resources_[*data_key] = data;
+    version_++;
+    return true;
+  }
+
+  std::optional<nlohmann::json> get(std::string type, std::string id)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = resources_.find(type + "/" + id);
+    if (it == resources_.end())
+      return std::nullopt;
+    return it->second;
+  }
+
+  std::vector<nlohmann::json> snapshot()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<nlohmann::json> ret;
+    ret.reserve(resources_.size());
+    for (auto const& [junk, item] : resources_)
+      ret.push_back(item);
+    return ret;
+  }
+
+  size_t size()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return resources_.size();
+  }
+
+  // bumped on every applied event, so readers can cheaply tell if anything changed.
+  uint64_t version()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return version_;
+  }
+
+private:
+  static std::optional<std::string> key(nlohmann::json const& item)
+  {
+    if (!item.is_object())
+      return std::nullopt;
+    auto type = item.find("type"), id = item.find("id");
+    if (type == item.end() || id == item.end() || !type->is_string() || !id->is_string())
+      return std::nullopt;
+    return type->get<std::string>() + "/" + id->get<std::string>();
+  }
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, nlohmann::json> resources_;
+  uint64_t version_ = 0;
+};
+
+struct StreamContext
+{
+  SSEParser* parser;
+  std::atomic<bool>* stop;
+};
+
+// Nothing may throw through libcurl, so anything that does aborts the
+// transfer instead (returning short of size * nmemb), and streamMBTA()
+// reconnects.
+static size_t curlStreamCallback(void* data, size_t size, size_t nmemb, void* usr)
+{
+  try
+  {
+    ((StreamContext*)usr)->parser->feed((char*)data, size * nmemb);
+  }
+  catch(const std::exception& e)
+  {
+    std::cerr << "streamMBTA(): dropping connection: " << e.what() << std::endl;
+    return 0;
+  }
+  catch(...)
+  {
+    std::cerr << "streamMBTA(): dropping connection" << std::endl;
+    return 0;
+  }
+  return size * nmemb;
+}
+
+static int curlStreamProgress(void* usr, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+{
+  return ((StreamContext*)usr)->stop->load() ? 1 : 0; // nonzero aborts the transfer
+}
+
+// Keeps 'store' in sync with the event stream at 'url' until 'stop' is set,
+// reconnecting with backoff whenever the connection drops. Every connection
+// starts with a fresh "reset", so reconnecting needs no resume bookkeeping.
+// If given, on_applied is called (on this thread) after each applied event.
+void streamMBTA(std::string url, LiveStateStore* store, std::atomic<bool>* stop,
+                std::function<void(std::string const&)> on_applied = nullptr)
+{
+  int backoff_seconds = 1;
+  while (!stop->load())
+  {
+    CURL* curl = curl_easy_init();
+    if (!curl)
+      crash("curl_easy_init() in streamMBTA() failed!");
+
+    bool got_events = false;
+    SSEParser parser([&](std::string const& event, std::string const& data)
+    {
+      nlohmann::json parsed;
+      try
+      {
+        parsed = nlohmann::json::parse(data);
+      }
+      catch(const std::exception& e)
+      {
+        std::cerr << "streamMBTA(): skipping unparseable '" << event << "' event: "
+                  << data << std::endl;
+        return;
+      }
+      if (store->applyEvent(event, parsed))
+      {
+        got_events = true;
+        if (on_applied)
+          on_applied(event);
+      }
+      else
+        std::cerr << "streamMBTA(): ignoring '" << event << "' event" << std::endl;
+    });
+    StreamContext context{&parser, stop};
+
+    struct curl_slist* list = mbtaHeaders("text/event-stream");
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlStreamCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &context);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, curlStreamProgress);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &context);
+    // The server sends keepalive comments, so a silent minute means a dead connection.
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+    CURLcode res = curl_easy_perform(curl);
+    curl_easy_cleanup(curl);
+    curl_slist_free_all(list);
+
+    if (stop->load())
+      break;
+    std::cerr << "streamMBTA(): connection to " << url << " ended ("
+              << curl_easy_strerror(res) << "); reconnecting in "
+              << backoff_seconds << "s" << std::endl;
+    backoff_seconds = got_events ? 1 : std::min(backoff_seconds * 2, 60);
+    for (int i = 0; i < backoff_seconds * 10 && !stop->load(); i++)
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+}
+
+// ================= END live streaming =======================================
+
+// ================= BEGIN network serving ====================================
+
+// A connection's wire protocol. Consumes every complete request at the front
+// of 'in' (leaving any partial one for next time) and appends the responses to
+// 'out'. Pipelined requests that arrive together get answered together, with
+// one write. Returns false if the connection should close once 'out' is sent.
+using ProtocolHandler = std::function<bool(std::string& in, std::string& out)>;
+
+// Event-driven server: each of num_threads workers runs its own epoll loop,
+// and they share the listening socket (EPOLLEXCLUSIVE, so a new connection
+// wakes just one of them). A connection lives on the worker that accepted it.
+class EventLoopServer
+{
+public:
+  EventLoopServer(int listen_fd, int num_threads, ProtocolHandler handler)
+  : listen_fd_(listen_fd), num_threads_(std::max(1, num_threads)), handler_(handler) {}
+
+  // Blocks until stop().
+  void run()
+  {
+    std::vector<std::thread> threads;
+    for (int i = 1; i < num_threads_; i++)
+      threads.emplace_back([this]() { workerLoop(); });
+    workerLoop();
+    for (auto& thread : threads)
+      thread.join();
+  }
+
+  void stop() { stopping_ = true; } // workers notice within one epoll timeout
+
+private:
+  struct Connection
+  {
+    std::string in;
+    std::string out;
+    size_t out_sent = 0;
+    bool close_after_flush = false;
+    bool input_paused = false; // too much unsent output; see service()
+  };
+
+  // A client that pipelines requests but doesn't read the responses gets
+  // this much buffered before we stop reading from it.
+  static constexpr size_t kMaxUnsentOutput = 1 << 20;
+
+  void workerLoop()
+  {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+      crash("epoll_create1() failed");
+    epoll_event listen_event{};
+    listen_event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    listen_event.data.fd = listen_fd_;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd_, &listen_event) < 0)
+      crash("epoll_ctl() on the listening socket failed");
+
+    std::unordered_map<int, Connection> connections;
+    epoll_event events[256];
+    bool accepting = true;
+    auto accept_resume = std::chrono::steady_clock::now();
+    while (!stopping_)
+    {
+      if (!accepting && std::chrono::steady_clock::now() >= accept_resume)
+      {
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd_, &listen_event) < 0)
+          crash("epoll_ctl() on the listening socket failed");
+        accepting = true;
+      }
+      int num_events = epoll_wait(epoll_fd, events, 256, accepting ? 200 : 100);
+      for (int i = 0; i < num_events; i++)
+      {
+        int fd = events[i].data.fd;
+        if (fd == listen_fd_)
+        {
+          // Out of descriptors: the listening socket stays readable, so rather
+          // than spin on it, stop watching it for a bit while some close.
+          if (!acceptAll(epoll_fd, &connections))
+          {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd_, nullptr);
+            accepting = false;
+            accept_resume = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+          }
+          continue;
+        }
+        auto it = connections.find(fd);
+        if (it == connections.end())
+          continue;
+        if (!service(fd, &it->second, events[i].events))
+        {
+          close(fd);
+          connections.erase(it);
+        }
+      }
+    }
+    for (auto const& [fd, junk] : connections)
+      close(fd);
+    close(epoll_fd);
+  }
+
+  // Returns false if we're out of descriptors (or memory) and should back off.
+  bool acceptAll(int epoll_fd, std::unordered_map<int, Connection>* connections)
+  {
+    while (true)
+    {
+      int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0)
+      {
+        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+          return false;
+        if (errno == EINTR || errno == ECONNABORTED)
+          continue;
+        return true; // EAGAIN: another worker got it, or we've drained the backlog
+      }
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // harmless failure on unix sockets
+      epoll_event event{};
+      event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      event.data.fd = fd;
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+      {
+        close(fd);
+        continue;
+      }
+      (*connections)[fd];
+    }
+  }
+
+  // Reads whatever is available, handles it, writes what we can. Returns
+  // false when the connection should be closed. Once kMaxUnsentOutput is
+  // waiting on the client, further input stays in the socket (so TCP pushes
+  // back on the client) until EPOLLOUT says some of it went out.
+  bool service(int fd, Connection* conn, uint32_t events)
+  {
+    if (events & EPOLLERR)
+      return false;
+    bool readable = (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) || conn->input_paused;
+    bool peer_closed = false;
+    char buf[65536];
+    while (true)
+    {
+      if (!flush(fd, conn))
+        return false;
+      conn->input_paused = conn->out.size() - conn->out_sent >= kMaxUnsentOutput;
+      if (conn->input_paused || !readable)
+        break;
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n > 0)
+      {
+        conn->in.append(buf, n);
+        if (!conn->close_after_flush && !handler_(conn->in, conn->out))
+          conn->close_after_flush = true;
+      }
+      else if (n == 0)
+      {
+        peer_closed = true;
+        readable = false;
+      }
+      else if (errno == EINTR)
+        continue;
+      else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        readable = false;
+      else
+        return false;
+    }
+    if (conn->out_sent < conn->out.size())
+      return true; // EPOLLOUT will bring us back
+    return !conn->close_after_flush && !peer_closed;
+  }
+
+  // Sends until the socket would block. Returns false on a send error.
+  bool flush(int fd, Connection* conn)
+  {
+    while (conn->out_sent < conn->out.size())
+    {
+      ssize_t n = send(fd, conn->out.data() + conn->out_sent,
+                       conn->out.size() - conn->out_sent, MSG_NOSIGNAL);
+      if (n > 0)
+        conn->out_sent += n;
+      else if (n < 0 && errno == EINTR)
+        continue;
+      else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        break;
+      else
+        return false;
+    }
+    // Drop what's been sent, so a client that's always a little behind
+    // doesn't keep the whole history of its responses buffered.
+    if (conn->out_sent == conn->out.size() || conn->out_sent >= kMaxUnsentOutput)
+    {
+      conn->out.erase(0, conn->out_sent);
+      conn->out_sent = 0;
+    }
+    return true;
+  }
+
+  int listen_fd_;
+  int num_threads_;
+  ProtocolHandler handler_;
+  std::atomic<bool> stopping_ = false;
+};
+
+int listenTcp(int port)
+{
+  int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    crash("socket() failed");
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  int zero = 0;
+  setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero)); // take IPv4 too
+  sockaddr_in6 addr{};
+  addr.sin6_family = AF_INET6;
+  addr.sin6_addr = in6addr_any;
+  addr.sin6_port = htons(port);
+  if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+    crash("couldn't bind port " + std::to_string(port));
+  if (listen(fd, SOMAXCONN) < 0)
+    crash("listen() failed");
+  return fd;
+}
+
+int listenUnix(std::string path)
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    crash("socket() failed");
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+    crash("unix socket path too long: " + path);
+  std::copy(path.begin(), path.end(), addr.sun_path);
+  // A stale socket file from a previous run would block bind(), so it goes;
+  // anything else at that path is surely a mistyped flag.
+  struct stat existing;
+  if (lstat(path.c_str(), &existing) == 0)
+  {
+    if (!S_ISSOCK(existing.st_mode))
+      crash(path + " exists and isn't a socket; not replacing it");
+    unlink(path.c_str());
+  }
+  if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+    crash("couldn't bind " + path);
+  if (listen(fd, SOMAXCONN) < 0)
+    crash("listen() failed");
+  return fd;
+}
+
+struct HttpRequest
+{
+  std::string method;
+  std::string path;
+  std::unordered_map<std::string, std::string> params; // decoded query string
+};
+
+struct HttpResponse
+{
+  int status = 200;
+  std::string body;
+  std::string content_type = "application/json";
+};
+
+std::string urlDecode(std::string_view s)
+{
+  std::string ret;
+  for (size_t i = 0; i < s.size(); i++)
+  {
+    if (s[i] == '+')
+      ret += ' ';
+    else if (s[i] == '%' && i + 2 < s.size() && std::isxdigit((unsigned char)s[i+1]) &&
+             std::isxdigit((unsigned char)s[i+2]))
+    {
+      ret += (char)std::stoi(std::string(s.substr(i + 1, 2)), nullptr, 16);
+      i += 2;
+    }
+    else
+      ret += s[i];
+  }
+  return ret;
+}
+
+char const* httpReason(int status)
+{
+  switch (status)
+  {
+    case 200: return "OK";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 409: return "Conflict";
+    case 413: return "Payload Too Large";
+    case 431: return "Request Header Fields Too Large";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    default: return "Error";
+  }
+}
+
+// HTTP/1.1 framing for EventLoopServer: parses every complete (pipelined)
+// request in 'in', hands each to 'dispatch', and appends the responses to
+// 'out' in order. Keep-alive is the default, as HTTP/1.1 says. Bodies are
+// skipped, up to kMaxBodyBytes; a bigger one, or a chunked one, gets an error
+// and the connection closed, since we can't tell where it ends. Exceptions
+// from 'dispatch' become errors too, rather than taking the server down.
+bool serveHttpRequests(std::string& in, std::string& out,
+                       std::function<HttpResponse(HttpRequest const&)> const& dispatch)
+{
+  size_t constexpr kMaxHeaderBytes = 64 * 1024;
+  size_t constexpr kMaxBodyBytes = 1 << 20;
+  size_t consumed = 0;
+  bool keep_alive = true;
+  while (keep_alive)
+  {
+    size_t header_end = in.find("\r\n\r\n", consumed);
+    if (header_end == std::string::npos)
+    {
+      if (in.size() - consumed > kMaxHeaderBytes)
+      {
+        out += "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\n"
+               "Connection: close\r\n\r\n";
+        keep_alive = false;
+      }
+      break;
+    }
+    std::string_view head(in.data() + consumed, header_end - consumed);
+    size_t line_end = std::min(head.find("\r\n"), head.size());
+    std::string_view request_line = head.substr(0, line_end);
+    size_t first_space = request_line.find(' ');
+    size_t second_space = request_line.rfind(' ');
+    HttpRequest request;
+    std::string_view target, version;
+    bool malformed = first_space == std::string_view::npos || second_space <= first_space;
+    if (!malformed)
+    {
+      request.method = request_line.substr(0, first_space);
+      target = request_line.substr(first_space + 1, second_space - first_space - 1);
+      version = request_line.substr(second_space + 1);
+    }
+
+    size_t content_length = 0;
+    std::string connection_header;
+    std::optional<HttpResponse> rejected;
+    for (size_t pos = line_end + 2; pos < head.size(); )
+    {
+      size_t next = std::min(head.find("\r\n", pos), head.size());
+      std::string_view line = head.substr(pos, next - pos);
+      pos = next + 2;
+      size_t colon = line.find(':');
+      if (colon == std::string_view::npos)
+        continue;
+      std::string name(line.substr(0, colon));
+      std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+      std::string_view value = line.substr(colon + 1);
+      while (!value.empty() && value[0] == ' ')
+        value.remove_prefix(1);
+      while (!value.empty() && value.back() == ' ')
+        value.remove_suffix(1);
+      if (name == "content-length")
+      {
+        auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), content_length);
+        if (ec != std::errc() || end != value.data() + value.size())
+          rejected = HttpResponse{400, "{\"error\":\"bad Content-Length\"}"};
+        else if (content_length > kMaxBodyBytes)
+          rejected = HttpResponse{413, "{\"error\":\"request body too large\"}"};
+      }
+      else if (name == "transfer-encoding")
+        rejected = HttpResponse{501, "{\"error\":\"Transfer-Encoding isn't supported\"}"};
+      else if (name == "connection")
+      {
+        connection_header = value;
+        std::transform(connection_header.begin(), connection_header.end(),
+                       connection_header.begin(), ::tolower);
+      }
+    }
+    if (!rejected && in.size() - header_end - 4 < content_length)
+      break; // body not here yet; we don't use bodies, but must skip them
+    consumed = header_end + 4 + (rejected ? 0 : content_length);
+    keep_alive = version == "HTTP/1.1" ? connection_header != "close"
+                                       : connection_header == "keep-alive";
+
+    HttpResponse response;
+    if (rejected)
+    {
+      response = *rejected;
+      keep_alive = false;
+    }
+    else if (malformed)
+    {
+      response = HttpResponse{400, "{\"error\":\"malformed request line\"}"};
+      keep_alive = false;
+    }
+    else
+    {
+      size_t question = target.find('?');
+      request.path = urlDecode(target.substr(0, question));
+      if (question != std::string_view::npos)
+      {
+        std::string_view query = target.substr(question + 1);
+        while (!query.empty())
+        {
+          size_t amp = std::min(query.find('&'), query.size());
+          std::string_view pair = query.substr(0, amp);
+          size_t eq = pair.find('=');
+          if (eq == std::string_view::npos)
+            request.params[urlDecode(pair)] = "";
+          else
+            request.params[urlDecode(pair.substr(0, eq))] = urlDecode(pair.substr(eq + 1));
+          query.remove_prefix(std::min(amp + 1, query.size()));
+        }
+      }
+      try
+      {
+        response = dispatch(request);
+      }
+      catch (nlohmann::json::exception const& e)
+      {
+        // e.g. a parameter that isn't UTF-8 couldn't be echoed back
+        response = HttpResponse{400, "{\"error\":\"bad request\"}"};
+      }
+      catch (std::exception const& e)
+      {
+        response = HttpResponse{500, "{\"error\":\"internal error\"}"};
+      }
+    }
+    out += "HTTP/1.1 " + std::to_string(response.status) + " " + httpReason(response.status) +
+           "\r\nContent-Type: " + response.content_type +
+           "\r\nContent-Length: " + std::to_string(response.body.size()) +
+           (keep_alive ? "\r\n\r\n" : "\r\nConnection: close\r\n\r\n");
+    out += response.body;
+  }
+  in.erase(0, consumed);
+  return keep_alive;
+}
+
+// ================= END network serving ======================================
+
+void printRouteLongNames(nlohmann::json routes_json)
+{
+  std::cout << "The 'long name' of each route in the MBTA subway system:" << std::endl;
+  for (auto const& item : routes_json["data"])
+    std::cout << item["attributes"]["long_name"].get<std::string>() << std::endl;
+  std::cout << std::endl;
+}
+
+std::vector<std::string> getRouteIDs(nlohmann::json routes_json)
+{
+  std::vector<std::string> ret;
+  for (auto const& item : routes_json["data"])
+    ret.push_back(item["id"].get<std::string>());
+  return ret;
+}
+
+// Degrees; NaN if we weren't told.
+struct GeoPoint
+{
+  double lat = NAN;
+  double lon = NAN;
+
+  bool known() const { return !std::isnan(lat) && !std::isnan(lon); }
+};
+
+double constexpr kEarthRadiusMeters = 6371008.8;
+
+// Great-circle distance, by the haversine formula. NaN if either is unknown.
+double haversineMeters(GeoPoint a, GeoPoint b)
+{
+  if (!a.known() || !b.known())
+    return NAN;
+  double constexpr kRadians = std::numbers::pi / 180;
+  double dlat = (b.lat - a.lat) * kRadians, dlon = (b.lon - a.lon) * kRadians;
+  double h = std::sin(dlat / 2) * std::sin(dlat / 2) +
+             std::cos(a.lat * kRadians) * std::cos(b.lat * kRadians) * std::sin(dlon / 2) * std::sin(dlon / 2);
+  return 2 * kEarthRadiusMeters * std::asin(std::min(1.0, std::sqrt(h)));
+}
+
+// Everything is keyed on the MBTA's canonical stop IDs (e.g. place-dwnxg for
+// Downtown Crossing), not display names: once buses are loaded, lots of
+// unrelated stops share a name ("Massachusetts Ave @ Beacon St" on both sides
+// of the street, say), and keying on names silently merged them. Names only
+// show up at the edges - resolving what a human typed, and printing results.
+//
+// Stops can also be platforms/child stops of a parent station (the bus stop
+// outside Harvard is a child of place-harsq). The planner works at station
+// granularity, so a child stop is folded into its parent station; that's what
+// lets you transfer between a bus and the subway at the same station.
+struct StopInfo
+{
+  std::string id;
+  std::string name;
+  std::string parent_id; // empty if this stop has no parent station
+  std::string parent_name; // if the response included the parent resource
+  // Where the station is: the parent's location if the response included
+  // it, else this stop's own.
+  GeoPoint location;
+};
+
+// Expects a stops response that asked for include=parent_station (though it
+// copes without), so that parent station names come along too.
+std::vector<StopInfo> getStops(nlohmann::json stops_json)
+{
+  ScopedPhase phase("getStops", "extract");
+  auto location = [](nlohmann::json const& attributes)
+  {
+    GeoPoint ret;
+    auto lat = attributes.find("latitude"), lon = attributes.find("longitude");
+    if (lat != attributes.end() && lat->is_number() && lon != attributes.end() && lon->is_number())
+      ret = GeoPoint{lat->get<double>(), lon->get<double>()};
+    return ret;
+  };
+  std::unordered_map<std::string, std::pair<std::string, GeoPoint>> included;
+  if (stops_json.contains("included"))
+    for (auto const& item : stops_json["included"])
+      included[item["id"].get<std::string>()] = {item["attributes"]["name"].get<std::string>(),
+                                                 location(item["attributes"])};
+
+  std::vector<StopInfo> ret;
+  for (auto const& item : stops_json["data"])
+  {
+    StopInfo info;
+    info.id = item["id"].get<std::string>();
+    info.name = item["attributes"]["name"].get<std::string>();
+    info.location = location(item["attributes"]);
+    if (item.contains("relationships") && item["relationships"].contains("parent_station") &&
+        item["relationships"]["parent_station"]["data"].is_object())
+    {
+      info.parent_id = item["relationships"]["parent_station"]["data"]["id"].get<std::string>();
+      auto it = included.find(info.parent_id);
+      if (it != included.end())
+      {
+        info.parent_name = it->second.first;
+        if (it->second.second.known())
+          info.location = it->second.second;
+      }
+    }
+    ret.push_back(info);
+  }
+  return ret;
+}
+
+using StopID = uint32_t;
+using RouteID = uint16_t;
+
+// The network as the planner sees it: stops and routes interned to small
+// integers, with adjacency and route membership stored as flat CSR arrays
+// rather than a map of strings per stop. That's what keeps the all-modes
+// network (thousands of stops, hundreds of routes) small and cache-friendly.
+// Built once by TopologyBuilder, then immutable.
+//
+// A StopID is a station: a parent station, or a stop that has no parent. Child
+// stops/platforms aren't nodes of their own; they map to their station.
+struct Topology
+{
+  std::vector<std::string> stop_ids; // canonical ID, indexed by StopID
+  std::vector<std::string> stop_names; // display name, indexed by StopID
+  std::vector<GeoPoint> stop_locations; // indexed by StopID (unknown for old snapshots)
+  std::unordered_map<std::string, StopID> stop_of_id; // canonical ID -> StopID
+  // display name -> every station with that name (usually just one).
+  std::unordered_map<std::string, std::vector<StopID>> stops_named;
+  // child stop/platform ID -> its parent station, and the reverse.
+  std::unordered_map<std::string, StopID> station_of_child;
+  std::vector<std::vector<std::string>> children_of_stop; // indexed by StopID
+  // Sorted by name, so "lowest RouteID" means the same thing as the old
+  // "first in a std::set<std::string>" tie-break did.
+  std::vector<std::string> route_names; // indexed by RouteID
+  // the stops of each route, in the order the API lists them.
+  std::vector<std::vector<StopID>> route_stops;
+
+  // neighbors of s are adjacency[adjacency_offsets[s] .. adjacency_offsets[s+1]).
+  std::vector<uint32_t> adjacency_offsets;
+  std::vector<StopID> adjacency;
+  // routes serving s (sorted) are stop_routes[route_offsets[s] .. route_offsets[s+1]).
+  std::vector<uint32_t> route_offsets;
+  std::vector<RouteID> stop_routes;
+
+  size_t numStops() const { return stop_names.size(); }
+  size_t numRoutes() const { return route_names.size(); }
+
+  std::span<StopID const> neighbors(StopID s) const
+  {
+    return std::span<StopID const>(adjacency.data() + adjacency_offsets[s],
+                                   adjacency.data() + adjacency_offsets[s + 1]);
+  }
+  std::span<RouteID const> routesOf(StopID s) const
+  {
+    return std::span<RouteID const>(stop_routes.data() + route_offsets[s],
+                                    stop_routes.data() + route_offsets[s + 1]);
+  }
+
+  // Resolves a canonical station ID, child stop ID, or (unambiguous) display
+  // name. For an ambiguous name, returns nullopt and fills 'ambiguous_with'.
+  std::optional<StopID> resolve(std::string const& key,
+                                std::vector<StopID>* ambiguous_with = nullptr) const
+  {
+    if (auto it = stop_of_id.find(key); it != stop_of_id.end())
+      return it->second;
+    if (auto it = station_of_child.find(key); it != station_of_child.end())
+      return it->second;
+    if (auto it = stops_named.find(key); it != stops_named.end())
+    {
+      if (it->second.size() == 1)
+        return it->second.front();
+      if (ambiguous_with)
+        *ambiguous_with = it->second;
+    }
+    return std::nullopt;
+  }
+
+  // The display name, plus the canonical ID if some other station shares the name.
+  std::string displayName(StopID s) const
+  {
+    if (stops_named.at(stop_names[s]).size() > 1)
+      return stop_names[s] + " [" + stop_ids[s] + "]";
+    return stop_names[s];
+  }
+};
+
+class TopologyBuilder
+{
+public:
+  // Routes should be added in API order; stops in their order along the route.
+  void addRoute(std::string route_name, std::vector<StopInfo> stops)
+  {
+    routes_.emplace_back(std::move(route_name), std::move(stops));
+  }
+
+  Topology build()
+  {
+    ScopedPhase phase("build topology");
+    MemoryScope memory(MemTag::kTopology);
+    Topology topo;
+    std::vector<size_t> by_name(routes_.size());
+    for (size_t i = 0; i < by_name.size(); i++)
+      by_name[i] = i;
+    std::sort(by_name.begin(), by_name.end(), [&](size_t a, size_t b)
+              { return routes_[a].first < routes_[b].first; });
+    std::vector<RouteID> route_id_of(routes_.size());
+    for (size_t i = 0; i < by_name.size(); i++)
+    {
+      route_id_of[by_name[i]] = i;
+      topo.route_names.push_back(routes_[by_name[i]].first);
+    }
+    topo.route_stops.resize(routes_.size());
+
+    // Edges are kept in discovery order (route by route, previous stop then
+    // next stop) because that order is what BFS tie-breaks on.
+    std::vector<std::vector<StopID>> adjacency_lists;
+    std::vector<std::vector<RouteID>> routes_of_stop;
+    // A station's own resource (or an included parent) names it authoritatively;
+    // a child stop whose parent wasn't included only lends it a placeholder name.
+    std::vector<bool> name_is_authoritative;
+    auto intern = [&](StopInfo const& stop)
+    {
+      bool is_child = !stop.parent_id.empty();
+      std::string const& id = is_child ? stop.parent_id : stop.id;
+      std::string const& name = !is_child ? stop.name
+                              : !stop.parent_name.empty() ? stop.parent_name : stop.name;
+      bool authoritative = !is_child || !stop.parent_name.empty();
+      auto [it, inserted] = topo.stop_of_id.emplace(id, topo.stop_ids.size());
+      StopID station = it->second;
+      if (inserted)
+      {
+        topo.stop_ids.push_back(id);
+        topo.stop_names.push_back(name);
+        topo.stop_locations.push_back(stop.location);
+        topo.children_of_stop.emplace_back();
+        name_is_authoritative.push_back(authoritative);
+        adjacency_lists.emplace_back();
+        routes_of_stop.emplace_back();
+      }
+      else if (authoritative && !name_is_authoritative[station])
+      {
+        topo.stop_names[station] = name;
+        if (stop.location.known())
+          topo.stop_locations[station] = stop.location;
+        name_is_authoritative[station] = true;
+      }
+      if (!topo.stop_locations[station].known())
+        topo.stop_locations[station] = stop.location;
+      if (is_child && topo.station_of_child.emplace(stop.id, station).second)
+        topo.children_of_stop[station].push_back(stop.id);
+      return station;
+    };
+    auto addEdge = [&](StopID from, StopID to)
+    {
+      auto& list = adjacency_lists[from];
+      if (std::find(list.begin(), list.end(), to) == list.end())
+        list.push_back(to);
+    };
+    for (size_t r = 0; r < routes_.size(); r++)
+    {
+      std::vector<StopID>& stops = topo.route_stops[route_id_of[r]];
+      for (StopInfo const& stop : routes_[r].second)
+      {
+        StopID station = intern(stop);
+        // two platforms of one station in a row shouldn't become a self-loop.
+        if (stops.empty() || stops.back() != station)
+          stops.push_back(station);
+      }
+      for (size_t i = 0; i < stops.size(); i++)
+      {
+        routes_of_stop[stops[i]].push_back(route_id_of[r]);
+        if (i > 0)
+          addEdge(stops[i], stops[i-1]);
+        if (i + 1 < stops.size())
+          addEdge(stops[i], stops[i+1]);
+      }
+    }
+    routes_.clear();
+    for (StopID s = 0; s < topo.numStops(); s++)
+      topo.stops_named[topo.stop_names[s]].push_back(s);
+
+    topo.adjacency_offsets.push_back(0);
+    topo.route_offsets.push_back(0);
+    for (StopID s = 0; s < topo.numStops(); s++)
+    {
+      topo.adjacency.insert(topo.adjacency.end(),
+                            adjacency_lists[s].begin(), adjacency_lists[s].end());
+      topo.adjacency_offsets.push_back(topo.adjacency.size());
+      std::vector<RouteID>& routes = routes_of_stop[s];
+      std::sort(routes.begin(), routes.end());
+      routes.erase(std::unique(routes.begin(), routes.end()), routes.end());
+      topo.stop_routes.insert(topo.stop_routes.end(), routes.begin(), routes.end());
+      topo.route_offsets.push_back(topo.stop_routes.size());
+    }
+    topo.adjacency.shrink_to_fit();
+    topo.stop_routes.shrink_to_fit();
+    return topo;
+  }
+
+private:
+  std::vector<std::pair<std::string, std::vector<StopInfo>>> routes_;
+};
+
+// FNV-1a over everything that determines planning answers, so precomputed
+// artifacts built from one topology are never used with another.
+uint64_t topologyFingerprint(Topology const& topo)
+{
+  uint64_t hash = 14695981039346656037ull;
+  auto mix = [&](void const* data, size_t len)
+  {
+    for (size_t i = 0; i < len; i++)
+    {
+      hash ^= ((uint8_t const*)data)[i];
+      hash *= 1099511628211ull;
+    }
+  };
+  for (auto const* strings : {&topo.stop_ids, &topo.route_names})
+    for (std::string const& s : *strings)
+      mix(s.c_str(), s.size() + 1);
+  mix(topo.adjacency_offsets.data(), topo.adjacency_offsets.size() * sizeof(uint32_t));
+  mix(topo.adjacency.data(), topo.adjacency.size() * sizeof(StopID));
+  mix(topo.route_offsets.data(), topo.route_offsets.size() * sizeof(uint32_t));
+  mix(topo.stop_routes.data(), topo.stop_routes.size() * sizeof(RouteID));
+  return hash;
+}
+
+// Every (src, dst) answer precomputed, in 4 bytes a pair, so that a query is
+// a walk of O(transfers) array reads with no search at all. Per pair:
+//  - next_hop: which of src's neighbors is the next stop toward dst (u8
+//    index into topo.neighbors(src))
+//  - leg_route: the route to ride from src (u8 RouteID)
+//  - leg_next: the stop where that leg ends and the next one starts (u16
+//    StopID), or kLastLeg if it goes all the way to dst
+// The paths come from one BFS tree per destination, so the path from any
+// stop on src's path is the rest of src's path. That makes "the leg starting
+// at leg_next" exactly what greedilyStayOnRoute() would pick there, so
+// following leg_next from src reproduces the whole greedy route assignment.
+// (Ties between equally short paths can break differently than in
+// planRoute()'s forward BFS, so the answer can differ in which lines - never
+// in the number of stops.)
+//
+// Arrays are stored [dst][src]: a build writes one contiguous column per
+// destination, and a query reads within one column. The file format is that
+// same image behind a 32 byte header, so loading is a single mmap. For the
+// full network (~8000 stations) that's ~256 MB, paged in on demand.
+class NextHopMatrix
+{
+public:
+  static uint16_t constexpr kLastLeg = UINT16_MAX;
+  static uint8_t constexpr kNone = UINT8_MAX;
+
+  NextHopMatrix(NextHopMatrix const&) = delete;
+  NextHopMatrix& operator=(NextHopMatrix const&) = delete;
+
+  // nullptr (and *error) if this topology doesn't fit the compact encoding.
+  static std::unique_ptr<NextHopMatrix> build(Topology const& topo, int threads, std::string* error)
+  {
+    size_t n = topo.numStops();
+    if (n >= kLastLeg || topo.numRoutes() >= kNone)
+    {
+      *error = "too many stops or routes for the 16/8 bit next-hop matrix encoding";
+      return nullptr;
+    }
+    for (StopID s = 0; s < n; s++)
+      if (topo.neighbors(s).size() >= kNone)
+      {
+        *error = topo.stop_ids[s] + " has too many neighbors for the next-hop matrix";
+        return nullptr;
+      }
+
+    std::unique_ptr<NextHopMatrix> matrix(new NextHopMatrix);
+    matrix->owned_.resize(sizeof(Header) + 4 * n * n);
+    Header header{};
+    memcpy(header.magic, kMagic, sizeof(header.magic));
+    header.format_version = kFormatVersion;
+    header.num_stops = n;
+    header.num_routes = topo.numRoutes();
+    header.fingerprint = topologyFingerprint(topo);
+    memcpy(matrix->owned_.data(), &header, sizeof(header));
+    matrix->setPointers(matrix->owned_.data());
+
+    uint8_t* next_hop = const_cast<uint8_t*>(matrix->next_hop_);
+    uint8_t* leg_route = const_cast<uint8_t*>(matrix->leg_route_);
+    uint16_t* leg_next = const_cast<uint16_t*>(matrix->leg_next_);
+    parallelFor(n, threads, [&](size_t dst)
+    {
+      // BFS out from dst. The graph is symmetric, so toward[v] - the stop v
+      // was discovered from - is v's next hop toward dst.
+      static thread_local std::vector<StopID> toward, queue;
+      static thread_local std::vector<RouteID> candidates, narrowed;
+      toward.assign(n, UINT32_MAX);
+      queue.clear();
+      queue.push_back(dst);
+      toward[dst] = dst;
+      for (size_t head = 0; head < queue.size(); head++)
+        for (StopID neighbor : topo.neighbors(queue[head]))
+          if (toward[neighbor] == UINT32_MAX)
+          {
+            toward[neighbor] = queue[head];
+            queue.push_back(neighbor);
+          }
+
+      uint8_t* column_hop = next_hop + dst * n;
+      uint8_t* column_route = leg_route + dst * n;
+      uint16_t* column_next = leg_next + dst * n;
+      std::fill(column_hop, column_hop + n, kNone);
+      std::fill(column_route, column_route + n, kNone);
+      std::fill(column_next, column_next + n, kLastLeg);
+      // A path can run out of common lines right at dst, and then its last
+      // leg starts there, on dst's first line, as in greedilyStayOnRoute().
+      column_route[dst] = topo.routesOf(dst).front();
+      for (StopID src : queue)
+      {
+        if (src == dst)
+          continue;
+        std::span<StopID const> neighbors = topo.neighbors(src);
+        column_hop[src] = std::find(neighbors.begin(), neighbors.end(), toward[src]) - neighbors.begin();
+        // greedilyStayOnRoute(), along the tree path.
+        std::span<RouteID const> first = topo.routesOf(src);
+        candidates.assign(first.begin(), first.end());
+        for (StopID cur = src; cur != dst; cur = toward[cur])
+        {
+          std::span<RouteID const> here = topo.routesOf(toward[cur]);
+          narrowed.clear();
+          std::set_intersection(candidates.begin(), candidates.end(), here.begin(), here.end(),
+                                std::back_inserter(narrowed));
+          if (narrowed.empty())
+          {
+            column_next[src] = toward[cur];
+            break;
+          }
+          candidates.swap(narrowed);
+        }
+        column_route[src] = candidates.front();
+      }
+    });
+    return matrix;
+  }
+
+  // Maps a file written by save(). nullptr (and *error) if it's missing,
+  // malformed, or was built from a different topology.
+  static std::unique_ptr<NextHopMatrix> load(std::string const& path, Topology const& topo,
+                                             std::string* error)
+  {
+    std::unique_ptr<MappedFile> mapped = MappedFile::open(path, error);
+    if (!mapped)
+      return nullptr;
+    size_t n = topo.numStops();
+    Header header;
+    if (mapped->size() != sizeof(Header) + 4 * n * n)
+    {
+      *error = path + " is the wrong size for this topology";
+      return nullptr;
+    }
+    memcpy(&header, mapped->data(), sizeof(header));
+    if (memcmp(header.magic, kMagic, sizeof(header.magic)) != 0 ||
+        header.format_version != kFormatVersion || header.num_stops != n ||
+        header.num_routes != topo.numRoutes() || header.fingerprint != topologyFingerprint(topo))
+    {
+      *error = path + " was built from a different topology (or isn't a next-hop matrix)";
+      return nullptr;
+    }
+    std::unique_ptr<NextHopMatrix> matrix(new NextHopMatrix);
+    matrix->mapped_ = std::move(mapped);
+    matrix->setPointers(matrix->mapped_->data());
+    if (!matrix->wellFormed(topo))
+    {
+      *error = path + " is corrupt";
+      return nullptr;
+    }
+    return matrix;
+  }
+
+  bool save(std::string const& path) const
+  {
+    if (mapped_)
+      return writeFileAtomically(path, mapped_->data(), mapped_->size());
+    return writeFileAtomically(path, owned_.data(), owned_.size());
+  }
+
+  size_t bytes() const { return mapped_ ? mapped_->size() : owned_.size(); }
+
+  bool plan(Topology const& topo, StopID src, StopID dst, std::vector<RouteID>* routes,
+            std::vector<StopID>* path = nullptr) const
+  {
+    routes->clear();
+    size_t column = (size_t)dst * n_;
+    if (src != dst && next_hop_[column + src] == kNone)
+      return false;
+    if (src != dst)
+      for (StopID cur = src; cur != kLastLeg; cur = leg_next_[column + cur])
+        routes->push_back(leg_route_[column + cur]);
+    if (path)
+    {
+      path->clear();
+      path->push_back(src);
+      for (StopID cur = src; cur != dst; )
+      {
+        cur = topo.neighbors(cur)[next_hop_[column + cur]];
+        path->push_back(cur);
+      }
+    }
+    return true;
+  }
+
+private:
+  static constexpr char kMagic[8] = {'M', 'B', 'T', 'A', 'N', 'H', 'M', 'X'};
+  static uint32_t constexpr kFormatVersion = 2; // 2: leg_route is set at dst
+  struct Header
+  {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t num_stops;
+    uint32_t num_routes;
+    uint32_t reserved;
+    uint64_t fingerprint;
+  };
+  static_assert(sizeof(Header) == 32);
+
+  NextHopMatrix() = default;
+
+  // Whether plan() can trust every entry it might read: each next hop is one
+  // of the stop's neighbors, each leg's line exists, and every chain of hops
+  // reaches dst (and every chain of legs runs out) without looping. The
+  // fingerprint only says which topology a file is for, not that it survived
+  // being written, so load() checks this. Linear in the file: each column's
+  // chains are walked once, remembering which stops are known good.
+  bool wellFormed(Topology const& topo) const
+  {
+    enum : uint8_t { kUnseen, kOnWalk, kGood };
+    std::vector<uint8_t> hop_state(n_), leg_state(n_);
+    for (size_t dst = 0; dst < n_; dst++)
+    {
+      size_t column = dst * n_;
+      auto reachable = [&](size_t s) { return s == dst || next_hop_[column + s] != kNone; };
+      std::fill(hop_state.begin(), hop_state.end(), kUnseen);
+      std::fill(leg_state.begin(), leg_state.end(), kUnseen);
+      hop_state[dst] = kGood;
+      for (StopID src = 0; src < n_; src++)
+      {
+        if (!reachable(src))
+          continue;
+        if (leg_route_[column + src] >= topo.numRoutes())
+          return false;
+
+        StopID cur = src;
+        while (hop_state[cur] == kUnseen)
+        {
+          hop_state[cur] = kOnWalk;
+          uint8_t hop = next_hop_[column + cur];
+          if (hop == kNone || hop >= topo.neighbors(cur).size())
+            return false;
+          cur = topo.neighbors(cur)[hop];
+        }
+        if (hop_state[cur] == kOnWalk)
+          return false; // a cycle
+        for (cur = src; hop_state[cur] == kOnWalk; cur = topo.neighbors(cur)[next_hop_[column + cur]])
+          hop_state[cur] = kGood;
+
+        uint32_t leg = src;
+        while (leg != kLastLeg && leg_state[leg] == kUnseen)
+        {
+          leg_state[leg] = kOnWalk;
+          uint16_t next = leg_next_[column + leg];
+          if (next != kLastLeg && (next >= n_ || !reachable(next)))
+            return false;
+          leg = next;
+        }
+        if (leg != kLastLeg && leg_state[leg] == kOnWalk)
+          return false;
+        for (leg = src; leg != kLastLeg && leg_state[leg] == kOnWalk; leg = leg_next_[column + leg])
+          leg_state[leg] = kGood;
+      }
+    }
+    return true;
+  }
+
+  void setPointers(uint8_t const* image)
+  {
+    Header header;
+    memcpy(&header, image, sizeof(header));
+    n_ = header.num_stops;
+    next_hop_ = image + sizeof(Header);
+    leg_route_ = next_hop_ + n_ * n_;
+    leg_next_ = (uint16_t const*)(leg_route_ + n_ * n_); // 32 + 2n^2: always 2-aligned
+  }
+
+  size_t n_ = 0;
+  std::vector<uint8_t> owned_; // the file image, when built in-process
+  std::unique_ptr<MappedFile> mapped_; // or the mapped file
+  uint8_t const* next_hop_ = nullptr;
+  uint8_t const* leg_route_ = nullptr;
+  uint16_t const* leg_next_ = nullptr;
+};
+
+// Transfer patterns: for every origin, precomputed, the handful of ways worth
+// considering to reach each destination - as the sequence of stations where
+// you change lines, not the stops in between. A query then just prices those
+// few patterns with direct-connection lookups ("which line joins A and B, in
+// how few stops") and unpacks the winner along its lines.
+//
+// The patterns come from RAPTOR-style rounds over route_stops: round k finds
+// the fewest stops to everywhere using at most k rides, by riding every line
+// touched in round k-1 in both directions. A destination's Pareto set (every
+// round that improved it: more rides, fewer stops) is its set of optimal
+// patterns. Backtracking those gives each origin a DAG over (round, station)
+// nodes, which share prefixes; that DAG is what we store.
+//
+// Per origin, the DAG holds only stations some pattern boards a line at,
+// root (the origin) first and every node after its parent. A destination's
+// patterns are then the nodes its last ride can board at, one per pattern,
+// and destinations with the same ones share a copy. A sorted index maps runs
+// of consecutive destinations to their set; stops along one line mostly have
+// consecutive StopIDs and the same last boarding stations, so runs are long.
+// The file is a 32 byte header, then n+1 offsets into each of the nodes, the
+// sets and the index, then those three arrays. It answers with the fewest
+// lines among the shortest paths rather than whichever one a BFS happened to
+// find.
+class TransferPatterns
+{
+public:
+  TransferPatterns(TransferPatterns const&) = delete;
+  TransferPatterns& operator=(TransferPatterns const&) = delete;
+
+  static std::unique_ptr<TransferPatterns> build(Topology const& topo, int threads)
+  {
+    size_t n = topo.numStops();
+    std::vector<Block> blocks(n);
+    parallelFor(n, threads, [&](size_t origin) { blocks[origin] = patternsFrom(topo, origin); });
+
+    uint64_t num_nodes = 0, num_tails = 0, num_runs = 0;
+    for (Block const& block : blocks)
+    {
+      num_nodes += block.nodes.size();
+      num_tails += block.tails.size();
+      num_runs += block.runs.size();
+    }
+    std::unique_ptr<TransferPatterns> patterns(new TransferPatterns);
+    patterns->owned_.resize(sizeof(Header) + 24 * (n + 1) + sizeof(Node) * num_nodes +
+                            4 * num_tails + sizeof(Run) * num_runs);
+    uint8_t* image = patterns->owned_.data();
+    Header header{};
+    memcpy(header.magic, kMagic, sizeof(header.magic));
+    header.format_version = kFormatVersion;
+    header.num_stops = n;
+    header.num_routes = topo.numRoutes();
+    header.fingerprint = topologyFingerprint(topo);
+    memcpy(image, &header, sizeof(header));
+    uint64_t* node_offsets = (uint64_t*)(image + sizeof(Header));
+    uint64_t* tail_offsets = node_offsets + n + 1;
+    uint64_t* run_offsets = tail_offsets + n + 1;
+    Node* nodes = (Node*)(run_offsets + n + 1);
+    uint32_t* tails = (uint32_t*)(nodes + num_nodes);
+    Run* runs = (Run*)(tails + num_tails);
+    node_offsets[0] = tail_offsets[0] = run_offsets[0] = 0;
+    for (size_t origin = 0; origin < n; origin++)
+    {
+      Block& block = blocks[origin];
+      std::copy(block.nodes.begin(), block.nodes.end(), nodes + node_offsets[origin]);
+      std::copy(block.tails.begin(), block.tails.end(), tails + tail_offsets[origin]);
+      std::copy(block.runs.begin(), block.runs.end(), runs + run_offsets[origin]);
+      node_offsets[origin + 1] = node_offsets[origin] + block.nodes.size();
+      tail_offsets[origin + 1] = tail_offsets[origin] + block.tails.size();
+      run_offsets[origin + 1] = run_offsets[origin] + block.runs.size();
+      block = Block();
+    }
+    patterns->setPointers(image);
+    return patterns;
+  }
+
+  // Maps a file written by save(). nullptr (and *error) if it's missing,
+  // malformed, or was built from a different topology.
+  static std::unique_ptr<TransferPatterns> load(std::string const& path, Topology const& topo,
+                                                std::string* error)
+  {
+    std::unique_ptr<MappedFile> mapped = MappedFile::open(path, error);
+    if (!mapped)
+      return nullptr;
+    size_t n = topo.numStops();
+    size_t index_bytes = sizeof(Header) + 24 * (n + 1);
+    Header header;
+    if (mapped->size() < index_bytes)
+    {
+      *error = path + " is too short to be transfer patterns for this topology";
+      return nullptr;
+    }
+    memcpy(&header, mapped->data(), sizeof(header));
+    if (memcmp(header.magic, kMagic, sizeof(header.magic)) != 0 ||
+        header.format_version != kFormatVersion || header.num_stops != n ||
+        header.num_routes != topo.numRoutes() || header.fingerprint != topologyFingerprint(topo))
+    {
+      *error = path + " was built from a different topology (or isn't transfer patterns)";
+      return nullptr;
+    }
+    uint64_t num_nodes, num_tails, num_runs;
+    uint8_t const* offsets = mapped->data() + sizeof(Header);
+    memcpy(&num_nodes, offsets + 8 * n, 8);
+    memcpy(&num_tails, offsets + 8 * (n + 1) + 8 * n, 8);
+    memcpy(&num_runs, offsets + 16 * (n + 1) + 8 * n, 8);
+    if (num_nodes > mapped->size() || num_tails > mapped->size() || num_runs > mapped->size() ||
+        index_bytes + sizeof(Node) * num_nodes + 4 * num_tails + sizeof(Run) * num_runs != mapped->size())
+    {
+      *error = path + " is the wrong size for its node, pattern and index counts";
+      return nullptr;
+    }
+    std::unique_ptr<TransferPatterns> patterns(new TransferPatterns);
+    patterns->mapped_ = std::move(mapped);
+    patterns->setPointers(patterns->mapped_->data());
+    if (!patterns->wellFormed(topo))
+    {
+      *error = path + " is corrupt";
+      return nullptr;
+    }
+    return patterns;
+  }
+
+  bool save(std::string const& path) const
+  {
+    if (mapped_)
+      return writeFileAtomically(path, mapped_->data(), mapped_->size());
+    return writeFileAtomically(path, owned_.data(), owned_.size());
+  }
+
+  size_t bytes() const { return mapped_ ? mapped_->size() : owned_.size(); }
+
+  // Same contract as RoutePlanner::planRoute(). Of src's patterns to dst,
+  // takes the one with the fewest stops, then the fewest lines.
+  bool plan(Topology const& topo, StopID src, StopID dst, std::vector<RouteID>* routes,
+            std::vector<StopID>* path = nullptr) const
+  {
+    routes->clear();
+    if (path)
+      path->clear();
+    if (src == dst)
+    {
+      if (path)
+        path->push_back(src);
+      return true;
+    }
+    Node const* nodes = nodes_ + node_offsets_[src];
+    uint32_t const* tails = tails_ + tail_offsets_[src];
+    Run const* runs = runs_ + run_offsets_[src];
+    Run const* run = std::upper_bound(runs, runs + (run_offsets_[src + 1] - run_offsets_[src]), dst,
+                                      [](StopID dst, Run const& run) { return dst < run.first_dst; }) - 1;
+    if (run->num_tails == 0)
+      return false;
+
+    static thread_local std::vector<StopID> transfers;
+    static thread_local std::vector<Leg> legs, best_legs;
+    best_legs.clear();
+    uint32_t best_stops = UINT32_MAX;
+    for (uint32_t pattern = 0; pattern < run->num_tails; pattern++)
+    {
+      transfers.clear();
+      transfers.push_back(dst);
+      for (uint32_t node = tails[run->first_tail + pattern]; node != kNoNode; node = nodes[node].parent)
+        transfers.push_back(nodes[node].stop);
+      std::reverse(transfers.begin(), transfers.end());
+      legs.clear();
+      uint32_t stops = 0;
+      for (size_t i = 0; i + 1 < transfers.size(); i++)
+      {
+        Leg leg = directConnection(topo, transfers[i], transfers[i + 1]);
+        stops += std::max(leg.from, leg.to) - std::min(leg.from, leg.to);
+        legs.push_back(leg);
+      }
+      if (stops < best_stops || (stops == best_stops && legs.size() < best_legs.size()))
+      {
+        best_stops = stops;
+        best_legs.swap(legs);
+      }
+    }
+
+    if (path)
+      path->push_back(src);
+    for (Leg const& leg : best_legs)
+    {
+      if (routes->empty() || routes->back() != leg.route)
+        routes->push_back(leg.route);
+      if (path)
+      {
+        std::vector<StopID> const& line = topo.route_stops[leg.route];
+        int step = leg.to > leg.from ? 1 : -1;
+        for (uint32_t pos = leg.from; pos != leg.to; )
+        {
+          pos += step;
+          path->push_back(line[pos]);
+        }
+      }
+    }
+    return true;
+  }
+
+private:
+  static constexpr char kMagic[8] = {'M', 'B', 'T', 'A', 'T', 'P', 'A', 'T'};
+  static uint32_t constexpr kFormatVersion = 2; // 2: only transfer stations, and an index
+  static uint32_t constexpr kNoNode = UINT32_MAX;
+  struct Header
+  {
+    char magic[8];
+    uint32_t format_version;
+    uint32_t num_stops;
+    uint32_t num_routes;
+    uint32_t reserved;
+    uint64_t fingerprint;
+  };
+  static_assert(sizeof(Header) == 32);
+  // Indices are within the origin's block.
+  struct Node
+  {
+    uint32_t stop;
+    uint32_t parent; // the previous transfer station; kNoNode at the root
+  };
+  // Destinations first_dst up to the next run's get the patterns
+  // tails[first_tail, first_tail + num_tails); none if they're unreachable.
+  struct Run
+  {
+    uint32_t first_dst;
+    uint32_t first_tail;
+    uint32_t num_tails;
+  };
+  // One origin's share of the file, while building.
+  struct Block
+  {
+    std::vector<Node> nodes;
+    std::vector<uint32_t> tails;
+    std::vector<Run> runs;
+  };
+  // One ride: route_stops[route][from] to route_stops[route][to].
+  struct Leg
+  {
+    RouteID route;
+    uint32_t from, to;
+  };
+
+  TransferPatterns() = default;
+
+  // Whether plan() can follow everything: the offsets only grow, each DAG
+  // starts at its origin and every node's parent comes before it (so the
+  // walk back to the root ends), each index covers every destination in
+  // order, every pattern set is inside its block, and each ride a pattern
+  // implies - node to parent, last boarding station to destination - is
+  // along a line. The fingerprint only says which topology a file is for,
+  // not that it survived being written, so load() checks this too. It reads
+  // the whole file once, and checks every (destination, pattern) pair.
+  bool wellFormed(Topology const& topo) const
+  {
+    uint64_t n = topo.numStops();
+    if (node_offsets_[0] != 0 || tail_offsets_[0] != 0 || run_offsets_[0] != 0)
+      return false;
+    for (StopID origin = 0; origin < n; origin++)
+    {
+      if (node_offsets_[origin + 1] <= node_offsets_[origin] ||
+          tail_offsets_[origin + 1] < tail_offsets_[origin] ||
+          run_offsets_[origin + 1] <= run_offsets_[origin])
+        return false;
+      uint64_t num_nodes = node_offsets_[origin + 1] - node_offsets_[origin];
+      uint64_t num_tails = tail_offsets_[origin + 1] - tail_offsets_[origin];
+      uint64_t num_runs = run_offsets_[origin + 1] - run_offsets_[origin];
+      Node const* nodes = nodes_ + node_offsets_[origin];
+      uint32_t const* tails = tails_ + tail_offsets_[origin];
+      Run const* runs = runs_ + run_offsets_[origin];
+
+      if (nodes[0].stop != origin || nodes[0].parent != kNoNode)
+        return false;
+      for (uint64_t i = 1; i < num_nodes; i++)
+        if (nodes[i].stop >= n || nodes[i].parent >= i ||
+            !shareALine(topo, nodes[nodes[i].parent].stop, nodes[i].stop))
+          return false;
+      for (uint64_t i = 0; i < num_tails; i++)
+        if (tails[i] >= num_nodes)
+          return false;
+      if (runs[0].first_dst != 0)
+        return false;
+      for (uint64_t i = 0; i < num_runs; i++)
+      {
+        uint64_t end_dst = i + 1 < num_runs ? runs[i + 1].first_dst : n;
+        if (end_dst <= runs[i].first_dst || end_dst > n ||
+            (uint64_t)runs[i].first_tail + runs[i].num_tails > num_tails)
+          return false;
+        for (uint64_t dst = runs[i].first_dst; dst < end_dst; dst++)
+          for (uint32_t j = 0; dst != origin && j < runs[i].num_tails; j++)
+            if (!shareALine(topo, nodes[tails[runs[i].first_tail + j]].stop, dst))
+              return false;
+      }
+    }
+    return true;
+  }
+
+  void setPointers(uint8_t const* image)
+  {
+    Header header;
+    memcpy(&header, image, sizeof(header));
+    size_t n = header.num_stops;
+    node_offsets_ = (uint64_t const*)(image + sizeof(Header));
+    tail_offsets_ = node_offsets_ + n + 1;
+    run_offsets_ = tail_offsets_ + n + 1;
+    nodes_ = (Node const*)(run_offsets_ + n + 1);
+    tails_ = (uint32_t const*)(nodes_ + node_offsets_[n]);
+    runs_ = (Run const*)(tails_ + tail_offsets_[n]);
+  }
+
+  // Whether there's a ride from a to a different station b.
+  static bool shareALine(Topology const& topo, StopID a, StopID b)
+  {
+    std::span<RouteID const> routes_a = topo.routesOf(a), routes_b = topo.routesOf(b);
+    for (size_t i = 0, j = 0; a != b && i < routes_a.size() && j < routes_b.size(); )
+    {
+      if (routes_a[i] == routes_b[j])
+        return true;
+      routes_a[i] < routes_b[j] ? i++ : j++;
+    }
+    return false;
+  }
+
+  // The line joining a and b in the fewest stops (lowest RouteID on ties).
+  // The patterns only ever pair stations that share a line.
+  static Leg directConnection(Topology const& topo, StopID a, StopID b)
+  {
+    Leg best{0, 0, 0};
+    int64_t best_stops = INT64_MAX;
+    std::span<RouteID const> routes_a = topo.routesOf(a), routes_b = topo.routesOf(b);
+    for (size_t i = 0, j = 0; i < routes_a.size() && j < routes_b.size(); )
+    {
+      if (routes_a[i] != routes_b[j])
+      {
+        routes_a[i] < routes_b[j] ? i++ : j++;
+        continue;
+      }
+      // Closest pair of positions, in case the line visits a or b twice.
+      std::vector<StopID> const& line = topo.route_stops[routes_a[i]];
+      int64_t last_a = -1, last_b = -1;
+      for (size_t pos = 0; pos < line.size(); pos++)
+      {
+        if (line[pos] == a)
+          last_a = pos;
+        else if (line[pos] == b)
+          last_b = pos;
+        else
+          continue;
+        if (last_a >= 0 && last_b >= 0 && std::abs(last_a - last_b) < best_stops)
+        {
+          best_stops = std::abs(last_a - last_b);
+          best = Leg{routes_a[i], (uint32_t)last_a, (uint32_t)last_b};
+        }
+      }
+      i++, j++;
+    }
+    return best;
+  }
+
+  // One origin's block: the round-based search, then the DAG.
+  static Block patternsFrom(Topology const& topo, StopID origin)
+  {
+    size_t n = topo.numStops();
+    // Per round k: the fewest stops to each station using at most k rides,
+    // and where the k'th ride boarded, or kNoNode if round k didn't improve
+    // on round k-1 there.
+    static thread_local std::vector<std::vector<uint32_t>> best, board, node_of;
+    static thread_local std::vector<StopID> marked, next_marked;
+    static thread_local std::vector<RouteID> touched;
+    static thread_local std::vector<uint64_t> route_stamp;
+    static thread_local uint64_t stamp = 0;
+    route_stamp.resize(topo.numRoutes(), 0);
+
+    best.resize(std::max<size_t>(best.size(), 1));
+    board.resize(best.size());
+    best[0].assign(n, UINT32_MAX);
+    board[0].assign(n, kNoNode);
+    best[0][origin] = 0;
+    board[0][origin] = origin;
+    marked.assign(1, origin);
+    size_t rounds = 1;
+    for (size_t k = 1; !marked.empty(); k++, rounds++)
+    {
+      if (best.size() <= k)
+      {
+        best.emplace_back();
+        board.emplace_back();
+      }
+      best[k] = best[k - 1];
+      board[k].assign(n, kNoNode);
+      touched.clear();
+      stamp++;
+      for (StopID s : marked)
+        for (RouteID route : topo.routesOf(s))
+          if (route_stamp[route] != stamp)
+          {
+            route_stamp[route] = stamp;
+            touched.push_back(route);
+          }
+      next_marked.clear();
+      for (RouteID route : touched)
+      {
+        std::vector<StopID> const& line = topo.route_stops[route];
+        // Ride it both ways, boarding wherever round k-1 improved.
+        for (int reverse = 0; reverse < 2; reverse++)
+        {
+          int64_t boarded_cost = INT64_MAX; // best[k-1] at the boarding stop, minus its position
+          StopID boarded_at = 0;
+          for (size_t pos = 0; pos < line.size(); pos++)
+          {
+            StopID s = line[reverse ? line.size() - 1 - pos : pos];
+            if (boarded_cost != INT64_MAX && boarded_cost + (int64_t)pos < best[k][s])
+            {
+              if (board[k][s] == kNoNode)
+                next_marked.push_back(s);
+              best[k][s] = boarded_cost + pos;
+              board[k][s] = boarded_at;
+            }
+            if (board[k - 1][s] != kNoNode && (int64_t)best[k - 1][s] - (int64_t)pos < boarded_cost)
+            {
+              boarded_cost = (int64_t)best[k - 1][s] - (int64_t)pos;
+              boarded_at = s;
+            }
+          }
+        }
+      }
+      marked.swap(next_marked);
+    }
+    // (the last round improved nothing)
+    rounds--;
+
+    // The round in which s last improved, at or before round k.
+    auto improvedIn = [&](size_t k, StopID s)
+    {
+      while (k > 0 && board[k][s] == kNoNode)
+        k--;
+      return k;
+    };
+    Block block;
+    block.nodes.push_back(Node{origin, kNoNode});
+    node_of.resize(std::max(node_of.size(), rounds));
+    for (size_t k = 0; k < rounds; k++)
+      node_of[k].assign(n, kNoNode);
+    node_of[0][origin] = 0;
+    // The node where the ride reaching label (k, s) boards. Backtracks to the
+    // first label that's already a node, then adds the ones after it in
+    // order, so parents always come first.
+    static thread_local std::vector<std::pair<size_t, StopID>> chain;
+    auto boardingNode = [&](size_t k, StopID s)
+    {
+      chain.clear();
+      StopID at = board[k][s];
+      k = improvedIn(k - 1, at);
+      while (node_of[k][at] == kNoNode)
+      {
+        chain.emplace_back(k, at);
+        StopID boarded_at = board[k][at];
+        k = improvedIn(k - 1, boarded_at);
+        at = boarded_at;
+      }
+      uint32_t node = node_of[k][at];
+      for (size_t i = chain.size(); i-- > 0; )
+      {
+        uint32_t child = block.nodes.size();
+        block.nodes.push_back(Node{chain[i].second, node});
+        node_of[chain[i].first][chain[i].second] = child;
+        node = child;
+      }
+      return node;
+    };
+    // Each destination's patterns, fewest stops first, as the nodes where
+    // their last rides board. Identical sets are stored once, and runs of
+    // destinations with the same set share an index entry.
+    std::map<std::vector<uint32_t>, uint32_t> set_at;
+    std::vector<uint32_t> tails;
+    for (StopID dst = 0; dst < n; dst++)
+    {
+      tails.clear();
+      if (dst != origin && best[rounds - 1][dst] != UINT32_MAX)
+        for (size_t k = improvedIn(rounds - 1, dst); k > 0; k = improvedIn(k - 1, dst))
+          tails.push_back(boardingNode(k, dst));
+      uint32_t first_tail = 0;
+      if (!tails.empty())
+      {
+        auto [it, inserted] = set_at.emplace(tails, block.tails.size());
+        if (inserted)
+          block.tails.insert(block.tails.end(), tails.begin(), tails.end());
+        first_tail = it->second;
+      }
+      if (block.runs.empty() || block.runs.back().first_tail != first_tail ||
+          block.runs.back().num_tails != tails.size())
+        block.runs.push_back(Run{dst, first_tail, (uint32_t)tails.size()});
+    }
+    return block;
+  }
+
+  std::vector<uint8_t> owned_; // the file image, when built in-process
+  std::unique_ptr<MappedFile> mapped_; // or the mapped file
+  uint64_t const* node_offsets_ = nullptr; // n+1 per-origin offsets into each array
+  uint64_t const* tail_offsets_ = nullptr;
+  uint64_t const* run_offsets_ = nullptr;
+  Node const* nodes_ = nullptr;
+  uint32_t const* tails_ = nullptr;
+  Run const* runs_ = nullptr;
+};
+
+// Contraction hierarchy over the stop graph, with hop weights (we have no
+// travel times). Stops are contracted least-important first; contracting v
+// adds a shortcut u-w (of weight w(u,v) + w(v,w)) wherever that was the only
+// shortest way between two of its neighbors. A query then only ever climbs:
+// a bidirectional Dijkstra over upward arcs, which touches a few dozen stops
+// instead of a BFS's thousands, and unpacks shortcuts back into stops for
+// routesAlongPath().
+//
+// Preprocessing contracts an independent set (stops that beat all their
+// remaining neighbors on priority) per round, running the witness searches
+// for the whole set in parallel. Those searches avoid every stop in the set,
+// so two stops in one round can't each count on the other as the witness.
+// Hubs with too many neighbors aren't contracted at all, and once what's left
+// is only hubs or is dense on average, we stop and leave it as a core: arcs
+// within the core count as upward both ways, so queries just search it
+// plainly. That keeps the build to seconds even on graphs with no hierarchy.
+class ContractionHierarchy
+{
+public:
+  static std::unique_ptr<ContractionHierarchy> build(Topology const& topo, int threads)
+  {
+    size_t n = topo.numStops();
+    std::vector<std::vector<Arc>> graph(n);
+    for (StopID s = 0; s < n; s++)
+      for (StopID neighbor : topo.neighbors(s))
+        graph[s].push_back(Arc{neighbor, 1, kNoStop});
+
+    std::vector<uint32_t> rank(n, kNoStop);
+    std::vector<int32_t> priority(n), deleted_neighbors(n, 0);
+    std::vector<uint8_t> in_round(n, 0);
+    std::vector<StopID> remaining(n), round;
+    for (StopID s = 0; s < n; s++)
+      remaining[s] = s;
+    std::vector<std::vector<Arc>> shortcuts(n);
+    auto contracted = [&](StopID s) { return rank[s] != kNoStop; };
+    auto updatePriority = [&](StopID v)
+    {
+      size_t degree = 0;
+      for (Arc const& arc : graph[v])
+        degree += !contracted(arc.to);
+      if (degree > kMaxContractDegree)
+      {
+        priority[v] = INT32_MAX; // a hub; leave it for the core
+        return;
+      }
+      std::vector<Arc>& added = shortcuts[v];
+      findShortcuts(graph, rank, in_round, v, &added);
+      priority[v] = 2 * (int32_t)added.size() - (int32_t)degree + deleted_neighbors[v];
+      added.clear();
+    };
+    parallelFor(n, threads, [&](size_t v) { updatePriority(v); });
+
+    uint32_t next_rank = 0;
+    std::vector<uint8_t> in_core(n, 0);
+    while (!remaining.empty())
+    {
+      size_t remaining_arcs = 0;
+      for (StopID v : remaining)
+        for (Arc const& arc : graph[v])
+          remaining_arcs += !contracted(arc.to);
+      bool dense = remaining_arcs > kMaxCoreDegree * remaining.size();
+      round.clear();
+      for (StopID v : remaining)
+      {
+        if (dense || priority[v] == INT32_MAX)
+          continue;
+        bool smallest = true;
+        for (Arc const& arc : graph[v])
+          if (!contracted(arc.to) && std::make_pair(priority[arc.to], arc.to) < std::make_pair(priority[v], v))
+          {
+            smallest = false;
+            break;
+          }
+        if (smallest)
+          round.push_back(v);
+      }
+      if (round.empty())
+      {
+        for (StopID v : remaining)
+        {
+          rank[v] = next_rank++;
+          in_core[v] = 1;
+        }
+        break;
+      }
+      for (StopID v : round)
+        in_round[v] = 1;
+      parallelFor(round.size(), threads, [&](size_t i)
+                  { findShortcuts(graph, rank, in_round, round[i], &shortcuts[round[i]]); });
+
+      for (StopID v : round)
+      {
+        rank[v] = next_rank++;
+        for (Arc const& shortcut : shortcuts[v])
+        {
+          addArc(graph[shortcut.middle], Arc{shortcut.to, shortcut.weight, v});
+          addArc(graph[shortcut.to], Arc{shortcut.middle, shortcut.weight, v});
+        }
+        std::vector<Arc>().swap(shortcuts[v]);
+      }
+      // Their neighbors' neighborhoods just changed.
+      std::vector<StopID> affected;
+      for (StopID v : round)
+        for (Arc const& arc : graph[v])
+          if (!contracted(arc.to))
+          {
+            deleted_neighbors[arc.to]++;
+            affected.push_back(arc.to);
+          }
+      std::sort(affected.begin(), affected.end());
+      affected.erase(std::unique(affected.begin(), affected.end()), affected.end());
+      for (StopID v : round)
+        in_round[v] = 0;
+      parallelFor(affected.size(), threads, [&](size_t i) { updatePriority(affected[i]); });
+      std::erase_if(remaining, contracted);
+    }
+
+    std::unique_ptr<ContractionHierarchy> ch(new ContractionHierarchy);
+    ch->up_offsets_.push_back(0);
+    for (StopID s = 0; s < n; s++)
+    {
+      for (Arc const& arc : graph[s])
+        if (rank[arc.to] > rank[s] || (in_core[s] && in_core[arc.to]))
+          ch->up_arcs_.push_back(arc);
+      ch->up_offsets_.push_back(ch->up_arcs_.size());
+    }
+    ch->num_shortcuts_ = 0;
+    for (Arc const& arc : ch->up_arcs_)
+      ch->num_shortcuts_ += arc.middle != kNoStop;
+    return ch;
+  }
+
+  size_t numShortcuts() const { return num_shortcuts_; }
+  size_t bytes() const { return up_offsets_.size() * 4 + up_arcs_.size() * sizeof(Arc); }
+
+  // A shortest path from src to dst (both included), or false if there's none.
+  bool shortestPath(StopID src, StopID dst, std::vector<StopID>* path) const
+  {
+    path->clear();
+    size_t n = up_offsets_.size() - 1;
+    static thread_local Search forward, backward;
+    forward.start(n, src);
+    backward.start(n, dst);
+    uint32_t best = UINT32_MAX;
+    StopID meeting = kNoStop;
+    if (src == dst)
+      best = 0, meeting = src;
+    while (true)
+    {
+      Search* side = &forward;
+      if (forward.heap.empty() || (!backward.heap.empty() && backward.heap.front().first < forward.heap.front().first))
+        side = &backward;
+      if (side->heap.empty() || side->heap.front().first >= best)
+        break;
+      Search& other = side == &forward ? backward : forward;
+      std::pop_heap(side->heap.begin(), side->heap.end(), std::greater<>());
+      auto [dist, v] = side->heap.back();
+      side->heap.pop_back();
+      if (dist != side->dist[v])
+        continue; // stale
+      if (other.reached(v) && dist + other.dist[v] < best)
+      {
+        best = dist + other.dist[v];
+        meeting = v;
+      }
+      // Stall-on-demand: if a higher stop reaches v more cheaply, nothing
+      // past v on this side can be on a shortest path.
+      bool stalled = false;
+      for (Arc const& arc : upArcs(v))
+        if (side->reached(arc.to) && side->dist[arc.to] + arc.weight < dist)
+        {
+          stalled = true;
+          break;
+        }
+      if (stalled)
+        continue;
+      for (uint32_t i = up_offsets_[v]; i < up_offsets_[v + 1]; i++)
+        side->relax(up_arcs_[i].to, dist + up_arcs_[i].weight, v, i);
+    }
+    if (meeting == kNoStop)
+      return false;
+
+    // src .. meeting, then meeting .. dst, unpacking each arc.
+    std::vector<uint32_t> arcs;
+    for (StopID v = meeting; v != src; v = forward.parent[v])
+      arcs.push_back(forward.parent_arc[v]);
+    path->push_back(src);
+    StopID at = src;
+    for (size_t i = arcs.size(); i-- > 0; )
+    {
+      // up_arcs_[arcs[i]] goes from 'at' upward.
+      Arc const& arc = up_arcs_[arcs[i]];
+      unpack(at, arc.to, arc.middle, path);
+      at = arc.to;
+    }
+    for (StopID v = meeting; v != dst; v = backward.parent[v])
+    {
+      Arc const& arc = up_arcs_[backward.parent_arc[v]];
+      unpack(v, backward.parent[v], arc.middle, path);
+    }
+    return true;
+  }
+
+private:
+  static StopID constexpr kNoStop = UINT32_MAX;
+  static size_t constexpr kMaxCoreDegree = 16; // average, over what's left to contract
+  static size_t constexpr kMaxContractDegree = 64;
+  struct Arc
+  {
+    StopID to;
+    uint32_t weight;
+    StopID middle; // the stop this shortcut skips, or kNoStop for a real edge
+  };
+
+  // One direction of a query's search; dist is only valid where seen == epoch.
+  struct Search
+  {
+    std::vector<uint32_t> seen, dist, parent_arc;
+    std::vector<StopID> parent;
+    std::vector<std::pair<uint32_t, StopID>> heap; // min-heap on distance
+    uint32_t epoch = 0;
+
+    void start(size_t n, StopID origin)
+    {
+      if (seen.size() < n)
+      {
+        seen.assign(n, 0);
+        dist.resize(n);
+        parent_arc.resize(n);
+        parent.resize(n);
+        epoch = 0;
+      }
+      if (++epoch == 0)
+      {
+        std::fill(seen.begin(), seen.end(), 0);
+        epoch = 1;
+      }
+      heap.clear();
+      relax(origin, 0, kNoStop, 0);
+    }
+    bool reached(StopID s) const { return seen[s] == epoch; }
+    void relax(StopID s, uint32_t d, StopID from, uint32_t arc)
+    {
+      if (reached(s) && dist[s] <= d)
+        return;
+      seen[s] = epoch;
+      dist[s] = d;
+      parent[s] = from;
+      parent_arc[s] = arc;
+      heap.emplace_back(d, s);
+      std::push_heap(heap.begin(), heap.end(), std::greater<>());
+    }
+  };
+
+  ContractionHierarchy() = default;
+
+  std::span<Arc const> upArcs(StopID s) const
+  {
+    return std::span<Arc const>(up_arcs_.data() + up_offsets_[s], up_arcs_.data() + up_offsets_[s + 1]);
+  }
+
+  // Appends the stops after 'from', through 'to', of the arc between them.
+  void unpack(StopID from, StopID to, StopID middle, std::vector<StopID>* path) const
+  {
+    if (middle == kNoStop)
+    {
+      path->push_back(to);
+      return;
+    }
+    // The skipped stop was contracted before both ends, so both halves are
+    // among its upward arcs.
+    auto half = [&](StopID end)
+    {
+      for (Arc const& arc : upArcs(middle))
+        if (arc.to == end)
+          return arc.middle;
+      return kNoStop;
+    };
+    unpack(from, middle, half(from), path);
+    unpack(middle, to, half(to), path);
+  }
+
+  // If there's already an arc to arc.to, keeps the shorter of the two.
+  static void addArc(std::vector<Arc>& arcs, Arc arc)
+  {
+    for (Arc& existing : arcs)
+      if (existing.to == arc.to)
+      {
+        if (arc.weight < existing.weight)
+          existing = arc;
+        return;
+      }
+    arcs.push_back(arc);
+  }
+
+  // The shortcuts contracting v would need, as Arc{to, weight, middle = the
+  // other end}, once per unordered pair of neighbors. Witness searches are local Dijkstras that
+  // avoid v and the rest of this round; when one gives up early we just add
+  // the shortcut, which costs a little query speed but never correctness.
+  static void findShortcuts(std::vector<std::vector<Arc>> const& graph, std::vector<uint32_t> const& rank,
+                            std::vector<uint8_t> const& in_round, StopID v, std::vector<Arc>* shortcuts)
+  {
+    size_t constexpr kMaxScanned = 1000; // arcs, per witness search
+    static thread_local Search witness;
+    static thread_local std::vector<Arc> neighbors;
+    neighbors.clear();
+    for (Arc const& arc : graph[v])
+      if (rank[arc.to] == kNoStop)
+        neighbors.push_back(arc);
+    shortcuts->clear();
+    for (size_t i = 0; i < neighbors.size(); i++)
+    {
+      uint32_t limit = 0;
+      for (size_t j = i + 1; j < neighbors.size(); j++)
+        limit = std::max(limit, neighbors[i].weight + neighbors[j].weight);
+      if (limit == 0)
+        continue;
+      witness.start(graph.size(), neighbors[i].to);
+      for (size_t scanned = 0; !witness.heap.empty() && scanned < kMaxScanned; )
+      {
+        std::pop_heap(witness.heap.begin(), witness.heap.end(), std::greater<>());
+        auto [dist, u] = witness.heap.back();
+        witness.heap.pop_back();
+        if (dist != witness.dist[u])
+          continue;
+        if (dist >= limit)
+          break;
+        scanned += graph[u].size();
+        for (Arc const& arc : graph[u])
+          if (arc.to != v && rank[arc.to] == kNoStop && !in_round[arc.to])
+            witness.relax(arc.to, dist + arc.weight, u, 0);
+      }
+      for (size_t j = i + 1; j < neighbors.size(); j++)
+      {
+        uint32_t via_v = neighbors[i].weight + neighbors[j].weight;
+        if (!witness.reached(neighbors[j].to) || witness.dist[neighbors[j].to] > via_v)
+          shortcuts->push_back(Arc{neighbors[j].to, via_v, neighbors[i].to});
+      }
+    }
+  }
+
+  std::vector<uint32_t> up_offsets_;
+  std::vector<Arc> up_arcs_; // arcs to higher-ranked stops, CSR by stop
+  size_t num_shortcuts_ = 0;
+};
+
+// Per-thread buffers for a query, reused across queries so that the steady
+// state allocates nothing. Rather than clearing 'seen' each query, we bump
+// 'epoch' and treat any other stamp as unseen.
+struct SearchScratch
+{
+  std::vector<uint32_t> seen;
+  std::vector<StopID> parent;
+  std::vector<StopID> queue;
+  std::vector<StopID> path;
+  std::vector<RouteID> candidates;
+  std::vector<RouteID> new_candidates;
+  uint32_t epoch = 0;
+  // Search effort of the current query, for QueryStats; engines that don't
+  // know a number leave it 0.
+  uint32_t nodes_expanded = 0;
+  uint32_t path_stops = 0;
+  uint32_t greedy_iterations = 0;
+
+  void prepare(size_t num_stops)
+  {
+    if (seen.size() < num_stops)
+    {
+      seen.resize(num_stops, 0);
+      parent.resize(num_stops);
+      queue.reserve(num_stops);
+    }
+    if (++epoch == 0) // wrapped around; old stamps could now collide
+    {
+      std::fill(seen.begin(), seen.end(), 0);
+      epoch = 1;
+    }
+  }
+};
+
+SearchScratch& threadScratch()
+{
+  static thread_local SearchScratch scratch;
+  return scratch;
+}
+
+// --engine lines: plans on the graph of lines instead of the graph of stops.
+// Lines are the nodes, and two are adjacent if some station serves both.
+// There are only a few dozen lines (a few hundred with buses), so the
+// fewest-lines sequence between every pair of them is precomputed, and a
+// query just looks at each line through src against each line through dst
+// and reads off the best. Stops are only worked out when the caller wants a
+// path: the fewest stops that ride exactly that sequence of lines.
+//
+// This answers with the fewest transfers rather than the fewest stops, so it
+// can take a longer path than the other engines; --difftest leaves it out.
+class LineGraph
+{
+public:
+  static std::unique_ptr<LineGraph> build(Topology const& topo)
+  {
+    size_t r = topo.numRoutes();
+    std::unique_ptr<LineGraph> graph(new LineGraph);
+    graph->num_routes_ = r;
+    std::vector<uint8_t> adjacent(r * r, 0);
+    for (StopID s = 0; s < topo.numStops(); s++)
+      for (RouteID a : topo.routesOf(s))
+        for (RouteID b : topo.routesOf(s))
+          if (a != b)
+            adjacent[a * r + b] = 1;
+
+    // Adjacency is symmetric, so a BFS out of 'to' gives every line's next
+    // step toward it. Ties go to whichever line the BFS got to first.
+    graph->transfers_.assign(r * r, kUnreachable);
+    graph->next_line_.assign(r * r, 0);
+    std::vector<RouteID> queue;
+    for (RouteID to = 0; to < r; to++)
+    {
+      graph->transfers_[to * r + to] = 0;
+      graph->next_line_[to * r + to] = to;
+      queue.assign(1, to);
+      for (size_t head = 0; head < queue.size(); head++)
+      {
+        RouteID cur = queue[head];
+        for (RouteID line = 0; line < r; line++)
+          if (adjacent[cur * r + line] && graph->transfers_[line * r + to] == kUnreachable)
+          {
+            graph->transfers_[line * r + to] = graph->transfers_[cur * r + to] + 1;
+            graph->next_line_[line * r + to] = cur;
+            queue.push_back(line);
+          }
+      }
+    }
+    return graph;
+  }
+
+  size_t bytes() const { return transfers_.size() * sizeof(uint16_t) + next_line_.size() * sizeof(RouteID); }
+
+  // Same contract as RoutePlanner::planRoute(), except that 'routes' is a
+  // sequence with the fewest lines (the lowest RouteIDs among equals), and
+  // 'path' the fewest stops along it.
+  bool plan(Topology const& topo, StopID src, StopID dst, std::vector<RouteID>* routes,
+            std::vector<StopID>* path = nullptr) const
+  {
+    routes->clear();
+    if (path)
+      path->clear();
+    if (src == dst)
+    {
+      if (path)
+        path->push_back(src);
+      return true;
+    }
+    uint32_t best = kUnreachable;
+    RouteID from = 0, to = 0;
+    for (RouteID a : topo.routesOf(src))
+      for (RouteID b : topo.routesOf(dst))
+        if (transfers_[a * num_routes_ + b] < best)
+        {
+          best = transfers_[a * num_routes_ + b];
+          from = a;
+          to = b;
+        }
+    if (best == kUnreachable)
+      return false;
+    for (RouteID line = from; ; line = next_line_[line * num_routes_ + to])
+    {
+      routes->push_back(line);
+      if (line == to)
+        break;
+    }
+    if (path)
+      expand(topo, src, dst, *routes, path);
+    return true;
+  }
+
+private:
+  static uint16_t constexpr kUnreachable = UINT16_MAX;
+
+  LineGraph() = default;
+
+  // Fewest stops from src to dst riding 'lines' in order: a BFS over (stop,
+  // leg) where a ride moves to a neighbor on the current leg's line and a
+  // transfer moves on to the next leg at a stop that line serves, for free
+  // (so transfers go on the front of the queue).
+  static void expand(Topology const& topo, StopID src, StopID dst, std::vector<RouteID> const& lines,
+                     std::vector<StopID>* path)
+  {
+    struct Scratch
+    {
+      std::vector<uint32_t> seen; // == epoch, else 'stops' and 'parent' are stale
+      std::vector<uint32_t> stops;
+      std::vector<uint32_t> parent; // state we came from
+      std::deque<uint32_t> queue;
+      uint32_t epoch = 0;
+    };
+    static thread_local Scratch scratch;
+    size_t n = topo.numStops();
+    size_t states = n * lines.size();
+    if (scratch.seen.size() < states)
+    {
+      scratch.seen.assign(states, 0);
+      scratch.stops.resize(states);
+      scratch.parent.resize(states);
+      scratch.epoch = 0;
+    }
+    if (++scratch.epoch == 0)
+    {
+      std::fill(scratch.seen.begin(), scratch.seen.end(), 0);
+      scratch.epoch = 1;
+    }
+    auto serves = [&](StopID stop, RouteID line)
+    {
+      std::span<RouteID const> routes = topo.routesOf(stop);
+      return std::binary_search(routes.begin(), routes.end(), line);
+    };
+    auto relax = [&](uint32_t state, uint32_t stops, uint32_t from, bool front)
+    {
+      if (scratch.seen[state] == scratch.epoch && scratch.stops[state] <= stops)
+        return;
+      scratch.seen[state] = scratch.epoch;
+      scratch.stops[state] = stops;
+      scratch.parent[state] = from;
+      front ? scratch.queue.push_front(state) : scratch.queue.push_back(state);
+    };
+    uint32_t goal = (lines.size() - 1) * n + dst;
+    scratch.queue.clear();
+    relax(src, 0, src, false);
+    uint32_t expanded = 0;
+    while (!scratch.queue.empty())
+    {
+      uint32_t state = scratch.queue.front();
+      scratch.queue.pop_front();
+      if (state == goal)
+        break;
+      expanded++;
+      size_t leg = state / n;
+      StopID stop = state % n;
+      uint32_t stops = scratch.stops[state];
+      if (leg + 1 < lines.size() && serves(stop, lines[leg + 1]))
+        relax(state + n, stops, state, true);
+      for (StopID neighbor : topo.neighbors(stop))
+        if (serves(neighbor, lines[leg]))
+          relax(leg * n + neighbor, stops + 1, state, false);
+    }
+    if (scratch.seen[goal] != scratch.epoch)
+      crash("LineGraph: no way to ride its own line sequence");
+    for (uint32_t state = goal; ; state = scratch.parent[state])
+    {
+      if (path->empty() || path->back() != state % n)
+        path->push_back(state % n);
+      if (state == (uint32_t)src)
+        break;
+    }
+    std::reverse(path->begin(), path->end());
+    threadScratch().nodes_expanded = expanded;
+    threadScratch().path_stops = path->size();
+  }
+
+  size_t num_routes_ = 0;
+  std::vector<uint16_t> transfers_; // [from line * R + to line]: lines ridden - 1
+  std::vector<RouteID> next_line_; // [line * R + to line]: the line after it toward 'to line'
+};
+
+// --engine astar: shortest by distance rather than by stops. Edges weigh
+// the great-circle distance between their stations, and the search is A*
+// toward dst with the straight-line (great-circle) distance as its
+// heuristic. No ride between two stops is shorter than that, so the answer
+// is exact, and a search for somewhere across town hardly looks behind it -
+// far fewer stops than the BFS, which goes out in every direction at once.
+// Like LineGraph, it's out to minimize something else, so --difftest leaves
+// it out.
+class GeoAStar
+{
+public:
+  // nullptr (and *error) if any station has no location.
+  static std::unique_ptr<GeoAStar> build(Topology const& topo, std::string* error)
+  {
+    size_t n = topo.numStops();
+    std::unique_ptr<GeoAStar> astar(new GeoAStar);
+    astar->position_.resize(n);
+    for (StopID s = 0; s < n; s++)
+    {
+      GeoPoint where = topo.stop_locations[s];
+      if (!where.known())
+      {
+        *error = topo.stop_ids[s] + " has no location (a snapshot from before they were saved?)";
+        return nullptr;
+      }
+      double lat = where.lat * std::numbers::pi / 180, lon = where.lon * std::numbers::pi / 180;
+      astar->position_[s] = {std::cos(lat) * std::cos(lon), std::cos(lat) * std::sin(lon), std::sin(lat)};
+    }
+    astar->edge_meters_.resize(topo.adjacency.size());
+    for (StopID s = 0; s < n; s++)
+      for (uint32_t e = topo.adjacency_offsets[s]; e < topo.adjacency_offsets[s + 1]; e++)
+        astar->edge_meters_[e] = astar->meters(s, topo.adjacency[e]);
+    return astar;
+  }
+
+  size_t bytes() const { return position_.size() * sizeof(position_[0]) + edge_meters_.size() * sizeof(double); }
+
+  // The shortest path by distance, src and dst included. Returns false if dst
+  // can't be reached.
+  bool shortestPath(Topology const& topo, StopID src, StopID dst, std::vector<StopID>* path) const
+  {
+    path->clear();
+    struct Scratch
+    {
+      std::vector<uint32_t> seen, done; // == epoch
+      std::vector<double> meters; // from src, so far
+      std::vector<StopID> parent;
+      std::vector<std::pair<double, StopID>> heap; // (meters + estimate to dst, stop)
+      uint32_t epoch = 0;
+    };
+    static thread_local Scratch scratch;
+    size_t n = topo.numStops();
+    if (scratch.seen.size() < n)
+    {
+      scratch.seen.assign(n, 0);
+      scratch.done.assign(n, 0);
+      scratch.meters.resize(n);
+      scratch.parent.resize(n);
+      scratch.epoch = 0;
+    }
+    if (++scratch.epoch == 0)
+    {
+      std::fill(scratch.seen.begin(), scratch.seen.end(), 0);
+      std::fill(scratch.done.begin(), scratch.done.end(), 0);
+      scratch.epoch = 1;
+    }
+    scratch.heap.clear();
+    scratch.seen[src] = scratch.epoch;
+    scratch.meters[src] = 0;
+    scratch.heap.push_back({meters(src, dst), src});
+    uint32_t expanded = 0;
+    bool found = false;
+    while (!scratch.heap.empty())
+    {
+      std::pop_heap(scratch.heap.begin(), scratch.heap.end(), std::greater<>());
+      StopID cur = scratch.heap.back().second;
+      scratch.heap.pop_back();
+      if (scratch.done[cur] == scratch.epoch)
+        continue;
+      scratch.done[cur] = scratch.epoch;
+      if (cur == dst)
+      {
+        found = true;
+        break;
+      }
+      expanded++;
+      for (uint32_t e = topo.adjacency_offsets[cur]; e < topo.adjacency_offsets[cur + 1]; e++)
+      {
+        StopID next = topo.adjacency[e];
+        double via_cur = scratch.meters[cur] + edge_meters_[e];
+        if (scratch.done[next] == scratch.epoch ||
+            (scratch.seen[next] == scratch.epoch && scratch.meters[next] <= via_cur))
+          continue;
+        scratch.seen[next] = scratch.epoch;
+        scratch.meters[next] = via_cur;
+        scratch.parent[next] = cur;
+        scratch.heap.push_back({via_cur + meters(next, dst), next});
+        std::push_heap(scratch.heap.begin(), scratch.heap.end(), std::greater<>());
+      }
+    }
+    threadScratch().nodes_expanded = expanded;
+    if (!found)
+      return false;
+    for (StopID stop = dst; stop != src; stop = scratch.parent[stop])
+      path->push_back(stop);
+    path->push_back(src);
+    std::reverse(path->begin(), path->end());
+    return true;
+  }
+
+private:
+  GeoAStar() = default;
+
+  // Great-circle distance from the chord between two points on the unit
+  // sphere: the same as haversineMeters(), without the trigonometry on
+  // every call.
+  double meters(StopID a, StopID b) const
+  {
+    double dx = position_[a][0] - position_[b][0], dy = position_[a][1] - position_[b][1],
+           dz = position_[a][2] - position_[b][2];
+    return 2 * kEarthRadiusMeters * std::asin(std::min(1.0, std::sqrt(dx * dx + dy * dy + dz * dz) / 2));
+  }
+
+  std::vector<std::array<double, 3>> position_; // on the unit sphere, by StopID
+  std::vector<double> edge_meters_; // parallel to Topology::adjacency
+};
+
+// Per-query instrumentation of RoutePlanner::planRoute(): wall time, BFS
+// nodes expanded, stops on the path, lines, and greedilyStayOnRoute()
+// iterations. Off by default; while off, a query pays one relaxed load.
+// Each thread records into its own histograms, and snapshot() merges them
+// (plus those of threads that have exited) on demand.
+class QueryStats
+{
+public:
+  static std::atomic<bool>& enabled()
+  {
+    static std::atomic<bool> on = false;
+    return on;
+  }
+
+  static void record(uint64_t nanos, bool found, SearchScratch const& scratch, size_t legs)
+  {
+    PerThread& mine = perThread();
+    mine.latency_ns.record(nanos);
+    if (!found)
+      mine.unreachable.record(1);
+    if (scratch.nodes_expanded)
+      mine.nodes_expanded.record(scratch.nodes_expanded);
+    if (scratch.path_stops)
+      mine.path_stops.record(scratch.path_stops);
+    if (scratch.greedy_iterations)
+      mine.greedy_iterations.record(scratch.greedy_iterations);
+    if (found)
+      mine.legs.record(legs);
+  }
+
+  static nlohmann::json snapshot()
+  {
+    Registry& registry = Registry::get();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    nlohmann::json ret = {{"enabled", enabled().load()}};
+    auto merged = [&](LogHistogram PerThread::* histogram, double scale = 1)
+    {
+      std::vector<uint64_t> counts;
+      uint64_t count = 0, sum = 0, max = 0;
+      for (PerThread const* thread : registry.threads)
+        (thread->*histogram).mergeInto(&counts, &count, &sum, &max);
+      (registry.retired.*histogram).mergeInto(&counts, &count, &sum, &max);
+      return LogHistogram::summarize(counts, count, sum, max, scale);
+    };
+    ret["latency_us"] = merged(&PerThread::latency_ns, 1e-3);
+    ret["unreachable"] = merged(&PerThread::unreachable)["count"];
+    ret["nodes_expanded"] = merged(&PerThread::nodes_expanded);
+    ret["path_stops"] = merged(&PerThread::path_stops);
+    ret["legs"] = merged(&PerThread::legs);
+    ret["greedy_iterations"] = merged(&PerThread::greedy_iterations);
+    return ret;
+  }
+
+private:
+  struct PerThread
+  {
+    LogHistogram latency_ns, unreachable, nodes_expanded, path_stops, legs, greedy_iterations;
+
+    void addTo(PerThread* other) const
+    {
+      for (auto histogram : {&PerThread::latency_ns, &PerThread::unreachable, &PerThread::nodes_expanded,
+                             &PerThread::path_stops, &PerThread::legs, &PerThread::greedy_iterations})
+        (this->*histogram).addTo(&(other->*histogram));
+    }
+  };
+  struct Registry
+  {
+    std::mutex mutex;
+    std::vector<PerThread*> threads;
+    PerThread retired; // written only under mutex, by exiting threads
+
+    static Registry& get()
+    {
+      static Registry* registry = new Registry; // outlives every thread's stats
+      return *registry;
+    }
+  };
+  // Registers a thread's stats on first use, and folds them into `retired`
+  // when the thread exits.
+  struct Registration
+  {
+    PerThread stats;
+    Registration()
+    {
+      Registry& registry = Registry::get();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      registry.threads.push_back(&stats);
+    }
+    ~Registration()
+    {
+      Registry& registry = Registry::get();
+      std::lock_guard<std::mutex> lock(registry.mutex);
+      stats.addTo(&registry.retired);
+      std::erase(registry.threads, &stats);
+    }
+  };
+
+  static PerThread& perThread()
+  {
+    static thread_local Registration mine;
+    return mine.stats;
+  }
+};
+
+// The two shortest-path trees planAlternatives() shares between all its
+// candidates, plus its bookkeeping.
+struct AlternativesScratch
+{
+  std::vector<uint32_t> from_src, to_dst; // stops; UINT32_MAX if unreachable
+  std::vector<StopID> parent_src, parent_dst; // toward src / toward dst
+  std::vector<std::vector<StopID>> by_length; // vias, by total stops through them
+  std::vector<uint32_t> covered; // == epoch: on a path we've already tried
+  std::vector<uint32_t> on_path; // == path_stamp: on the candidate being built
+  std::vector<StopID> path;
+  uint32_t epoch = 0, path_stamp = 0;
+
+  void prepare(size_t num_stops)
+  {
+    if (covered.size() < num_stops)
+    {
+      from_src.resize(num_stops);
+      to_dst.resize(num_stops);
+      parent_src.resize(num_stops);
+      parent_dst.resize(num_stops);
+      covered.assign(num_stops, 0);
+      on_path.assign(num_stops, 0);
+      epoch = path_stamp = 0;
+    }
+    if (++epoch == 0)
+    {
+      std::fill(covered.begin(), covered.end(), 0);
+      epoch = 1;
+    }
+  }
+};
+
+// Stations by location, for "what's near me" (nearest() and within()). A
+// uniform grid over the network in local meters (an equirectangular
+// projection about its middle latitude, off by well under 5% across a
+// metro area), each cell listing the stations in it. A query looks at the
+// cells around the point ring by ring until nothing further out could be
+// closer, and measures actual distances with haversineMeters(). Stations
+// without a location aren't in it.
+class StopGrid
+{
+public:
+  struct Nearby
+  {
+    StopID stop;
+    double meters;
+  };
+
+  explicit StopGrid(Topology const& topo)
+  {
+    std::vector<StopID> located;
+    double min_lat = 90, max_lat = -90;
+    for (StopID s = 0; s < topo.numStops(); s++)
+      if (GeoPoint where = topo.stop_locations[s]; where.known())
+      {
+        located.push_back(s);
+        min_lat = std::min(min_lat, where.lat);
+        max_lat = std::max(max_lat, where.lat);
+      }
+    if (located.empty())
+      return;
+    meters_per_degree_lat_ = kEarthRadiusMeters * std::numbers::pi / 180;
+    meters_per_degree_lon_ = meters_per_degree_lat_ * std::cos((min_lat + max_lat) / 2 * std::numbers::pi / 180);
+    double min_x = INFINITY, min_y = INFINITY, max_x = -INFINITY, max_y = -INFINITY;
+    for (StopID s : located)
+    {
+      auto [x, y] = project(topo.stop_locations[s]);
+      min_x = std::min(min_x, x), max_x = std::max(max_x, x);
+      min_y = std::min(min_y, y), max_y = std::max(max_y, y);
+    }
+    origin_x_ = min_x;
+    origin_y_ = min_y;
+    // A few stations per cell in a downtown, and never more than a million
+    // cells, however spread out (or mislocated) the stations are.
+    cell_meters_ = std::max({kCellMeters, (max_x - min_x) / 1024, (max_y - min_y) / 1024});
+    columns_ = (max_x - min_x) / cell_meters_ + 1;
+    rows_ = (max_y - min_y) / cell_meters_ + 1;
+    std::vector<uint32_t> cell_of(located.size());
+    cell_offsets_.assign(columns_ * rows_ + 1, 0);
+    for (size_t i = 0; i < located.size(); i++)
+    {
+      auto [x, y] = project(topo.stop_locations[located[i]]);
+      cell_of[i] = cellAt(column(x), row(y));
+      cell_offsets_[cell_of[i] + 1]++;
+    }
+    for (int64_t cell = 0; cell < columns_ * rows_; cell++)
+      cell_offsets_[cell + 1] += cell_offsets_[cell];
+    cell_stops_.resize(located.size());
+    std::vector<uint32_t> fill(cell_offsets_.begin(), cell_offsets_.end() - 1);
+    for (size_t i = 0; i < located.size(); i++)
+      cell_stops_[fill[cell_of[i]]++] = {located[i], topo.stop_locations[located[i]]};
+  }
+
+  bool empty() const { return cell_stops_.empty(); }
+
+  // The k closest stations to 'where', closest first.
+  void nearest(GeoPoint where, size_t k, std::vector<Nearby>* out) const
+  {
+    out->clear();
+    if (empty() || k == 0 || !where.known())
+      return;
+    auto [x, y] = project(where);
+    int64_t center_column = std::clamp<int64_t>(column(x), 0, columns_ - 1);
+    int64_t center_row = std::clamp<int64_t>(row(y), 0, rows_ - 1);
+    auto by_distance = [](Nearby const& a, Nearby const& b) { return std::tie(a.meters, a.stop) < std::tie(b.meters, b.stop); };
+    for (int64_t ring = 0; ; ring++)
+    {
+      // Everything in the ring's cells (the ones at Chebyshev distance 'ring').
+      auto visit = [&](int64_t c, int64_t r)
+      {
+        if (c < 0 || r < 0 || c >= columns_ || r >= rows_)
+          return;
+        uint32_t cell = cellAt(c, r);
+        for (uint32_t i = cell_offsets_[cell]; i < cell_offsets_[cell + 1]; i++)
+          out->push_back({cell_stops_[i].stop, haversineMeters(where, cell_stops_[i].where)});
+      };
+      for (int64_t c = center_column - ring; c <= center_column + ring; c++)
+      {
+        visit(c, center_row - ring);
+        if (ring > 0)
+          visit(c, center_row + ring);
+      }
+      for (int64_t r = center_row - ring + 1; r < center_row + ring; r++)
+      {
+        visit(center_column - ring, r);
+        visit(center_column + ring, r);
+      }
+      // Keep the best k, then stop once the next ring can't beat the kth.
+      if (out->size() > k)
+      {
+        std::nth_element(out->begin(), out->begin() + k - 1, out->end(), by_distance);
+        out->resize(k);
+      }
+      bool covers_grid = center_column - ring <= 0 && center_row - ring <= 0 &&
+                         center_column + ring >= columns_ - 1 && center_row + ring >= rows_ - 1;
+      if (covers_grid)
+        break;
+      if (out->size() == k)
+      {
+        double kth = std::max_element(out->begin(), out->end(), by_distance)->meters;
+        if (kth <= kProjectionSlack * unsearchedMeters(x, y, center_column, center_row, ring))
+          break;
+      }
+    }
+    std::sort(out->begin(), out->end(), by_distance);
+  }
+
+  // Every station within 'meters' of 'where', closest first. An infinite
+  // radius gets every station.
+  void within(GeoPoint where, double meters, std::vector<Nearby>* out) const
+  {
+    out->clear();
+    if (empty() || !where.known() || !(meters >= 0))
+      return;
+    auto [x, y] = project(where);
+    double reach = meters / kProjectionSlack;
+    int64_t first_column = std::max<int64_t>(0, column(x - reach)), last_column = std::min<int64_t>(columns_ - 1, column(x + reach));
+    int64_t first_row = std::max<int64_t>(0, row(y - reach)), last_row = std::min<int64_t>(rows_ - 1, row(y + reach));
+    for (int64_t c = first_column; c <= last_column; c++)
+      for (int64_t r = first_row; r <= last_row; r++)
+      {
+        uint32_t cell = cellAt(c, r);
+        for (uint32_t i = cell_offsets_[cell]; i < cell_offsets_[cell + 1]; i++)
+          if (double d = haversineMeters(where, cell_stops_[i].where); d <= meters)
+            out->push_back({cell_stops_[i].stop, d});
+      }
+    std::sort(out->begin(), out->end(), [](Nearby const& a, Nearby const& b)
+              { return std::tie(a.meters, a.stop) < std::tie(b.meters, b.stop); });
+  }
+
+private:
+  static constexpr double kCellMeters = 250;
+  // Projected distances can be this much longer than real ones over a metro
+  // area, so bounds from the grid are scaled down by it.
+  static constexpr double kProjectionSlack = 0.95;
+
+  struct Located
+  {
+    StopID stop;
+    GeoPoint where;
+  };
+
+  std::pair<double, double> project(GeoPoint where) const
+  {
+    return {where.lon * meters_per_degree_lon_, where.lat * meters_per_degree_lat_};
+  }
+  // Clamped to one past either edge while still a double, so that far-off
+  // points and huge (even infinite) radii convert to integers safely.
+  int64_t column(double x) const { return std::clamp(std::floor((x - origin_x_) / cell_meters_), -1.0, (double)columns_); }
+  int64_t row(double y) const { return std::clamp(std::floor((y - origin_y_) / cell_meters_), -1.0, (double)rows_); }
+  uint32_t cellAt(int64_t column, int64_t row) const { return row * columns_ + column; }
+
+  // How far (x, y) is from anything outside the square of cells searched so
+  // far; 0 if it isn't inside it.
+  double unsearchedMeters(double x, double y, int64_t center_column, int64_t center_row, int64_t ring) const
+  {
+    double left = origin_x_ + (center_column - ring) * cell_meters_;
+    double right = origin_x_ + (center_column + ring + 1) * cell_meters_;
+    double bottom = origin_y_ + (center_row - ring) * cell_meters_;
+    double top = origin_y_ + (center_row + ring + 1) * cell_meters_;
+    return std::max(0.0, std::min({x - left, right - x, y - bottom, top - y}));
+  }
+
+  double meters_per_degree_lat_ = 0, meters_per_degree_lon_ = 0;
+  double origin_x_ = 0, origin_y_ = 0, cell_meters_ = kCellMeters;
+  int64_t columns_ = 0, rows_ = 0;
+  std::vector<uint32_t> cell_offsets_; // stations in cell c are cell_stops_[cell_offsets_[c] .. [c+1])
+  std::vector<Located> cell_stops_;
+};
+
+// A stop reachableFrom() got to: fewest stops it takes (within the transfer
+// budget) and fewest transfers (within the stop budget). Both can't always
+// be had on the same trip.
+struct Reachable
+{
+  StopID stop;
+  uint32_t stops;
+  uint32_t transfers;
+};
+
+uint32_t constexpr kNoBudget = UINT32_MAX;
+
+// For reachableFrom(). A state is a stop plus the line you're on there,
+// numbered like Topology::stop_routes.
+struct ReachabilityScratch
+{
+  struct Label
+  {
+    uint32_t state;
+    StopID stop;
+    uint32_t stops, transfers;
+  };
+  std::vector<uint32_t> best_transfers; // fewest expanded at each state; valid if state_seen == epoch
+  std::vector<uint32_t> state_seen;
+  std::vector<int32_t> result_index; // into the output; valid if stop_seen == epoch
+  std::vector<uint32_t> stop_seen;
+  std::deque<Label> queue;
+  uint32_t epoch = 0;
+
+  void prepare(size_t num_stops, size_t num_states)
+  {
+    if (stop_seen.size() < num_stops || state_seen.size() < num_states)
+    {
+      best_transfers.resize(num_states);
+      state_seen.assign(num_states, 0);
+      result_index.resize(num_stops);
+      stop_seen.assign(num_stops, 0);
+      epoch = 0;
+    }
+    if (++epoch == 0)
+    {
+      std::fill(state_seen.begin(), state_seen.end(), 0);
+      std::fill(stop_seen.begin(), stop_seen.end(), 0);
+      epoch = 1;
+    }
+  }
+};
+
+class RoutePlanner
+{
+public:
+  static constexpr size_t kLocationCandidates = 5;
+  static constexpr double kMaxWalkMeters = 1000;
+
+  explicit RoutePlanner(Topology topology) : topo_(std::move(topology)), stop_grid_(topo_) {}
+
+  Topology const& topology() const { return topo_; }
+  StopGrid const& stopGrid() const { return stop_grid_; }
+
+  // 'stop' can be a display name or a canonical (station or child stop) ID.
+  // Crashes if it's unknown or ambiguous.
+  StopID findStopOrDie(std::string const& stop) const
+  {
+    std::vector<StopID> ambiguous_with;
+    std::optional<StopID> id = topo_.resolve(stop, &ambiguous_with);
+    if (id)
+      return *id;
+    if (ambiguous_with.empty())
+      crash(stop + ": no such stop.");
+    std::string msg = stop + " is ambiguous; use one of these IDs instead:";
+    for (StopID candidate : ambiguous_with)
+      msg += " " + topo_.stop_ids[candidate];
+    crash(msg);
+    return 0;
+  }
+
+  // Returns the list of line names (e.g. Red, Orange) you should take to get
+  // from the station 'src' to 'dst' (display names or canonical IDs).
+  std::vector<std::string> plotRouteFromTo(std::string src, std::string dst) const
+  {
+    StopID src_id = findStopOrDie(src);
+    StopID dst_id = findStopOrDie(dst);
+
+    std::vector<RouteID> routes;
+    if (!planRoute(src_id, dst_id, &routes))
+      crash("Can't get to " + dst + " from " + src);
+    std::vector<std::string> ret;
+    for (RouteID route : routes)
+      ret.push_back(topo_.route_names[route]);
+    return ret;
+  }
+
+  // Like plotRouteFromTo(), but up to k different line sequences, best first.
+  std::vector<std::vector<std::string>> plotAlternatives(std::string src, std::string dst,
+                                                         size_t k) const
+  {
+    StopID src_id = findStopOrDie(src);
+    StopID dst_id = findStopOrDie(dst);
+
+    std::vector<std::vector<RouteID>> alternatives;
+    if (!planAlternatives(src_id, dst_id, k, &alternatives))
+      crash("Can't get to " + dst + " from " + src);
+    std::vector<std::vector<std::string>> ret;
+    for (std::vector<RouteID> const& routes : alternatives)
+    {
+      ret.emplace_back();
+      for (RouteID route : routes)
+        ret.back().push_back(topo_.route_names[route]);
+    }
+    return ret;
+  }
+
+  // Like plotRouteFromTo(), but from a location (say, a phone's GPS) rather
+  // than a station; see planFromLocation().
+  std::vector<std::string> plotRouteFromLocation(double lat, double lon, std::string dst) const
+  {
+    StopID dst_id = findStopOrDie(dst);
+    LocationPlan plan;
+    if (!planFromLocation(GeoPoint{lat, lon}, dst_id, &plan))
+      crash("Can't get to " + dst + " from " + std::to_string(lat) + ", " + std::to_string(lon));
+    std::vector<std::string> ret;
+    for (RouteID route : plan.routes)
+      ret.push_back(topo_.route_names[route]);
+    return ret;
+  }
+
+  struct LocationPlan
+  {
+    StopID start = 0; // the station to walk to
+    double walk_meters = 0; // as the crow flies
+    std::vector<RouteID> routes;
+  };
+
+  // Plans from 'from' to dst by way of a nearby station. The candidates are
+  // the kLocationCandidates stations nearest 'from' that are within
+  // kMaxWalkMeters (or just the nearest, if none are), and the winner is the
+  // one whose trip takes the fewest lines, then the one with the shortest
+  // walk. Returns false if there's no station with a location, or none of
+  // the candidates can reach dst.
+  bool planFromLocation(GeoPoint from, StopID dst, LocationPlan* plan) const
+  {
+    static thread_local std::vector<StopGrid::Nearby> nearby;
+    static thread_local std::vector<RouteID> routes;
+    stop_grid_.nearest(from, kLocationCandidates, &nearby);
+    while (nearby.size() > 1 && nearby.back().meters > kMaxWalkMeters)
+      nearby.pop_back();
+    bool found = false;
+    for (StopGrid::Nearby const& candidate : nearby)
+    {
+      if (!planRoute(candidate.stop, dst, &routes))
+        continue;
+      if (found && routes.size() >= plan->routes.size())
+        continue; // nearby is closest first, so this walk is no shorter
+      found = true;
+      plan->start = candidate.stop;
+      plan->walk_meters = candidate.meters;
+      plan->routes = routes;
+    }
+    return found;
+  }
+
+  // Answer planRoute() from a precomputed all-pairs matrix instead of a BFS.
+  void useNextHopMatrix(std::shared_ptr<NextHopMatrix const> matrix)
+  {
+    next_hop_matrix_ = matrix;
+  }
+
+  // Or from precomputed transfer patterns.
+  void useTransferPatterns(std::shared_ptr<TransferPatterns const> patterns)
+  {
+    transfer_patterns_ = patterns;
+  }
+
+  // Or by searching a contraction hierarchy rather than the plain graph.
+  void useContractionHierarchy(std::shared_ptr<ContractionHierarchy const> ch)
+  {
+    contraction_hierarchy_ = ch;
+  }
+
+  // Or for the fewest transfers, from the line graph (see LineGraph).
+  void useLineGraph(std::shared_ptr<LineGraph const> lines)
+  {
+    line_graph_ = lines;
+  }
+
+  // Or for the shortest distance, by A* (see GeoAStar).
+  void useGeoAStar(std::shared_ptr<GeoAStar const> astar)
+  {
+    geo_astar_ = astar;
+  }
+
+  // The integer-ID core of plotRouteFromTo(). Returns false if dst can't be
+  // reached. Safe to call from many threads at once. If 'path' is given, it
+  // also gets the stops along the way (src and dst included).
+  bool planRoute(StopID src, StopID dst, std::vector<RouteID>* routes,
+                 std::vector<StopID>* path = nullptr) const
+  {
+    MemoryScope memory(MemTag::kScratch);
+    if (!QueryStats::enabled().load(std::memory_order_relaxed))
+      return dispatchPlanRoute(src, dst, routes, path);
+    SearchScratch& scratch = threadScratch();
+    scratch.nodes_expanded = scratch.path_stops = scratch.greedy_iterations = 0;
+    auto start = std::chrono::steady_clock::now();
+    bool found = dispatchPlanRoute(src, dst, routes, path);
+    auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    QueryStats::record(nanos, found, scratch, routes->size());
+    return found;
+  }
+
+  bool dispatchPlanRoute(StopID src, StopID dst, std::vector<RouteID>* routes,
+                         std::vector<StopID>* path) const
+  {
+    if (next_hop_matrix_)
+      return next_hop_matrix_->plan(topo_, src, dst, routes, path);
+    if (transfer_patterns_)
+      return transfer_patterns_->plan(topo_, src, dst, routes, path);
+    if (line_graph_)
+      return line_graph_->plan(topo_, src, dst, routes, path);
+    if (contraction_hierarchy_ || geo_astar_)
+    {
+      std::vector<StopID>& our_path = threadScratch().path;
+      routes->clear();
+      if (contraction_hierarchy_ ? !contraction_hierarchy_->shortestPath(src, dst, &our_path)
+                                 : !geo_astar_->shortestPath(topo_, src, dst, &our_path))
+        return false;
+      threadScratch().path_stops = our_path.size();
+      routesAlongPath(our_path, routes);
+      if (path)
+        *path = our_path;
+      return true;
+    }
+    return planRouteBFS(src, dst, routes, path);
+  }
+
+  // planRoute() by searching, whatever engine is attached.
+  bool planRouteBFS(StopID src, StopID dst, std::vector<RouteID>* routes,
+                    std::vector<StopID>* path = nullptr) const
+  {
+    routes->clear();
+    SearchScratch& scratch = threadScratch();
+    if (!backlinksBFS(src, dst, scratch))
+      return false;
+
+    // assemble path from backlinks
+    std::vector<StopID>& our_path = scratch.path;
+    our_path.clear();
+    for (StopID cur_hop = dst; cur_hop != src; cur_hop = scratch.parent[cur_hop])
+      our_path.push_back(cur_hop);
+    our_path.push_back(src);
+    std::reverse(our_path.begin(), our_path.end());
+    scratch.path_stops = our_path.size();
+
+    routesAlongPath(our_path, routes);
+    if (path)
+      *path = our_path;
+    return true;
+  }
+
+  // We have a path in stops. Now, to convert stops to routes, let's greedily
+  // stay on the same starting route as long as possible. Set intersection will
+  // tell us what routes are viable, as well as when we are forced to switch.
+  void routesAlongPath(std::span<StopID const> path, std::vector<RouteID>* routes) const
+  {
+    routes->clear();
+    if (path.size() < 2)
+      return;
+    size_t station_index = 0;
+    while (station_index < path.size())
+    {
+      auto [route, next_stop_ind] = greedilyStayOnRoute(path, station_index);
+      station_index = next_stop_ind;
+      routes->push_back(route);
+    }
+  }
+
+  // Up to k different line sequences from src to dst, starting with
+  // planRoute()'s answer and then by fewest stops. Returns false if dst
+  // can't be reached.
+  //
+  // These are via-stop alternatives: one BFS tree out of src and one into
+  // dst, and every stop v gives the candidate "shortest path to v, then
+  // shortest path from v". We try vias in order of that candidate's length,
+  // skip ones whose path loops back on itself or runs more than 25% (plus two
+  // stops) longer than the best, and skip vias already on a path we've tried (they'd mostly
+  // give the same path again). So however large k is, the search work is the
+  // two (bounded) trees, and each candidate after that is just a path walk.
+  bool planAlternatives(StopID src, StopID dst, size_t k,
+                        std::vector<std::vector<RouteID>>* alternatives) const
+  {
+    alternatives->clear();
+    static thread_local AlternativesScratch scratch;
+    std::vector<RouteID> routes;
+    if (k == 0 || !planRoute(src, dst, &routes, &scratch.path))
+      return k == 0;
+    alternatives->push_back(routes);
+    if (src == dst || k == 1)
+      return true;
+
+    scratch.prepare(topo_.numStops());
+    for (StopID s : scratch.path)
+      scratch.covered[s] = scratch.epoch;
+    uint32_t shortest = scratch.path.size() - 1;
+    uint32_t longest = shortest + shortest / 4 + 2;
+    // Only stops within 'longest' of both ends can be vias, so the dst tree
+    // stops at that depth and the src tree stays inside the ellipse.
+    shortestPathTree(dst, longest, nullptr, &scratch.to_dst, &scratch.parent_dst);
+    shortestPathTree(src, longest, &scratch.to_dst, &scratch.from_src, &scratch.parent_src);
+    for (std::vector<StopID>& vias : scratch.by_length)
+      vias.clear();
+    scratch.by_length.resize(std::max<size_t>(scratch.by_length.size(), longest + 1));
+    for (StopID v : threadScratch().queue) // what the src tree reached
+      scratch.by_length[scratch.from_src[v] + scratch.to_dst[v]].push_back(v);
+
+    for (uint32_t length = shortest; length <= longest && alternatives->size() < k; length++)
+      for (StopID via : scratch.by_length[length])
+      {
+        if (scratch.covered[via] == scratch.epoch)
+          continue;
+        if (!viaPath(src, dst, via, scratch))
+          continue;
+        for (StopID s : scratch.path)
+          scratch.covered[s] = scratch.epoch;
+        routesAlongPath(scratch.path, &routes);
+        if (std::find(alternatives->begin(), alternatives->end(), routes) == alternatives->end())
+        {
+          alternatives->push_back(routes);
+          if (alternatives->size() == k)
+            break;
+        }
+      }
+    return true;
+  }
+
+  // Every stop within max_stops stops and max_transfers transfers of src
+  // (either can be kNoBudget), with what it costs to get there, in order of
+  // stops. Transfers are line changes the way planRoute() counts them: you
+  // ride from a stop to a neighbor on any line serving both, and starting
+  // out on any line at src is free. Note planRoute() goes by fewest stops,
+  // so it can take more transfers than the fewest reported here.
+  //
+  // One search over (stop, line) states, breadth-first by stops: a ride
+  // costs a stop and a change costs a transfer but no stops, so changes go
+  // on the front of the queue and rides on the back. A state is only
+  // expanded again if it's reached with fewer transfers than before, which
+  // keeps every (stops, transfers) trade-off without a search per budget.
+  void reachableFrom(StopID src, uint32_t max_stops, uint32_t max_transfers,
+                     std::vector<Reachable>* out) const
+  {
+    out->clear();
+    static thread_local ReachabilityScratch scratch;
+    scratch.prepare(topo_.numStops(), topo_.stop_routes.size());
+    scratch.queue.clear();
+    for (uint32_t state = topo_.route_offsets[src]; state < topo_.route_offsets[src + 1]; state++)
+      scratch.queue.push_back({state, src, 0, 0});
+    while (!scratch.queue.empty())
+    {
+      ReachabilityScratch::Label label = scratch.queue.front();
+      scratch.queue.pop_front();
+      if (scratch.state_seen[label.state] == scratch.epoch &&
+          scratch.best_transfers[label.state] <= label.transfers)
+        continue;
+      scratch.state_seen[label.state] = scratch.epoch;
+      scratch.best_transfers[label.state] = label.transfers;
+      if (scratch.stop_seen[label.stop] != scratch.epoch)
+      {
+        scratch.stop_seen[label.stop] = scratch.epoch;
+        scratch.result_index[label.stop] = out->size();
+        out->push_back({label.stop, label.stops, label.transfers});
+      }
+      Reachable& reached = (*out)[scratch.result_index[label.stop]];
+      reached.transfers = std::min(reached.transfers, label.transfers);
+
+      auto improves = [&](uint32_t state, uint32_t transfers)
+      {
+        return scratch.state_seen[state] != scratch.epoch || transfers < scratch.best_transfers[state];
+      };
+      if (label.transfers < max_transfers)
+        for (uint32_t other = topo_.route_offsets[label.stop]; other < topo_.route_offsets[label.stop + 1]; other++)
+          if (other != label.state && improves(other, label.transfers + 1))
+            scratch.queue.push_front({other, label.stop, label.stops, label.transfers + 1});
+      if (label.stops >= max_stops)
+        continue;
+      RouteID route = topo_.stop_routes[label.state];
+      for (StopID neighbor : topo_.neighbors(label.stop))
+      {
+        std::span<RouteID const> routes = topo_.routesOf(neighbor);
+        auto it = std::lower_bound(routes.begin(), routes.end(), route);
+        if (it == routes.end() || *it != route)
+          continue;
+        uint32_t state = topo_.route_offsets[neighbor] + (it - routes.begin());
+        if (improves(state, label.transfers))
+          scratch.queue.push_back({state, neighbor, label.stops + 1, label.transfers});
+      }
+    }
+  }
+
+private:
+
+  // BFS, tracking backlinks in scratch.parent: following parent[] from dst
+  // gets you back to src. Returns false if dst is unreachable.
+  bool backlinksBFS(StopID src, StopID dst, SearchScratch& scratch) const
+  {
+    scratch.prepare(topo_.numStops());
+    std::vector<StopID>& to_visit = scratch.queue;
+    to_visit.clear();
+    to_visit.push_back(src);
+    scratch.seen[src] = scratch.epoch;
+    if (src == dst)
+      return true;
+    for (size_t head = 0; head < to_visit.size(); head++)
+    {
+      StopID cur = to_visit[head];
+      for (StopID neighbor : topo_.neighbors(cur))
+      {
+        if (scratch.seen[neighbor] == scratch.epoch)
+          continue;
+        scratch.seen[neighbor] = scratch.epoch;
+        scratch.parent[neighbor] = cur;
+        if (neighbor == dst)
+        {
+          scratch.nodes_expanded = head + 1;
+          return true;
+        }
+        to_visit.push_back(neighbor);
+      }
+    }
+    scratch.nodes_expanded = to_visit.size();
+    return false;
+  }
+
+  // BFS from 'root' out to 'max_depth': distances (UINT32_MAX where it didn't
+  // reach), and each stop's parent, one stop closer to root. With 'bound', it
+  // only goes where depth + bound[stop] <= max_depth. Leaves the stops it
+  // reached in threadScratch().queue.
+  void shortestPathTree(StopID root, uint32_t max_depth, std::vector<uint32_t> const* bound,
+                        std::vector<uint32_t>* distances, std::vector<StopID>* parents) const
+  {
+    std::vector<StopID>& queue = threadScratch().queue;
+    std::fill(distances->begin(), distances->begin() + topo_.numStops(), UINT32_MAX);
+    queue.clear();
+    queue.push_back(root);
+    (*distances)[root] = 0;
+    (*parents)[root] = root;
+    for (size_t head = 0; head < queue.size(); head++)
+    {
+      uint32_t depth = (*distances)[queue[head]] + 1;
+      for (StopID neighbor : topo_.neighbors(queue[head]))
+        if ((*distances)[neighbor] == UINT32_MAX &&
+            (uint64_t)depth + (bound ? (*bound)[neighbor] : 0) <= max_depth)
+        {
+          (*distances)[neighbor] = depth;
+          (*parents)[neighbor] = queue[head];
+          queue.push_back(neighbor);
+        }
+    }
+  }
+
+  // src -> via along the src tree, then via -> dst along the dst tree, into
+  // scratch.path. False if that visits some stop twice.
+  bool viaPath(StopID src, StopID dst, StopID via, AlternativesScratch& scratch) const
+  {
+    if (++scratch.path_stamp == 0)
+    {
+      std::fill(scratch.on_path.begin(), scratch.on_path.end(), 0);
+      scratch.path_stamp = 1;
+    }
+    std::vector<StopID>& path = scratch.path;
+    path.clear();
+    for (StopID s = via; ; s = scratch.parent_src[s])
+    {
+      path.push_back(s);
+      scratch.on_path[s] = scratch.path_stamp;
+      if (s == src)
+        break;
+    }
+    std::reverse(path.begin(), path.end());
+    for (StopID s = via; s != dst; )
+    {
+      s = scratch.parent_dst[s];
+      if (scratch.on_path[s] == scratch.path_stamp)
+        return false;
+      scratch.on_path[s] = scratch.path_stamp;
+      path.push_back(s);
+    }
+    return true;
+  }
+
+  // Starting from path[station_index], return the line that you can stay on
+  // for the most stations in this path. Also returns the index where you have
+  // to switch to a new line - meaning you should call this function again on
+  // that index.
+  std::pair<RouteID, size_t> greedilyStayOnRoute(std::span<StopID const> path,
+                                                 size_t station_index) const
+  {
+    SearchScratch& scratch = threadScratch();
+    std::vector<RouteID>& candidates = scratch.candidates;
+    std::vector<RouteID>& new_candidates = scratch.new_candidates;
+    std::span<RouteID const> first = topo_.routesOf(path[station_index++]);
+    candidates.assign(first.begin(), first.end());
+    while (station_index < path.size())
+    {
+      std::span<RouteID const> here = topo_.routesOf(path[station_index]);
+      new_candidates.clear();
+      std::set_intersection(candidates.begin(), candidates.end(),
+                            here.begin(), here.end(),
+                            std::back_inserter(new_candidates));
+      scratch.greedy_iterations++;
+      if (new_candidates.empty())
+        break;
+      station_index++;
+      candidates.swap(new_candidates);
+    }
+    return std::make_pair(candidates.front(), station_index);
+  }
+
+  Topology topo_;
+  StopGrid stop_grid_;
+  std::shared_ptr<NextHopMatrix const> next_hop_matrix_;
+  std::shared_ptr<TransferPatterns const> transfer_patterns_;
+  std::shared_ptr<ContractionHierarchy const> contraction_hierarchy_;
+  std::shared_ptr<LineGraph const> line_graph_;
+  std::shared_ptr<GeoAStar const> geo_astar_;
+};
+
+// Resolves what people actually type ("kendall", "dwntwn xing", "PARK ST") to
+// ranked candidate stations, fast enough to run on every keystroke. Two
+// structures, both over normalized names:
+//  - a trie of every word-suffix of every name ("kendall mit", "mit"), whose
+//    nodes know which range of the sorted entries lies below them, so a prefix
+//    lookup is a walk down the trie and a slice of that array.
+//  - trigram posting lists, scored by Dice coefficient, for misspellings and
+//    abbreviations that prefix matching can't catch.
+class StopNameIndex
+{
+public:
+  struct Match
+  {
+    StopID stop;
+    float score; // higher is better; 3 is an exact (normalized) match
+  };
+
+  explicit StopNameIndex(Topology const& topo) : num_stops_(topo.numStops())
+  {
+    for (StopID s = 0; s < topo.numStops(); s++)
+    {
+      std::string name = normalize(topo.stop_names[s]);
+      // every word boundary starts a key, so "mit" finds Kendall/MIT.
+      for (size_t word = 0; word < name.size(); word = name.find(' ', word) + 1)
+      {
+        entries_.push_back(Entry{name.substr(word), s, word == 0});
+        if (name.find(' ', word) == std::string::npos)
+          break;
+      }
+      std::vector<uint32_t> trigrams = trigramsOf(name);
+      num_trigrams_.push_back(trigrams.size());
+      for (uint32_t trigram : trigrams)
+        postings_[trigram].push_back(s);
+      names_.push_back(std::move(name));
+    }
+    std::sort(entries_.begin(), entries_.end(),
+              [](Entry const& a, Entry const& b) { return a.key < b.key; });
+    buildTrie();
+  }
+
+  // The query's last word may still be being typed ("st" on its way to
+  // "State"), so it's matched both as typed and with abbreviations spelled
+  // out ("st" as "street"), and each stop keeps its better score.
+  std::vector<Match> lookup(std::string_view query, size_t max_results = 10) const
+  {
+    std::string expanded = normalize(query);
+    std::string literal = normalize(query, false);
+    std::vector<Match> ret;
+    if (expanded.empty())
+      return ret;
+
+    struct Scratch
+    {
+      std::vector<float> score;
+      std::vector<uint16_t> shared_trigrams;
+      std::vector<StopID> touched;
+    };
+    static thread_local Scratch scratch;
+    if (scratch.score.size() < num_stops_)
+    {
+      scratch.score.resize(num_stops_, -1);
+      scratch.shared_trigrams.resize(num_stops_, 0);
+    }
+    auto offer = [&](StopID s, float score)
+    {
+      if (scratch.score[s] < 0)
+        scratch.touched.push_back(s);
+      scratch.score[s] = std::max(scratch.score[s], score);
+    };
+
+    auto match = [&](std::string const& normalized)
+    {
+      // Prefix matches: start-of-name beats start-of-a-later-word, and among
+      // those, shorter names (closer to what was typed) win.
+      auto [begin, end] = prefixRange(normalized);
+      for (uint32_t i = begin; i < end; i++)
+      {
+        Entry const& entry = entries_[i];
+        float score = entry.whole_name ? 2.0f : 1.5f;
+        if (entry.whole_name && entry.key.size() == normalized.size())
+          score = 3.0f;
+        offer(entry.stop, score - 0.001f * names_[entry.stop].size());
+      }
+
+      // Fuzzy matches: Dice coefficient over trigrams, plus a bonus if the typed
+      // words are in-order subsequences of the name's words ("dwntwn" of "downtown").
+      std::vector<uint32_t> query_trigrams = trigramsOf(normalized);
+      std::vector<StopID> trigram_hits;
+      for (uint32_t trigram : query_trigrams)
+      {
+        auto it = postings_.find(trigram);
+        if (it == postings_.end())
+          continue;
+        for (StopID s : it->second)
+          if (scratch.shared_trigrams[s]++ == 0)
+            trigram_hits.push_back(s);
+      }
+      for (StopID s : trigram_hits)
+      {
+        float dice = 2.0f * scratch.shared_trigrams[s] /
+                     (query_trigrams.size() + num_trigrams_[s]);
+        scratch.shared_trigrams[s] = 0;
+        if (dice < 0.2f)
+          continue;
+        if (wordsAreSubsequences(normalized, names_[s]))
+          dice += 0.3f;
+        offer(s, std::min(dice, 1.4f));
+      }
+    };
+    match(expanded);
+    if (literal != expanded)
+      match(literal);
+
+    for (StopID s : scratch.touched)
+    {
+      ret.push_back(Match{s, scratch.score[s]});
+      scratch.score[s] = -1;
+    }
+    scratch.touched.clear();
+    size_t keep = std::min(max_results, ret.size());
+    std::partial_sort(ret.begin(), ret.begin() + keep, ret.end(),
+                      [](Match const& a, Match const& b)
+                      { return a.score > b.score || (a.score == b.score && a.stop < b.stop); });
+    ret.resize(keep);
+    return ret;
+  }
+
+  // Lowercase, punctuation to spaces, single spaces, and common abbreviations
+  // spelled out - applied identically to names and queries. Without
+  // expand_last_word, a final word that nothing follows is left as typed.
+  static std::string normalize(std::string_view raw, bool expand_last_word = true)
+  {
+    static std::unordered_map<std::string, std::string> const kExpansions = {
+      {"xing", "crossing"}, {"sq", "square"}, {"st", "street"}, {"ave", "avenue"},
+      {"av", "avenue"}, {"ctr", "center"}, {"stn", "station"}, {"sta", "station"},
+      {"univ", "university"}, {"hts", "heights"}, {"rd", "road"}, {"mass", "massachusetts"},
+      {"mt", "mount"}, {"pk", "park"}, {"blvd", "boulevard"}, {"hwy", "highway"}};
+    std::string ret;
+    std::string word;
+    auto flushWord = [&](bool expand)
+    {
+      if (word.empty())
+        return;
+      auto it = expand ? kExpansions.find(word) : kExpansions.end();
+      if (!ret.empty())
+        ret += ' ';
+      ret += it == kExpansions.end() ? word : it->second;
+      word.clear();
+    };
+    for (char c : raw)
+    {
+      if (c == '\'')
+        continue; // "Mary's" -> "marys", not "mary s"
+      if (std::isalnum((unsigned char)c))
+        word += std::tolower((unsigned char)c);
+      else
+        flushWord(true);
+    }
+    flushWord(expand_last_word);
+    return ret;
+  }
+
+private:
+  struct Entry
+  {
+    std::string key; // normalized name, from some word onward
+    StopID stop;
+    bool whole_name; // key starts at the start of the name
+  };
+  struct TrieNode
+  {
+    uint32_t first_child = 0; // 0 = none (the root is never anyone's child)
+    uint32_t next_sibling = 0;
+    uint32_t begin = 0; // entries_[begin, end) all have this node's prefix
+    uint32_t end = 0;
+    char c = 0;
+  };
+
+  // entries_ is sorted, so every node's entries are contiguous. Nodes are
+  // appended in sorted order too, so siblings end up in ascending char order.
+  void buildTrie()
+  {
+    trie_.assign(1, TrieNode{});
+    trie_[0].end = entries_.size();
+    std::vector<uint32_t> path = {0}; // path[d] is the node for key prefix of length d
+    std::string_view previous;
+    for (uint32_t i = 0; i < entries_.size(); i++)
+    {
+      std::string_view key = entries_[i].key;
+      size_t common = 0;
+      while (common < key.size() && common < previous.size() && key[common] == previous[common])
+        common++;
+      path.resize(common + 1);
+      for (size_t d = 1; d <= common; d++)
+        trie_[path[d]].end = i + 1;
+      for (size_t d = common; d < key.size(); d++)
+      {
+        uint32_t node = trie_.size();
+        trie_.push_back(TrieNode{0, 0, i, i + 1, key[d]});
+        uint32_t parent = path[d];
+        if (trie_[parent].first_child == 0)
+          trie_[parent].first_child = node;
+        else
+        {
+          uint32_t sibling = trie_[parent].first_child;
+          while (trie_[sibling].next_sibling != 0)
+            sibling = trie_[sibling].next_sibling;
+          trie_[sibling].next_sibling = node;
+        }
+        path.push_back(node);
+      }
+      previous = key;
+    }
+  }
+
+  std::pair<uint32_t, uint32_t> prefixRange(std::string_view prefix) const
+  {
+    uint32_t node = 0;
+    for (char c : prefix)
+    {
+      uint32_t child = trie_[node].first_child;
+      while (child != 0 && trie_[child].c < c)
+        child = trie_[child].next_sibling;
+      if (child == 0 || trie_[child].c != c)
+        return {0, 0};
+      node = child;
+    }
+    return {trie_[node].begin, trie_[node].end};
+  }
+
+  // Trigrams of each word, padded like "  w", " wo", ..., "rd ", deduplicated.
+  static std::vector<uint32_t> trigramsOf(std::string_view normalized)
+  {
+    std::vector<uint32_t> ret;
+    size_t word_start = 0;
+    while (word_start < normalized.size())
+    {
+      size_t word_end = normalized.find(' ', word_start);
+      if (word_end == std::string_view::npos)
+        word_end = normalized.size();
+      std::string padded = "  " + std::string(normalized.substr(word_start, word_end - word_start)) + " ";
+      for (size_t i = 0; i + 3 <= padded.size(); i++)
+        ret.push_back((uint8_t)padded[i] << 16 | (uint8_t)padded[i+1] << 8 | (uint8_t)padded[i+2]);
+      word_start = word_end + 1;
+    }
+    std::sort(ret.begin(), ret.end());
+    ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+    return ret;
+  }
+
+  // Can each typed word be matched, in order, to a distinct name word that
+  // starts with the same letter and contains it as a subsequence?
+  static bool wordsAreSubsequences(std::string_view typed, std::string_view name)
+  {
+    size_t name_pos = 0;
+    size_t typed_pos = 0;
+    while (typed_pos < typed.size())
+    {
+      size_t typed_end = std::min(typed.find(' ', typed_pos), typed.size());
+      std::string_view word = typed.substr(typed_pos, typed_end - typed_pos);
+      bool matched = false;
+      while (!matched && name_pos < name.size())
+      {
+        size_t name_end = std::min(name.find(' ', name_pos), name.size());
+        std::string_view candidate = name.substr(name_pos, name_end - name_pos);
+        name_pos = name_end + 1;
+        if (candidate[0] != word[0])
+          continue;
+        size_t i = 0;
+        for (char c : candidate)
+          if (i < word.size() && c == word[i])
+            i++;
+        matched = i == word.size();
+      }
+      if (!matched)
+        return false;
+      typed_pos = typed_end + 1;
+    }
+    return true;
+  }
+
+  size_t num_stops_;
+  std::vector<std::string> names_; // normalized, indexed by StopID
+  std::vector<Entry> entries_;
+  std::vector<TrieNode> trie_;
+  std::unordered_map<uint32_t, std::vector<StopID>> postings_;
+  std::vector<uint16_t> num_trigrams_; // indexed by StopID
+};
+
+// Everything derived from one load of the network. Immutable once built;
+// a reload builds a whole new one and swaps it in (see PlannerService).
+struct PlannerSnapshot
+{
+  PlannerSnapshot(Topology topology, uint64_t version)
+  : planner(std::move(topology)), index(planner.topology()), version(version),
+    loaded_at(std::chrono::system_clock::now()) {}
+
+  RoutePlanner planner;
+  StopNameIndex index; // refers into planner's topology, so this can't be copied/moved
+  uint64_t version; // increases with every reload
+  std::chrono::system_clock::time_point loaded_at;
+};
+
+// Sharded (src, dst) -> routes cache with single-flight: if N threads ask for
+// the same uncached pair at once, one computes it and the others wait for that
+// answer. Real traffic is dominated by a few hot pairs arriving in bursts
+// (the stadium letting out), which is exactly the case this is for.
+//
+// Entries are tagged with the topology version they were computed against,
+// and a lookup for any other version is a miss. That makes invalidation
+// atomic: the moment PlannerService swaps in a new topology, no stale entry
+// can be returned, even before invalidate() has finished clearing shards.
+class PlanCache
+{
+public:
+  struct Result
+  {
+    bool reachable;
+    std::vector<RouteID> routes;
+  };
+  using ResultPtr = std::shared_ptr<Result const>;
+
+  struct Stats
+  {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t coalesced; // waited on another thread's computation instead of computing
+    uint64_t evictions;
+    uint64_t entries;
+  };
+
+  explicit PlanCache(size_t capacity) : capacity_per_shard_(std::max<size_t>(1, capacity / kNumShards)) {}
+
+  // Returns the cached result for (src, dst) under 'version', or runs
+  // compute() to make it (at most once per key, however many callers). If
+  // compute() throws, so does this, for every caller waiting on it, and
+  // nothing is cached.
+  ResultPtr getOrCompute(uint64_t version, StopID src, StopID dst,
+                         std::function<Result()> const& compute)
+  {
+    MemoryScope memory(MemTag::kCache);
+    uint64_t key = (uint64_t)src << 32 | dst;
+    Shard& shard = shards_[std::hash<uint64_t>()(key) % kNumShards];
+    std::promise<ResultPtr> promise;
+    {
+      std::unique_lock<std::mutex> lock(shard.mutex);
+      auto it = shard.entries.find(key);
+      if (it != shard.entries.end() && it->second.version == version)
+      {
+        it->second.referenced = true;
+        std::shared_future<ResultPtr> result = it->second.result;
+        lock.unlock();
+        if (result.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+          hits_.fetch_add(1, std::memory_order_relaxed);
+        else
+          coalesced_.fetch_add(1, std::memory_order_relaxed);
+        return result.get();
+      }
+      bool inserted = it == shard.entries.end();
+      if (inserted)
+      {
+        it = shard.entries.emplace(key, Entry{}).first;
+        entries_.fetch_add(1, std::memory_order_relaxed);
+        shard.clock.push_back(key);
+      }
+      it->second.version = version;
+      it->second.referenced = false;
+      it->second.result = promise.get_future().share();
+      if (inserted)
+        evictIfFull(&shard); // after the future's set, since eviction looks at it
+    }
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    ResultPtr result;
+    try
+    {
+      result = std::make_shared<Result const>(compute());
+    }
+    catch (...)
+    {
+      promise.set_exception(std::current_exception());
+      // A finished entry for this key and version is ours (or an equally
+      // disposable one, if invalidate() ran meanwhile).
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      auto it = shard.entries.find(key);
+      if (it != shard.entries.end() && it->second.version == version &&
+          it->second.result.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+      {
+        shard.entries.erase(it);
+        entries_.fetch_sub(1, std::memory_order_relaxed);
+      }
+      throw;
+    }
+    promise.set_value(result);
+    return result;
+  }
+
+  // Frees every entry. Correctness doesn't depend on this (see above); it's
+  // so stale entries don't hold memory until they happen to be evicted.
+  void invalidate()
+  {
+    for (Shard& shard : shards_)
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      entries_.fetch_sub(shard.entries.size(), std::memory_order_relaxed);
+      shard.entries.clear();
+      shard.clock.clear();
+    }
+  }
+
+  // Lock-free, so it's fine to call as often as a metrics scraper likes.
+  Stats stats() const
+  {
+    return Stats{hits_.load(), misses_.load(), coalesced_.load(), evictions_.load(), entries_.load()};
+  }
+
+private:
+  static size_t constexpr kNumShards = 64;
+
+  struct Entry
+  {
+    uint64_t version = 0;
+    bool referenced = false;
+    std::shared_future<ResultPtr> result;
+  };
+
+  struct Shard
+  {
+    std::mutex mutex;
+    std::unordered_map<uint64_t, Entry> entries;
+    std::deque<uint64_t> clock; // insertion order, for second-chance eviction
+  };
+
+  // CLOCK / second chance: entries hit since they last came around survive.
+  // In-flight entries are skipped too, so nobody's future gets dropped.
+  void evictIfFull(Shard* shard)
+  {
+    while (shard->entries.size() > capacity_per_shard_ && !shard->clock.empty())
+    {
+      uint64_t victim = shard->clock.front();
+      shard->clock.pop_front();
+      auto it = shard->entries.find(victim);
+      if (it == shard->entries.end())
+        continue;
+      bool in_flight = !it->second.result.valid() ||
+                       it->second.result.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+      if (it->second.referenced || in_flight)
+      {
+        it->second.referenced = false;
+        shard->clock.push_back(victim);
+        if (in_flight)
+          break; // everything may be in flight; don't spin, just run a little over
+        continue;
+      }
+      shard->entries.erase(it);
+      entries_.fetch_sub(1, std::memory_order_relaxed);
+      evictions_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  size_t capacity_per_shard_;
+  Shard shards_[kNumShards];
+  std::atomic<uint64_t> hits_ = 0;
+  std::atomic<uint64_t> misses_ = 0;
+  std::atomic<uint64_t> coalesced_ = 0;
+  std::atomic<uint64_t> evictions_ = 0;
+  std::atomic<uint64_t> entries_ = 0;
+};
+
+// --query-log F: every query PlannerService plans, appended to F as
+// (timestamp, src, dst), for --replay. A query thread only appends to its
+// own buffer (under its own, uncontended, lock); a background thread does
+// all the I/O, when a buffer fills and once a second.
+//
+// File format (native-endian): "MBTAQLOG" u32 version=1, then chunks of
+//   'S' u32 n, n x (u16 length + bytes)   stop IDs, indexed by the StopIDs in
+//                                         the 'Q' chunks that follow
+//   'Q' u32 n, n x (u64 unix time in microseconds, u32 src, u32 dst)
+// There's a new 'S' chunk whenever a reload changes the topology. Chunks
+// from different threads interleave, so records are only roughly in order.
+class QueryLog
+{
+public:
+  struct Record
+  {
+    uint64_t unix_us;
+    StopID src;
+    StopID dst;
+  };
+
+  // A whole log, read back: records' src and dst index into 'stops'.
+  struct Contents
+  {
+    std::vector<std::string> stops;
+    std::vector<Record> records;
+  };
+
+  // nullptr (and *error) if the file can't be created.
+  static std::unique_ptr<QueryLog> open(std::string const& path, std::string* error)
+  {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+      *error = "couldn't create " + path + ": " + strerror(errno);
+      return nullptr;
+    }
+    return std::unique_ptr<QueryLog>(new QueryLog(fd));
+  }
+
+  QueryLog(QueryLog const&) = delete;
+  QueryLog& operator=(QueryLog const&) = delete;
+
+  // Flushes everything logged so far.
+  ~QueryLog()
+  {
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex_);
+      stopping_ = true;
+    }
+    queue_cv_.notify_one();
+    writer_.join();
+    out_.reset();
+    close(fd_);
+  }
+
+  void log(PlannerSnapshot const& snapshot, StopID src, StopID dst)
+  {
+    uint64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    ThreadBuffer& buffer = threadBuffer();
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    if (buffer.version != snapshot.version)
+    {
+      if (!buffer.records.empty())
+        handOff(&buffer);
+      buffer.version = snapshot.version;
+      noteTopology(snapshot);
+    }
+    buffer.records.push_back(Record{now, src, dst});
+    if (buffer.records.size() >= kBufferRecords)
+      handOff(&buffer);
+  }
+
+  // nullopt (and *error) if 'path' isn't a complete query log.
+  static std::optional<Contents> read(std::string const& path, std::string* error)
+  {
+    std::unique_ptr<MappedFile> mapped = MappedFile::open(path, error);
+    if (!mapped)
+      return std::nullopt;
+    std::string_view data((char const*)mapped->data(), mapped->size());
+    auto take = [&](size_t bytes)
+    {
+      if (data.size() < bytes)
+        throw std::runtime_error(path + " is truncated");
+      std::string_view ret = data.substr(0, bytes);
+      data.remove_prefix(bytes);
+      return ret;
+    };
+    auto get = [&]<typename T>(T* value) { memcpy(value, take(sizeof(T)).data(), sizeof(T)); };
+    Contents contents;
+    try
+    {
+      uint32_t version = 0;
+      if (take(8) != std::string_view(kMagic, 8) || (get(&version), version != kFormatVersion))
+        throw std::runtime_error(path + " isn't a query log (or is a different version)");
+      std::unordered_map<std::string, uint32_t> index_of_stop;
+      std::vector<uint32_t> table; // this chunk's StopIDs -> index into contents.stops
+      while (!data.empty())
+      {
+        char type = take(1)[0];
+        uint32_t n = 0;
+        get(&n);
+        if (type == 'S')
+        {
+          table.resize(n);
+          for (uint32_t& index : table)
+          {
+            uint16_t length = 0;
+            get(&length);
+            auto [it, inserted] = index_of_stop.emplace(take(length), contents.stops.size());
+            if (inserted)
+              contents.stops.push_back(it->first);
+            index = it->second;
+          }
+        }
+        else if (type == 'Q')
+          for (uint32_t i = 0; i < n; i++)
+          {
+            Record record;
+            get(&record.unix_us);
+            get(&record.src);
+            get(&record.dst);
+            if (record.src >= table.size() || record.dst >= table.size())
+              throw std::runtime_error(path + " has a query for a stop it never named");
+            contents.records.push_back(Record{record.unix_us, table[record.src], table[record.dst]});
+          }
+        else
+          throw std::runtime_error(path + " has a chunk of unknown type");
+      }
+    }
+    catch (std::runtime_error const& e)
+    {
+      *error = e.what();
+      return std::nullopt;
+    }
+    return contents;
+  }
+
+private:
+  static constexpr char kMagic[8] = {'M', 'B', 'T', 'A', 'Q', 'L', 'O', 'G'};
+  static uint32_t constexpr kFormatVersion = 1;
+  static size_t constexpr kBufferRecords = 4096;
+
+  struct ThreadBuffer
+  {
+    std::mutex mutex;
+    uint64_t version = 0; // of the topology 'records' StopIDs belong to
+    std::vector<Record> records;
+  };
+  struct Block
+  {
+    uint64_t version;
+    std::vector<Record> records;
+  };
+
+  explicit QueryLog(int fd) : fd_(fd), out_(std::make_unique<BufferedWriter>(fd))
+  {
+    out_->append(std::string_view(kMagic, 8));
+    std::string version;
+    appendBinary<uint32_t>(&version, kFormatVersion);
+    out_->append(version);
+    writer_ = std::thread([this]() { writerLoop(); });
+  }
+
+  ThreadBuffer& threadBuffer()
+  {
+    // (log, buffer), so a thread that outlives one log doesn't use its buffer in the next.
+    static thread_local std::pair<uint64_t, ThreadBuffer*> mine{0, nullptr};
+    if (mine.first != id_)
+    {
+      std::lock_guard<std::mutex> lock(buffers_mutex_);
+      buffers_.push_back(std::make_unique<ThreadBuffer>());
+      mine = {id_, buffers_.back().get()};
+    }
+    return *mine.second;
+  }
+
+  // Call with buffer->mutex held.
+  void handOff(ThreadBuffer* buffer)
+  {
+    {
+      std::lock_guard<std::mutex> lock(queue_mutex_);
+      full_.push_back(Block{buffer->version, std::move(buffer->records)});
+    }
+    queue_cv_.notify_one();
+    buffer->records.clear();
+    buffer->records.reserve(kBufferRecords);
+  }
+
+  void noteTopology(PlannerSnapshot const& snapshot)
+  {
+    std::lock_guard<std::mutex> lock(tables_mutex_);
+    if (!stop_tables_.contains(snapshot.version))
+      stop_tables_[snapshot.version] = snapshot.planner.topology().stop_ids;
+  }
+
+  void writerLoop()
+  {
+    auto last_sweep = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(queue_mutex_);
+    while (true)
+    {
+      queue_cv_.wait_for(lock, std::chrono::seconds(1), [&]() { return stopping_ || !full_.empty(); });
+      bool stopping = stopping_;
+      std::vector<Block> blocks;
+      blocks.swap(full_);
+      lock.unlock();
+      // Once a second, take what's in the partly full buffers too.
+      if (stopping || std::chrono::steady_clock::now() - last_sweep >= std::chrono::seconds(1))
+      {
+        last_sweep = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> buffers_lock(buffers_mutex_);
+        for (auto const& buffer : buffers_)
+        {
+          std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+          if (!buffer->records.empty())
+            blocks.push_back(Block{buffer->version, std::move(buffer->records)});
+          buffer->records.clear();
+        }
+      }
+      for (Block const& block : blocks)
+        write(block);
+      out_->flush();
+      if (stopping)
+        return;
+      lock.lock();
+    }
+  }
+
+  void write(Block const& block)
+  {
+    std::string chunk;
+    if (block.version != written_version_)
+    {
+      std::lock_guard<std::mutex> lock(tables_mutex_);
+      std::vector<std::string> const& stops = stop_tables_.at(block.version);
+      chunk += 'S';
+      appendBinary<uint32_t>(&chunk, stops.size());
+      for (std::string const& stop : stops)
+      {
+        appendBinary<uint16_t>(&chunk, stop.size());
+        chunk += stop;
+      }
+      written_version_ = block.version;
+    }
+    chunk += 'Q';
+    appendBinary<uint32_t>(&chunk, block.records.size());
+    for (Record const& record : block.records)
+    {
+      appendBinary(&chunk, record.unix_us);
+      appendBinary(&chunk, record.src);
+      appendBinary(&chunk, record.dst);
+    }
+    out_->append(chunk);
+  }
+
+  static uint64_t nextId()
+  {
+    static std::atomic<uint64_t> next = 1;
+    return next++;
+  }
+
+  int fd_;
+  std::unique_ptr<BufferedWriter> out_; // only the writer thread touches it
+  uint64_t const id_ = nextId();
+  std::mutex buffers_mutex_;
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+  std::mutex queue_mutex_;
+  std::condition_variable queue_cv_;
+  std::vector<Block> full_;
+  bool stopping_ = false;
+  std::mutex tables_mutex_;
+  std::unordered_map<uint64_t, std::vector<std::string>> stop_tables_; // by topology version
+  uint64_t written_version_ = 0; // stop table the file is currently on
+  std::thread writer_;
+};
+
+// What the servers talk to: the current PlannerSnapshot (swappable at any
+// time, e.g. by a periodic reload) plus the result cache in front of it.
+// Request handlers should grab current() once per request and use that
+// snapshot throughout, so IDs and answers stay consistent mid-swap.
+class PlannerService
+{
+public:
+  // cache_entries == 0 disables the cache.
+  PlannerService(std::shared_ptr<PlannerSnapshot const> snapshot, size_t cache_entries)
+  : current_(snapshot)
+  {
+    if (cache_entries > 0)
+      cache_ = std::make_unique<PlanCache>(cache_entries);
+  }
+
+  std::shared_ptr<PlannerSnapshot const> current() const { return current_.load(); }
+
+  // Logs every plan() from now on; 'log' must outlive this service.
+  void setQueryLog(QueryLog* log) { query_log_ = log; }
+
+  void swap(std::shared_ptr<PlannerSnapshot const> next)
+  {
+    current_.store(next);
+    if (cache_)
+      cache_->invalidate();
+  }
+
+  // planRoute() on 'snapshot', through the cache.
+  bool plan(PlannerSnapshot const& snapshot, StopID src, StopID dst, std::vector<RouteID>* routes)
+  {
+    if (query_log_)
+      query_log_->log(snapshot, src, dst);
+    auto start = std::chrono::steady_clock::now();
+    bool reachable = planThroughCache(snapshot, src, dst, routes);
+    query_seconds_.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    (reachable ? queries_ok_ : queries_unreachable_).fetch_add(1, std::memory_order_relaxed);
+    return reachable;
+  }
+
+  std::optional<PlanCache::Stats> cacheStats() const
+  {
+    if (!cache_)
+      return std::nullopt;
+    return cache_->stats();
+  }
+
+  // Everything this service knows, plus ApiMetrics, in Prometheus text format.
+  std::string prometheusMetrics() const
+  {
+    std::string out;
+    appendPromHeader(&out, "mbta_planner_queries_total", "counter", "Route plans served, by result.");
+    appendPromSample(&out, "mbta_planner_queries_total", "result=\"ok\"", queries_ok_.load());
+    appendPromSample(&out, "mbta_planner_queries_total", "result=\"unreachable\"", queries_unreachable_.load());
+    query_seconds_.render(&out, "mbta_planner_query_duration_seconds", "Route plan latency, cache included.");
+    if (std::optional<PlanCache::Stats> cache = cacheStats())
+    {
+      appendPromHeader(&out, "mbta_plan_cache_lookups_total", "counter", "Plan cache lookups, by outcome.");
+      appendPromSample(&out, "mbta_plan_cache_lookups_total", "outcome=\"hit\"", cache->hits);
+      appendPromSample(&out, "mbta_plan_cache_lookups_total", "outcome=\"miss\"", cache->misses);
+      appendPromSample(&out, "mbta_plan_cache_lookups_total", "outcome=\"coalesced\"", cache->coalesced);
+      appendPromHeader(&out, "mbta_plan_cache_evictions_total", "counter", "Plan cache evictions.");
+      appendPromSample(&out, "mbta_plan_cache_evictions_total", "", cache->evictions);
+      appendPromHeader(&out, "mbta_plan_cache_entries", "gauge", "Plans in the cache.");
+      appendPromSample(&out, "mbta_plan_cache_entries", "", cache->entries);
+    }
+    std::shared_ptr<PlannerSnapshot const> snapshot = current();
+    auto loaded_at = std::chrono::duration<double>(snapshot->loaded_at.time_since_epoch()).count();
+    appendPromHeader(&out, "mbta_topology_version", "gauge", "Topology version; goes up with every reload.");
+    appendPromSample(&out, "mbta_topology_version", "", snapshot->version);
+    appendPromHeader(&out, "mbta_topology_loaded_timestamp_seconds", "gauge", "When the current topology was loaded.");
+    appendPromSample(&out, "mbta_topology_loaded_timestamp_seconds", "", loaded_at);
+    appendPromHeader(&out, "mbta_topology_age_seconds", "gauge", "How long ago the current topology was loaded.");
+    appendPromSample(&out, "mbta_topology_age_seconds", "",
+                     std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count() - loaded_at);
+    appendPromHeader(&out, "mbta_topology_stops", "gauge", "Stations in the current topology.");
+    appendPromSample(&out, "mbta_topology_stops", "", snapshot->planner.topology().numStops());
+    ApiMetrics::global().render(&out);
+    return out;
+  }
+
+private:
+  bool planThroughCache(PlannerSnapshot const& snapshot, StopID src, StopID dst, std::vector<RouteID>* routes)
+  {
+    if (!cache_)
+      return snapshot.planner.planRoute(src, dst, routes);
+    PlanCache::ResultPtr result = cache_->getOrCompute(snapshot.version, src, dst, [&]()
+    {
+      PlanCache::Result computed;
+      computed.reachable = snapshot.planner.planRoute(src, dst, &computed.routes);
+      return computed;
+    });
+    *routes = result->routes;
+    return result->reachable;
+  }
+
+  std::atomic<std::shared_ptr<PlannerSnapshot const>> current_;
+  std::unique_ptr<PlanCache> cache_;
+  QueryLog* query_log_ = nullptr;
+  std::atomic<uint64_t> queries_ok_ = 0;
+  std::atomic<uint64_t> queries_unreachable_ = 0;
+  PromHistogram query_seconds_{{1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4,
+                                1e-3, 2.5e-3, 5e-3, 1e-2, 0.1, 1}};
+};
+
+struct StopResolution
+{
+  std::optional<StopID> stop;
+  bool guessed = false; // 'stop' is the clear winner of a fuzzy lookup
+  std::vector<StopID> candidates; // if there's no 'stop': the closest matches
+};
+
+// What someone typed -> a station. Exact names and IDs go straight through;
+// otherwise we take the best fuzzy match if it's a clear winner, and if it
+// isn't, return the candidates for the user to pick from.
+StopResolution resolveStop(Topology const& topo, StopNameIndex const& index,
+                           std::string const& typed)
+{
+  StopResolution ret;
+  std::vector<StopID> ambiguous_with;
+  ret.stop = topo.resolve(typed, &ambiguous_with);
+  if (ret.stop)
+    return ret;
+  std::vector<StopNameIndex::Match> matches = index.lookup(typed, 5);
+  bool clear_winner = !matches.empty() && ambiguous_with.empty() && matches[0].score >= 0.5f &&
+                      (matches.size() == 1 || matches[0].score - matches[1].score >= 0.15f);
+  if (clear_winner)
+  {
+    ret.stop = matches[0].stop;
+    ret.guessed = true;
+    return ret;
+  }
+  for (auto const& match : matches)
+    ret.candidates.push_back(match.stop);
+  return ret;
+}
+
+// resolveStop() for the interactive loop, explaining itself on stdout.
+std::optional<StopID> resolveTypedStop(Topology const& topo, StopNameIndex const& index,
+                                       std::string const& typed)
+{
+  StopResolution resolution = resolveStop(topo, index, typed);
+  if (resolution.guessed)
+    std::cout << "(taking '" << typed << "' to mean " << topo.displayName(*resolution.stop) << ")\n";
+  if (resolution.stop)
+    return resolution.stop;
+  if (resolution.candidates.empty())
+  {
+    std::cout << typed << ": no such stop.\n";
+    return std::nullopt;
+  }
+  std::cout << "'" << typed << "' could be any of:\n";
+  for (StopID candidate : resolution.candidates)
+    std::cout << "  " << topo.stop_names[candidate] << " (" << topo.stop_ids[candidate] << ")\n";
+  return std::nullopt;
+}
+
+// One line of reachability output, for /reachable and --reachable:
+// {"from":"place-x","reachable":[{"id":"place-y","stops":2,"transfers":0},...]}
+void appendReachableJsonl(std::string* out, Topology const& topo, StopID src,
+                          std::vector<Reachable> const& reachable)
+{
+  *out += "{\"from\":";
+  appendJsonString(out, topo.stop_ids[src]);
+  *out += ",\"reachable\":[";
+  for (size_t i = 0; i < reachable.size(); i++)
+  {
+    *out += i > 0 ? ",{\"id\":" : "{\"id\":";
+    appendJsonString(out, topo.stop_ids[reachable[i].stop]);
+    *out += ",\"stops\":" + std::to_string(reachable[i].stops) +
+            ",\"transfers\":" + std::to_string(reachable[i].transfers) + "}";
+  }
+  *out += "]}\n";
+}
+
+// The JSON-over-HTTP face of a PlannerService, for EventLoopServer:
+//   GET /plan?from=...&to=...    route between two stops (names, fuzzy names or IDs)
+//   GET /plan?from_lat=...&from_lon=...&to=...
+//                                route from a location, by way of the best
+//                                station near it (see planFromLocation())
+//   GET /stops/lookup?q=...&limit=N   ranked stop name matches (for autocomplete)
+//   GET /stops/nearby?lat=...&lon=...&limit=N&radius=M
+//                                closest stations, with distances in meters
+//   GET /reachable?from=A|B|...&max_stops=N&max_transfers=N
+//                                everything within budget of each origin, as
+//                                JSON lines (see appendReachableJsonl())
+//   GET /routes                  every route and its stops
+//   GET /stops                   every station, its routes and child stops
+//   GET /stats                   topology version and cache statistics
+//   GET /memstats                heap use by subsystem (see memoryStats())
+// The two listings only change when the topology does, so they're rendered
+// once per topology version.
+class PlannerHttpApi
+{
+public:
+  explicit PlannerHttpApi(PlannerService& service) : service_(service) {}
+
+  HttpResponse dispatch(HttpRequest const& request)
+  {
+    if (request.method != "GET")
+      return error(405, "only GET is supported");
+    std::shared_ptr<PlannerSnapshot const> snapshot = service_.current();
+    if (request.path == "/plan")
+      return plan(*snapshot, request);
+    if (request.path == "/stops/lookup")
+      return lookup(*snapshot, request);
+    if (request.path == "/stops/nearby")
+      return nearby(*snapshot, request);
+    if (request.path == "/reachable")
+      return reachable(*snapshot, request);
+    if (request.path == "/routes")
+      return HttpResponse{200, listings(snapshot)->routes};
+    if (request.path == "/stops")
+      return HttpResponse{200, listings(snapshot)->stops};
+    if (request.path == "/stats")
+      return stats(*snapshot, request);
+    if (request.path == "/memstats")
+      return HttpResponse{200, memoryStats().dump()};
+    return error(404, "no such endpoint: " + request.path);
+  }
+
+private:
+  struct Listings
+  {
+    uint64_t version;
+    std::string routes;
+    std::string stops;
+  };
+
+  std::shared_ptr<Listings const> listings(std::shared_ptr<PlannerSnapshot const> const& snapshot)
+  {
+    std::lock_guard<std::mutex> lock(listings_mutex_);
+    if (listings_ && listings_->version == snapshot->version)
+      return listings_;
+    Topology const& topo = snapshot->planner.topology();
+    auto rendered = std::make_shared<Listings>();
+    rendered->version = snapshot->version;
+    nlohmann::json routes = nlohmann::json::array();
+    for (RouteID r = 0; r < topo.numRoutes(); r++)
+    {
+      nlohmann::json stops = nlohmann::json::array();
+      for (StopID s : topo.route_stops[r])
+        stops.push_back(topo.stop_ids[s]);
+      routes.push_back({{"id", topo.route_names[r]}, {"stops", stops}});
+    }
+    rendered->routes = routes.dump();
+    nlohmann::json stops = nlohmann::json::array();
+    for (StopID s = 0; s < topo.numStops(); s++)
+    {
+      nlohmann::json stop = stopJson(topo, s);
+      nlohmann::json route_names = nlohmann::json::array();
+      for (RouteID r : topo.routesOf(s))
+        route_names.push_back(topo.route_names[r]);
+      stop["routes"] = route_names;
+      stop["children"] = topo.children_of_stop[s];
+      stops.push_back(stop);
+    }
+    rendered->stops = stops.dump();
+    listings_ = rendered;
+    return listings_;
+  }
+
+  static HttpResponse error(int status, std::string message,
+                            nlohmann::json candidates = nullptr)
+  {
+    nlohmann::json body = {{"error", message}};
+    if (!candidates.is_null())
+      body["candidates"] = candidates;
+    // messages quote what the client sent, which needn't be UTF-8
+    return HttpResponse{status, body.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace)};
+  }
+
+  static nlohmann::json stopJson(Topology const& topo, StopID s)
+  {
+    return {{"id", topo.stop_ids[s]}, {"name", topo.stop_names[s]}};
+  }
+
+  static std::string param(HttpRequest const& request, std::string const& name)
+  {
+    auto it = request.params.find(name);
+    return it == request.params.end() ? "" : it->second;
+  }
+
+  // Fills *stop, or returns the error response to send instead.
+  static std::optional<HttpResponse> resolveParam(PlannerSnapshot const& snapshot,
+                                                  HttpRequest const& request,
+                                                  std::string const& name, StopID* stop)
+  {
+    Topology const& topo = snapshot.planner.topology();
+    std::string typed = param(request, name);
+    if (typed.empty())
+      return error(400, "missing '" + name + "' parameter");
+    StopResolution resolution = resolveStop(topo, snapshot.index, typed);
+    if (resolution.stop)
+    {
+      *stop = *resolution.stop;
+      return std::nullopt;
+    }
+    nlohmann::json candidates = nlohmann::json::array();
+    for (StopID candidate : resolution.candidates)
+      candidates.push_back(stopJson(topo, candidate));
+    if (candidates.empty())
+      return error(404, typed + ": no such stop");
+    return error(409, typed + " is ambiguous", candidates);
+  }
+
+  // Fills *where, or returns the error response to send instead.
+  static std::optional<HttpResponse> locationParams(HttpRequest const& request,
+                                                    std::string const& lat_name,
+                                                    std::string const& lon_name, GeoPoint* where)
+  {
+    double* coordinates[2] = {&where->lat, &where->lon};
+    std::string const* names[2] = {&lat_name, &lon_name};
+    for (int i = 0; i < 2; i++)
+    {
+      std::string value = param(request, *names[i]);
+      if (value.empty())
+        return error(400, "missing '" + *names[i] + "' parameter");
+      char* end;
+      *coordinates[i] = std::strtod(value.c_str(), &end);
+      double limit = i == 0 ? 90 : 180;
+      if (*end || !(std::abs(*coordinates[i]) <= limit))
+        return error(400, *names[i] + " must be a number of degrees");
+    }
+    return std::nullopt;
+  }
+
+  HttpResponse plan(PlannerSnapshot const& snapshot, HttpRequest const& request)
+  {
+    Topology const& topo = snapshot.planner.topology();
+    StopID src, dst;
+    bool from_location = request.params.count("from_lat") || request.params.count("from_lon");
+    GeoPoint here;
+    if (from_location)
+    {
+      if (auto err = locationParams(request, "from_lat", "from_lon", &here))
+        return *err;
+      if (snapshot.planner.stopGrid().empty())
+        return error(404, "stop locations aren't known");
+    }
+    else if (auto err = resolveParam(snapshot, request, "from", &src))
+      return *err;
+    if (auto err = resolveParam(snapshot, request, "to", &dst))
+      return *err;
+    RoutePlanner::LocationPlan located;
+    if (from_location)
+    {
+      if (!snapshot.planner.planFromLocation(here, dst, &located))
+      {
+        nlohmann::json body = {{"to", stopJson(topo, dst)}, {"routes", nullptr},
+                               {"error", "unreachable from any station nearby"}};
+        return HttpResponse{404, body.dump()};
+      }
+      src = located.start;
+    }
+    static thread_local std::vector<RouteID> routes;
+    static thread_local std::vector<StopID> path;
+    bool want_stops = param(request, "stops") == "1";
+    // the cache only holds routes, so stop paths go straight to the planner.
+    bool reachable = want_stops ? snapshot.planner.planRoute(src, dst, &routes, &path)
+                                : service_.plan(snapshot, src, dst, &routes);
+    nlohmann::json body = {{"from", stopJson(topo, src)}, {"to", stopJson(topo, dst)}};
+    if (from_location)
+      body["walk_meters"] = std::lround(located.walk_meters);
+    if (!reachable)
+    {
+      body["routes"] = nullptr;
+      body["error"] = "unreachable";
+      return HttpResponse{404, body.dump()};
+    }
+    nlohmann::json route_names = nlohmann::json::array();
+    for (RouteID r : routes)
+      route_names.push_back(topo.route_names[r]);
+    body["routes"] = route_names;
+    if (want_stops)
+    {
+      nlohmann::json stops = nlohmann::json::array();
+      double meters = 0;
+      for (size_t i = 0; i < path.size(); i++)
+      {
+        stops.push_back(topo.stop_ids[path[i]]);
+        if (i > 0)
+          meters += haversineMeters(topo.stop_locations[path[i - 1]], topo.stop_locations[path[i]]);
+      }
+      body["stops"] = stops;
+      // as the crow flies, stop to stop; left out if a stop has no location.
+      if (!std::isnan(meters))
+        body["meters"] = std::lround(meters);
+    }
+    // alternatives=k: up to k line sequences, best (the one above) first.
+    if (size_t k = std::strtoul(param(request, "alternatives").c_str(), nullptr, 10); k > 0)
+    {
+      static thread_local std::vector<std::vector<RouteID>> alternatives;
+      snapshot.planner.planAlternatives(src, dst, std::min<size_t>(k, 20), &alternatives);
+      nlohmann::json all = nlohmann::json::array();
+      for (std::vector<RouteID> const& alternative : alternatives)
+      {
+        nlohmann::json names = nlohmann::json::array();
+        for (RouteID r : alternative)
+          names.push_back(topo.route_names[r]);
+        all.push_back(names);
+      }
+      body["alternatives"] = all;
+    }
+    return HttpResponse{200, body.dump()};
+  }
+
+  // Budgets default to none. Any origin that doesn't resolve fails the whole
+  // request, like /plan.
+  static HttpResponse reachable(PlannerSnapshot const& snapshot, HttpRequest const& request)
+  {
+    Topology const& topo = snapshot.planner.topology();
+    std::string from = param(request, "from");
+    if (from.empty())
+      return error(400, "missing 'from' parameter");
+    if (std::count(from.begin(), from.end(), '|') >= 100)
+      return error(400, "at most 100 origins per request");
+    std::vector<StopID> origins;
+    for (size_t start = 0; start <= from.size(); )
+    {
+      size_t end = std::min(from.find('|', start), from.size());
+      HttpRequest one;
+      one.params["from"] = from.substr(start, end - start);
+      StopID origin;
+      if (auto err = resolveParam(snapshot, one, "from", &origin))
+        return *err;
+      origins.push_back(origin);
+      start = end + 1;
+    }
+    uint32_t budget[2] = {kNoBudget, kNoBudget};
+    char const* budget_names[2] = {"max_stops", "max_transfers"};
+    for (int i = 0; i < 2; i++)
+      if (std::string value = param(request, budget_names[i]); !value.empty())
+      {
+        char* end;
+        unsigned long parsed = std::strtoul(value.c_str(), &end, 10);
+        if (*end || value[0] == '-' || parsed >= kNoBudget)
+          return error(400, std::string(budget_names[i]) + " must be a number");
+        budget[i] = parsed;
+      }
+    static thread_local std::vector<Reachable> reached;
+    HttpResponse response{200, "", "application/x-ndjson"};
+    for (StopID origin : origins)
+    {
+      snapshot.planner.reachableFrom(origin, budget[0], budget[1], &reached);
+      appendReachableJsonl(&response.body, topo, origin, reached);
+    }
+    return response;
+  }
+
+  // limit defaults to 10 (at most 100); radius, in meters, to none.
+  static HttpResponse nearby(PlannerSnapshot const& snapshot, HttpRequest const& request)
+  {
+    GeoPoint where;
+    if (auto err = locationParams(request, "lat", "lon", &where))
+      return *err;
+    std::string limit = param(request, "limit");
+    size_t max_results = std::min<size_t>(limit.empty() ? 10 : std::strtoul(limit.c_str(), nullptr, 10), 100);
+    static thread_local std::vector<StopGrid::Nearby> found;
+    if (std::string radius = param(request, "radius"); !radius.empty())
+    {
+      char* end;
+      double meters = std::strtod(radius.c_str(), &end);
+      if (*end || !(meters >= 0))
+        return error(400, "radius must be a number of meters");
+      snapshot.planner.stopGrid().within(where, meters, &found);
+      found.resize(std::min(found.size(), max_results));
+    }
+    else
+      snapshot.planner.stopGrid().nearest(where, max_results, &found);
+    nlohmann::json stops = nlohmann::json::array();
+    for (StopGrid::Nearby const& near : found)
+    {
+      nlohmann::json stop = stopJson(snapshot.planner.topology(), near.stop);
+      stop["meters"] = std::lround(near.meters);
+      stops.push_back(stop);
+    }
+    return HttpResponse{200, stops.dump()};
+  }
+
+  static HttpResponse lookup(PlannerSnapshot const& snapshot, HttpRequest const& request)
+  {
+    std::string limit = param(request, "limit");
+    size_t max_results = limit.empty() ? 10 : std::strtoul(limit.c_str(), nullptr, 10);
+    nlohmann::json matches = nlohmann::json::array();
+    for (auto const& match : snapshot.index.lookup(param(request, "q"),
+                                                   std::min<size_t>(max_results, 100)))
+    {
+      nlohmann::json stop = stopJson(snapshot.planner.topology(), match.stop);
+      stop["score"] = match.score;
+      matches.push_back(stop);
+    }
+    return HttpResponse{200, matches.dump()};
+  }
+
+  // ?query_stats=on|off turns per-query histograms on or off at runtime.
+  HttpResponse stats(PlannerSnapshot const& snapshot, HttpRequest const& request)
+  {
+    if (auto toggle = request.params.find("query_stats"); toggle != request.params.end())
+    {
+      if (toggle->second != "on" && toggle->second != "off")
+        return error(400, "query_stats must be on or off");
+      QueryStats::enabled() = toggle->second == "on";
+    }
+    nlohmann::json body = {
+      {"topology_version", snapshot.version},
+      {"topology_loaded_at", std::chrono::system_clock::to_time_t(snapshot.loaded_at)},
+      {"stops", snapshot.planner.topology().numStops()},
+      {"routes", snapshot.planner.topology().numRoutes()}};
+    if (std::optional<PlanCache::Stats> cache = service_.cacheStats())
+      body["cache"] = {{"hits", cache->hits}, {"misses", cache->misses},
+                       {"coalesced", cache->coalesced}, {"evictions", cache->evictions},
+                       {"entries", cache->entries}};
+    body["planner_queries"] = QueryStats::snapshot();
+    return HttpResponse{200, body.dump()};
+  }
+
+  PlannerService& service_;
+  std::mutex listings_mutex_;
+  std::shared_ptr<Listings const> listings_;
+};
+
+// Length-prefixed binary protocol, for co-located callers that can't afford
+// HTTP + JSON per query (served over a unix socket by --uds). All integers
+// are native-endian, since both ends are on the same host.
+//
+// Every frame, both ways: u32 payload length, then the payload.
+// Request payload:  u32 request_id, u8 opcode, then per opcode:
+//   kPlan         u16 n, n x (u32 src StopID, u32 dst StopID)
+//   kPlanNames    u16 n, n x (str src, str dst), with names or IDs as in resolveStop()
+//   kResolve      u16 n, n x str
+//   kRouteNames   (nothing)
+//   kStopIds      (nothing)
+//   kTopologyVersion  (nothing)
+// where str is u16 length + bytes.
+// Response payload: u32 request_id (echoed), u8 status (0 ok, 1 malformed
+// request), then if ok, per opcode:
+//   kPlan, kPlanNames   u16 n, n x (u8 result, u8 k, k x u16 RouteID), where
+//                       result is 0 ok, 1 unknown stop, 2 unreachable
+//   kResolve            u16 n, n x u32 StopID (kNoStop if unresolved)
+//   kRouteNames         u16 n, n x str, indexed by RouteID
+//   kStopIds            u32 n, n x str (canonical IDs), indexed by StopID
+//   kTopologyVersion    u64 version
+// Clients normally fetch the two tables once, then send kPlan with integer
+// IDs. Those IDs hold until the topology is reloaded, which bumps
+// kTopologyVersion; poll it if you run against a --reload-minutes server.
+// Many pairs per frame, and many frames in flight per connection, are both
+// fine: responses come back in request order.
+class BinaryPlannerProtocol
+{
+public:
+  enum Opcode : uint8_t
+  {
+    kPlan = 1, kPlanNames = 2, kResolve = 3, kRouteNames = 4, kStopIds = 5, kTopologyVersion = 6
+  };
+  static uint32_t constexpr kNoStop = UINT32_MAX;
+  static uint32_t constexpr kMaxFrameBytes = 16 << 20;
+
+  explicit BinaryPlannerProtocol(PlannerService& service) : service_(service) {}
+
+  // A ProtocolHandler for EventLoopServer.
+  bool handle(std::string& in, std::string& out)
+  {
+    size_t consumed = 0;
+    bool ok = true;
+    std::shared_ptr<PlannerSnapshot const> snapshot = service_.current();
+    while (in.size() - consumed >= 4)
+    {
+      uint32_t length;
+      memcpy(&length, in.data() + consumed, 4);
+      if (length > kMaxFrameBytes)
+      {
+        ok = false; // can't resync after a garbage length; drop the connection
+        break;
+      }
+      if (in.size() - consumed - 4 < length)
+        break;
+      Reader request{std::string_view(in.data() + consumed + 4, length)};
+      consumed += 4 + length;
+
+      size_t frame_start = out.size();
+      appendBinary<uint32_t>(&out, 0); // length, patched below
+      uint32_t request_id = request.get<uint32_t>();
+      uint8_t opcode = request.get<uint8_t>();
+      appendBinary<uint32_t>(&out, request_id);
+      appendBinary<uint8_t>(&out, 0);
+      if (request.bad || !respond(*snapshot, opcode, &request, &out) || request.bad)
+      {
+        out.resize(frame_start + 9); // length, request_id, status
+        out.back() = 1;
+      }
+      uint32_t payload_length = out.size() - frame_start - 4;
+      memcpy(out.data() + frame_start, &payload_length, 4);
+    }
+    in.erase(0, consumed);
+    return ok;
+  }
+
+private:
+  // Bounds-checked cursor over a request payload; reading past the end just
+  // sets 'bad'.
+  struct Reader
+  {
+    std::string_view data;
+    bool bad = false;
+
+    template<typename T>
+    T get()
+    {
+      T value{};
+      if (data.size() < sizeof(T))
+      {
+        bad = true;
+        return value;
+      }
+      memcpy(&value, data.data(), sizeof(T));
+      data.remove_prefix(sizeof(T));
+      return value;
+    }
+
+    std::string_view getString()
+    {
+      uint16_t length = get<uint16_t>();
+      if (bad || data.size() < length)
+      {
+        bad = true;
+        return {};
+      }
+      std::string_view ret = data.substr(0, length);
+      data.remove_prefix(length);
+      return ret;
+    }
+  };
+
+  static void appendString(std::string* out, std::string_view s)
+  {
+    appendBinary<uint16_t>(out, s.size());
+    out->append(s);
+  }
+
+  static std::optional<StopID> resolve(PlannerSnapshot const& snapshot, std::string_view typed)
+  {
+    return resolveStop(snapshot.planner.topology(), snapshot.index, std::string(typed)).stop;
+  }
+
+  void appendPlan(PlannerSnapshot const& snapshot, std::optional<StopID> src,
+                  std::optional<StopID> dst, std::string* out)
+  {
+    static thread_local std::vector<RouteID> routes;
+    size_t num_stops = snapshot.planner.topology().numStops();
+    if (!src || !dst || *src >= num_stops || *dst >= num_stops)
+    {
+      appendBinary<uint8_t>(out, 1);
+      appendBinary<uint8_t>(out, 0);
+      return;
+    }
+    if (!service_.plan(snapshot, *src, *dst, &routes))
+    {
+      appendBinary<uint8_t>(out, 2);
+      appendBinary<uint8_t>(out, 0);
+      return;
+    }
+    appendBinary<uint8_t>(out, 0);
+    appendBinary<uint8_t>(out, std::min<size_t>(routes.size(), 255));
+    for (size_t i = 0; i < routes.size() && i < 255; i++)
+      appendBinary<uint16_t>(out, routes[i]);
+  }
+
+  // Returns false if the opcode is unknown.
+  bool respond(PlannerSnapshot const& snapshot, uint8_t opcode, Reader* request, std::string* out)
+  {
+    Topology const& topo = snapshot.planner.topology();
+    switch (opcode)
+    {
+      case kPlan:
+      {
+        uint16_t n = request->get<uint16_t>();
+        appendBinary<uint16_t>(out, n);
+        for (uint16_t i = 0; i < n && !request->bad; i++)
+        {
+          StopID src = request->get<uint32_t>();
+          StopID dst = request->get<uint32_t>();
+          appendPlan(snapshot, src, dst, out);
+        }
+        return true;
+      }
+      case kPlanNames:
+      {
+        uint16_t n = request->get<uint16_t>();
+        appendBinary<uint16_t>(out, n);
+        for (uint16_t i = 0; i < n && !request->bad; i++)
+        {
+          std::string_view src = request->getString();
+          std::string_view dst = request->getString();
+          appendPlan(snapshot, resolve(snapshot, src), resolve(snapshot, dst), out);
+        }
+        return true;
+      }
+      case kResolve:
+      {
+        uint16_t n = request->get<uint16_t>();
+        appendBinary<uint16_t>(out, n);
+        for (uint16_t i = 0; i < n && !request->bad; i++)
+          appendBinary<uint32_t>(out, resolve(snapshot, request->getString()).value_or(kNoStop));
+        return true;
+      }
+      case kRouteNames:
+        appendBinary<uint16_t>(out, topo.numRoutes());
+        for (std::string const& name : topo.route_names)
+          appendString(out, name);
+        return true;
+      case kStopIds:
+        appendBinary<uint32_t>(out, topo.numStops());
+        for (std::string const& id : topo.stop_ids)
+          appendString(out, id);
+        return true;
+      case kTopologyVersion:
+        appendBinary<uint64_t>(out, snapshot.version);
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  PlannerService& service_;
+};
+
+// ================= BEGIN batch mode ========================================
+
+enum class BatchFormat { kJsonl, kCsv, kBinary };
+
+struct BatchSummary
+{
+  uint64_t pairs = 0;
+  uint64_t planned = 0;
+  uint64_t unresolved = 0;
+  uint64_t unreachable = 0;
+  uint64_t bytes_out = 0;
+  double seconds = 0;
+};
+
+// Plans every (from, to) pair in 'in' - one per line, separated by a tab, or
+// else by the first comma - across 'threads' threads, writing one result per
+// pair to out_fd, in input order. Stops can be names, fuzzy names or IDs.
+//
+// Output formats:
+//  - jsonl: {"from":"place-x","to":"place-y","routes":["Red","Orange"]}, with
+//    "guessed":true added if either stop came from a fuzzy match, or
+//    {"line":N,"error":"...","from":"typed","to":"typed"} (N counts blank
+//    lines too)
+//  - csv: from,to,status,routes (routes joined with '|'; status ok, unresolved
+//    or unreachable; unresolved rows echo what was typed)
+//  - binary (native endianness): "MBTB" u32 version=1, u32 num_routes, then
+//    each route name as u16 length + bytes, then the same for stop IDs. Then
+//    per pair: u32 from StopID, u32 to StopID (0xFFFFFFFF if unresolved),
+//    u8 status (0 ok, 1 unresolved, 2 unreachable), u8 n, n x u16 RouteID.
+//
+// Input is taken a chunk at a time and each chunk's output is rendered in
+// per-block buffers, so memory stays flat no matter how big the input is.
+BatchSummary runBatch(RoutePlanner const& planner, StopNameIndex const& index,
+                      std::istream& in, int out_fd, BatchFormat format, int threads)
+{
+  Topology const& topo = planner.topology();
+  auto start_time = std::chrono::steady_clock::now();
+  BatchSummary summary;
+  BufferedWriter writer(out_fd);
+
+  if (format == BatchFormat::kCsv)
+    writer.append("from,to,status,routes\n");
+  if (format == BatchFormat::kBinary)
+  {
+    std::string header = "MBTB";
+    appendBinary<uint32_t>(&header, 1);
+    for (auto const* names : {&topo.route_names, &topo.stop_ids})
+    {
+      appendBinary<uint32_t>(&header, names->size());
+      for (std::string const& name : *names)
+      {
+        appendBinary<uint16_t>(&header, name.size());
+        header += name;
+      }
+    }
+    writer.append(header);
+  }
+
+  size_t constexpr kChunkLines = 1 << 16;
+  size_t constexpr kBlockLines = 1024;
+  std::vector<std::string> lines;
+  std::vector<uint64_t> line_numbers; // of lines[i] in the input, from 1
+  std::vector<std::string> block_out((kChunkLines + kBlockLines - 1) / kBlockLines);
+  std::atomic<uint64_t> planned = 0, unresolved = 0, unreachable = 0;
+  uint64_t line_number = 0;
+  while (true)
+  {
+    lines.clear();
+    line_numbers.clear();
+    std::string line;
+    while (lines.size() < kChunkLines && std::getline(in, line))
+    {
+      line_number++;
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+      if (!line.empty())
+      {
+        lines.push_back(std::move(line));
+        line_numbers.push_back(line_number);
+      }
+    }
+    if (lines.empty())
+      break;
+
+    size_t num_blocks = (lines.size() + kBlockLines - 1) / kBlockLines;
+    parallelFor(num_blocks, threads, [&](size_t block)
+    {
+      std::string& out = block_out[block];
+      out.clear();
+      std::vector<RouteID> routes;
+      size_t end = std::min(lines.size(), (block + 1) * kBlockLines);
+      for (size_t i = block * kBlockLines; i < end; i++)
+      {
+        std::string_view pair = lines[i];
+        size_t split = pair.find('\t');
+        if (split == std::string_view::npos)
+          split = pair.find(',');
+        std::string from(pair.substr(0, split));
+        std::string to(split == std::string_view::npos ? "" : pair.substr(split + 1));
+        StopResolution src_resolution = resolveStop(topo, index, from);
+        StopResolution dst_resolution = resolveStop(topo, index, to);
+        std::optional<StopID> src = src_resolution.stop, dst = dst_resolution.stop;
+        bool guessed = src_resolution.guessed || dst_resolution.guessed;
+        int status = 0;
+        if (!src || !dst)
+        {
+          status = 1;
+          unresolved++;
+        }
+        else if (!planner.planRoute(*src, *dst, &routes))
+        {
+          status = 2;
+          unreachable++;
+        }
+        else
+          planned++;
+        if (status != 0)
+          routes.clear();
+
+        if (format == BatchFormat::kJsonl)
+        {
+          if (status == 1)
+          {
+            out += "{\"line\":" + std::to_string(line_numbers[i]) +
+                   ",\"error\":\"unresolved stop\",\"from\":";
+            appendJsonString(&out, from);
+            out += ",\"to\":";
+            appendJsonString(&out, to);
+            out += "}\n";
+            continue;
+          }
+          out += "{\"from\":";
+          appendJsonString(&out, topo.stop_ids[*src]);
+          out += ",\"to\":";
+          appendJsonString(&out, topo.stop_ids[*dst]);
+          if (guessed)
+            out += ",\"guessed\":true";
+          if (status == 2)
+          {
+            out += ",\"routes\":null,\"error\":\"unreachable\"}\n";
+            continue;
+          }
+          out += ",\"routes\":[";
+          for (size_t r = 0; r < routes.size(); r++)
+          {
+            if (r > 0)
+              out += ',';
+            appendJsonString(&out, topo.route_names[routes[r]]);
+          }
+          out += "]}\n";
+        }
+        else if (format == BatchFormat::kCsv)
+        {
+          appendCsvField(&out, status == 1 ? from : topo.stop_ids[*src]);
+          out += ',';
+          appendCsvField(&out, status == 1 ? to : topo.stop_ids[*dst]);
+          out += status == 0 ? ",ok," : status == 1 ? ",unresolved," : ",unreachable,";
+          for (size_t r = 0; r < routes.size(); r++)
+          {
+            if (r > 0)
+              out += '|';
+            appendCsvField(&out, topo.route_names[routes[r]]);
+          }
+          out += '\n';
+        }
+        else
+        {
+          appendBinary<uint32_t>(&out, src && dst ? *src : UINT32_MAX);
+          appendBinary<uint32_t>(&out, src && dst ? *dst : UINT32_MAX);
+          appendBinary<uint8_t>(&out, status);
+          appendBinary<uint8_t>(&out, std::min<size_t>(routes.size(), 255));
+          for (size_t r = 0; r < routes.size() && r < 255; r++)
+            appendBinary<uint16_t>(&out, routes[r]);
+        }
+      }
+    });
+    for (size_t block = 0; block < num_blocks; block++)
+      writer.append(block_out[block]);
+    summary.pairs += lines.size();
+  }
+  writer.flush();
+
+  summary.planned = planned;
+  summary.unresolved = unresolved;
+  summary.unreachable = unreachable;
+  summary.bytes_out = writer.bytesWritten();
+  summary.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+  return summary;
+}
+
+// --reachable: reachableFrom() each origin in 'in' (one per line; names,
+// fuzzy names or IDs), writing a JSON line per origin to out_fd in input
+// order (see appendReachableJsonl()), or {"line":N,"error":"unresolved
+// stop","from":"typed"}. Origins are taken a few per thread at a time and
+// each batch is written out as soon as it's done, so results stream.
+// Returns the number of origins.
+uint64_t runReachableBatch(RoutePlanner const& planner, StopNameIndex const& index, std::istream& in,
+                           int out_fd, uint32_t max_stops, uint32_t max_transfers, int threads)
+{
+  Topology const& topo = planner.topology();
+  BufferedWriter writer(out_fd);
+  std::vector<std::string> lines, outs;
+  std::vector<uint64_t> line_numbers; // of lines[i] in the input, from 1
+  uint64_t origins = 0, line_number = 0;
+  while (true)
+  {
+    lines.clear();
+    line_numbers.clear();
+    std::string line;
+    while (lines.size() < 4 * (size_t)threads && std::getline(in, line))
+    {
+      line_number++;
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+      if (!line.empty())
+      {
+        lines.push_back(std::move(line));
+        line_numbers.push_back(line_number);
+      }
+    }
+    if (lines.empty())
+      break;
+    outs.resize(lines.size());
+    parallelFor(lines.size(), threads, [&](size_t i)
+    {
+      static thread_local std::vector<Reachable> reached;
+      outs[i].clear();
+      std::optional<StopID> src = resolveStop(topo, index, lines[i]).stop;
+      if (!src)
+      {
+        outs[i] = "{\"line\":" + std::to_string(line_numbers[i]) + ",\"error\":\"unresolved stop\",\"from\":";
+        appendJsonString(&outs[i], lines[i]);
+        outs[i] += "}\n";
+        return;
+      }
+      planner.reachableFrom(*src, max_stops, max_transfers, &reached);
+      appendReachableJsonl(&outs[i], topo, *src, reached);
+    });
+    for (size_t i = 0; i < lines.size(); i++)
+      writer.append(outs[i]);
+    writer.flush();
+    origins += lines.size();
+  }
+  return origins;
+}
+
+// ================= END batch mode ==========================================
+
+// ================= BEGIN bit-parallel BFS ==================================
+
+// Sources per multiSourceBFS() batch. Four words, so OR-ing two sets is a
+// couple of SIMD instructions.
+size_t constexpr kBfsBatch = 256;
+using SourceSet = std::array<uint64_t, kBfsBatch / 64>;
+
+// Calls f(i) for every source i in 'set'.
+template <typename F>
+void forEachSource(SourceSet const& set, F f)
+{
+  for (size_t word = 0; word < set.size(); word++)
+    for (uint64_t bits = set[word]; bits; bits &= bits - 1)
+      f(word * 64 + std::countr_zero(bits));
+}
+
+// Breadth-first search from up to kBfsBatch sources at once, for all-pairs
+// work (hop counts, eccentricity, the diameter). Every stop has a set of the
+// sources that have reached it, and each level is one pass over the
+// adjacency: a stop picks up whatever its neighbors' frontier sets hold that
+// it hasn't seen yet. So the whole batch costs about one pass per level (a
+// few dozen on the MBTA) rather than one BFS per source. Stops every source
+// has already reached are skipped.
+//
+// on_level(depth, reached) is called for depth 0, 1, ... with reached[stop]
+// the sources (i for sources[i]) that first get to each stop at that depth,
+// empty for most.
+template <typename OnLevel>
+void multiSourceBFS(Topology const& topo, std::span<StopID const> sources, OnLevel on_level)
+{
+  struct Scratch
+  {
+    std::vector<SourceSet> seen, frontier, next;
+  };
+  static thread_local Scratch scratch;
+  size_t n = topo.numStops();
+  if (sources.size() > kBfsBatch)
+    crash("multiSourceBFS: more than " + std::to_string(kBfsBatch) + " sources");
+  scratch.seen.assign(n, {});
+  scratch.frontier.assign(n, {});
+  scratch.next.resize(n);
+  SourceSet all = {};
+  for (size_t i = 0; i < sources.size(); i++)
+  {
+    all[i / 64] |= 1ull << i % 64;
+    scratch.seen[sources[i]][i / 64] |= 1ull << i % 64;
+  }
+  scratch.frontier = scratch.seen;
+  on_level(0, std::span<SourceSet const>(scratch.frontier));
+  for (uint32_t depth = 1;; depth++)
+  {
+    uint64_t any = 0;
+    for (StopID stop = 0; stop < n; stop++)
+    {
+      SourceSet fresh = {};
+      SourceSet& seen = scratch.seen[stop];
+      if (seen != all)
+      {
+        for (StopID neighbor : topo.neighbors(stop))
+          for (size_t word = 0; word < fresh.size(); word++)
+            fresh[word] |= scratch.frontier[neighbor][word];
+        for (size_t word = 0; word < fresh.size(); word++)
+        {
+          fresh[word] &= ~seen[word];
+          seen[word] |= fresh[word];
+          any |= fresh[word];
+        }
+      }
+      scratch.next[stop] = fresh;
+    }
+    if (!any)
+      return;
+    std::swap(scratch.frontier, scratch.next);
+    on_level(depth, std::span<SourceSet const>(scratch.frontier));
+  }
+}
+
+uint16_t constexpr kUnreachableHops = UINT16_MAX;
+
+// Hops between every pair of stops, row src and column dst (so n*n of them),
+// kUnreachableHops where there's no path. Batches of sources are spread over
+// 'threads' threads.
+std::vector<uint16_t> allPairsHops(Topology const& topo, int threads)
+{
+  size_t n = topo.numStops();
+  std::vector<uint16_t> hops(n * n, kUnreachableHops);
+  parallelFor((n + kBfsBatch - 1) / kBfsBatch, threads, [&](size_t batch)
+  {
+    std::vector<StopID> sources;
+    for (StopID src = batch * kBfsBatch; src < std::min(n, (batch + 1) * kBfsBatch); src++)
+      sources.push_back(src);
+    multiSourceBFS(topo, sources, [&](uint32_t depth, std::span<SourceSet const> reached)
+    {
+      for (StopID stop = 0; stop < n; stop++)
+        forEachSource(reached[stop], [&](size_t i) { hops[sources[i] * n + stop] = depth; });
+    });
+  });
+  return hops;
+}
+
+// How far things are from each stop, over every pair. Same batching as
+// allPairsHops(), without keeping the matrix.
+struct HopSummary
+{
+  // Hops to the farthest stop it can reach, and that stop (itself if none).
+  std::vector<uint32_t> eccentricity;
+  std::vector<StopID> farthest;
+  // Mean hops to the other stops it can reach (0 if none).
+  std::vector<double> mean_hops;
+  // The longest shortest path, and a pair at its ends.
+  uint32_t diameter = 0;
+  StopID diameter_from = 0, diameter_to = 0;
+};
+
+HopSummary hopSummary(Topology const& topo, int threads)
+{
+  size_t n = topo.numStops();
+  HopSummary ret;
+  ret.eccentricity.assign(n, 0);
+  ret.farthest.resize(n);
+  ret.mean_hops.assign(n, 0);
+  parallelFor((n + kBfsBatch - 1) / kBfsBatch, threads, [&](size_t batch)
+  {
+    std::vector<StopID> sources;
+    for (StopID src = batch * kBfsBatch; src < std::min(n, (batch + 1) * kBfsBatch); src++)
+      sources.push_back(src);
+    std::vector<uint64_t> hop_sum(sources.size()), reached_count(sources.size());
+    std::vector<uint32_t> eccentricity(sources.size());
+    std::vector<StopID> farthest(sources.size());
+    multiSourceBFS(topo, sources, [&](uint32_t depth, std::span<SourceSet const> reached)
+    {
+      for (StopID stop = 0; stop < n; stop++)
+        forEachSource(reached[stop], [&](size_t i)
+        {
+          hop_sum[i] += depth;
+          reached_count[i]++;
+          eccentricity[i] = depth;
+          farthest[i] = stop;
+        });
+    });
+    for (size_t i = 0; i < sources.size(); i++)
+    {
+      ret.eccentricity[sources[i]] = eccentricity[i];
+      ret.farthest[sources[i]] = farthest[i];
+      if (reached_count[i] > 1)
+        ret.mean_hops[sources[i]] = double(hop_sum[i]) / (reached_count[i] - 1);
+    }
+  });
+  for (StopID stop = 0; stop < n; stop++)
+    if (ret.eccentricity[stop] > ret.diameter)
+    {
+      ret.diameter = ret.eccentricity[stop];
+      ret.diameter_from = stop;
+      ret.diameter_to = ret.farthest[stop];
+    }
+  return ret;
+}
+
+// ================= END bit-parallel BFS ====================================
+
+// ================= BEGIN benchmarks ========================================
+
+// One row of --bench output. Latencies are per query, on one thread.
+struct BenchResult
+{
+  std::string name;
+  size_t queries = 0;
+  double p50_us = 0, p99_us = 0, max_us = 0;
+  double queries_per_second = 0;
+  double allocations_per_query = 0;
+};
+
+// Times query(i) for i in [0, n), after an untimed warm-up pass over the
+// first few, so per-thread scratch buffers are already grown.
+template <typename Query>
+BenchResult benchmark(std::string name, size_t n, Query query)
+{
+  for (size_t i = 0; i < std::min<size_t>(n, 1000); i++)
+    query(i);
+  std::vector<double> latencies(n);
+  uint64_t allocations_before = t_allocations;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; i++)
+  {
+    auto query_start = std::chrono::steady_clock::now();
+    query(i);
+    latencies[i] = std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now() - query_start).count();
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  BenchResult result;
+  result.name = std::move(name);
+  result.queries = n;
+  result.allocations_per_query = n ? double(t_allocations - allocations_before) / n : 0;
+  if (n == 0)
+    return result;
+  std::sort(latencies.begin(), latencies.end());
+  result.p50_us = latencies[n / 2];
+  result.p99_us = latencies[std::min(n - 1, n * 99 / 100)];
+  result.max_us = latencies.back();
+  result.queries_per_second = n / seconds;
+  return result;
+}
+
+// The hand-checked cases from the README.
+std::vector<std::pair<std::string, std::string>> const kReadmeCases = {
+  {"Copley", "Mattapan"}, {"Mattapan", "Copley"}, {"Kendall/MIT", "Braintree"},
+  {"Braintree", "Kendall/MIT"}, {"Forest Hills", "Wonderland"}, {"Wonderland", "Forest Hills"},
+  {"Park Street", "Charles/MGH"}, {"Charles/MGH", "Park Street"}, {"North Station", "Haymarket"},
+  {"Haymarket", "North Station"}, {"Alewife", "Davis"}, {"Davis", "Alewife"},
+  {"Boston College", "Mattapan"}, {"Mattapan", "Boston College"},
+  {"Boston College", "Braintree"}, {"Braintree", "Boston College"},
+};
+
+// --bench: latency percentiles, single-thread throughput and allocations per
+// query for each of
+//  - the README cases, through the string API (plotRouteFromTo)
+//  - all pairs (every k'th source, if there are more than ~4M pairs)
+//  - random pairs, also run on every core for aggregate throughput
+//  - the longest trips we can find
+// all through whichever --engine is attached. Run it on a --snapshot so that
+// numbers are comparable between builds.
+void runBenchmarks(RoutePlanner const& planner, int threads)
+{
+  Topology const& topo = planner.topology();
+  size_t n = topo.numStops();
+  if (n < 2)
+  {
+    std::cerr << "Nothing to benchmark: the network has " << n << " stops" << std::endl;
+    return;
+  }
+  std::vector<BenchResult> results;
+  std::vector<RouteID> routes;
+
+  std::vector<std::pair<std::string, std::string>> readme;
+  for (auto const& [from, to] : kReadmeCases)
+    if (topo.resolve(from) && topo.resolve(to))
+      readme.push_back({from, to});
+  if (!readme.empty())
+  {
+    size_t repeats = 2000;
+    results.push_back(benchmark("readme cases (plotRouteFromTo)", readme.size() * repeats, [&](size_t i)
+    {
+      auto const& [from, to] = readme[i % readme.size()];
+      planner.plotRouteFromTo(from, to);
+    }));
+  }
+
+  size_t kMaxPairs = 4'000'000;
+  size_t source_stride = std::max<size_t>(1, (n * n + kMaxPairs - 1) / kMaxPairs);
+  size_t sources = (n + source_stride - 1) / source_stride;
+  results.push_back(benchmark(source_stride == 1 ? "all pairs"
+                              : "all pairs (every " + std::to_string(source_stride) + "th source)",
+                              sources * n, [&](size_t i)
+  {
+    planner.planRoute(i / n * source_stride, i % n, &routes);
+  }));
+
+  std::mt19937_64 rng(42);
+  std::vector<std::pair<StopID, StopID>> random_pairs(200'000);
+  for (auto& [src, dst] : random_pairs)
+    src = rng() % n, dst = rng() % n;
+  results.push_back(benchmark("random pairs", random_pairs.size(), [&](size_t i)
+  {
+    planner.planRoute(random_pairs[i].first, random_pairs[i].second, &routes);
+  }));
+  auto start = std::chrono::steady_clock::now();
+  parallelFor(random_pairs.size(), threads, [&](size_t i)
+  {
+    static thread_local std::vector<RouteID> thread_routes;
+    planner.planRoute(random_pairs[i].first, random_pairs[i].second, &thread_routes);
+  });
+  double parallel_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  // Longest trips: the farthest stop from each source.
+  std::vector<std::tuple<uint32_t, StopID, StopID>> longest;
+  HopSummary hops = hopSummary(topo, threads);
+  for (StopID src = 0; src < n; src++)
+    longest.emplace_back(hops.eccentricity[src], src, hops.farthest[src]);
+  std::sort(longest.rbegin(), longest.rend());
+  longest.resize(std::min<size_t>(longest.size(), 32));
+  results.push_back(benchmark("longest trips (" + std::to_string(std::get<0>(longest.front())) +
+                              " stops at most)", longest.size() * 1000, [&](size_t i)
+  {
+    auto const& [length, src, dst] = longest[i % longest.size()];
+    planner.planRoute(src, dst, &routes);
+  }));
+
+  std::printf("%zu stops, %zu routes\n", n, topo.numRoutes());
+  std::printf("%-44s %10s %9s %9s %9s %12s %13s\n", "case", "queries", "p50 us", "p99 us",
+              "max us", "queries/s", "allocs/query");
+  for (BenchResult const& r : results)
+    std::printf("%-44s %10zu %9.2f %9.2f %9.2f %12.0f %13.2f\n", r.name.c_str(), r.queries,
+                r.p50_us, r.p99_us, r.max_us, r.queries_per_second, r.allocations_per_query);
+  std::printf("random pairs on %d threads: %.0f queries/s\n", threads,
+              random_pairs.size() / parallel_seconds);
+}
+
+// ================= END benchmarks ==========================================
+
+// ================= BEGIN differential testing ==============================
+
+// The original planner, from before the interned topology: string-keyed BFS
+// plus greedilyStayOnRoute(), kept as close to the first version as it can
+// be, so that --difftest has something simple and independent to hold the
+// engines to. Differences: stops are keyed by ID rather than display name,
+// it returns false where it used to crash(), and it's const (.at() for
+// operator[]) so threads can share it. Plus two fixes that RoutePlanner has
+// too: BFS marks a stop visited when it's discovered rather than when it's
+// dequeued (otherwise a later stop at the same depth can overwrite its
+// backlink, and the path comes out longer than the shortest), and
+// greedilyStayOnRoute() no longer reads past the end of the path when a leg
+// starts at the last stop.
+class ReferencePlanner
+{
+public:
+  explicit ReferencePlanner(Topology const& topo)
+  {
+    for (StopID stop = 0; stop < topo.numStops(); stop++)
+    {
+      std::vector<std::string>& adjacent = adjacency_lists_[topo.stop_ids[stop]];
+      for (StopID neighbor : topo.neighbors(stop))
+        adjacent.push_back(topo.stop_ids[neighbor]);
+      std::set<std::string>& routes = routes_of_stop_[topo.stop_ids[stop]];
+      for (RouteID route : topo.routesOf(stop))
+        routes.insert(topo.route_names[route]);
+    }
+  }
+
+  // The line names to take from 'src' to 'dst' (stop IDs, which must differ),
+  // and the stops along the way. False if dst can't be reached.
+  bool plotRouteFromTo(std::string src, std::string dst, std::vector<std::string>* routes_to_travel,
+                       std::vector<std::string>* our_path) const
+  {
+    std::unordered_map<std::string, std::string> backlinks;
+    if (!backlinksBFS(src, dst, &backlinks))
+      return false;
+
+    // assemble path from backlinks
+    our_path->clear();
+    std::string cur_hop = dst;
+    do
+    {
+      our_path->push_back(cur_hop);
+      cur_hop = backlinks[cur_hop];
+    } while (cur_hop != src);
+    our_path->push_back(cur_hop);
+    std::reverse(our_path->begin(), our_path->end());
+
+    int station_index = 0;
+    routes_to_travel->clear();
+    while (station_index < our_path->size())
+    {
+      auto [route_name, next_stop_ind] = greedilyStayOnRoute(*our_path, station_index);
+      station_index = next_stop_ind;
+      routes_to_travel->push_back(route_name);
+    }
+    return true;
+  }
+
+private:
+  bool backlinksBFS(std::string src, std::string dst,
+                    std::unordered_map<std::string, std::string>* backlinks) const
+  {
+    std::unordered_set<std::string> visited = {src};
+    std::queue<std::string> to_visit;
+    to_visit.push(src);
+    while (!to_visit.empty() && !visited.contains(dst))
+    {
+      std::string cur = to_visit.front();
+      to_visit.pop();
+      for (std::string const& neighbor : adjacency_lists_.at(cur))
+      {
+        if (visited.contains(neighbor))
+          continue;
+        visited.insert(neighbor);
+        to_visit.push(neighbor);
+        (*backlinks)[neighbor] = cur;
+      }
+    }
+    return visited.contains(dst);
+  }
+
+  std::pair<std::string, int> greedilyStayOnRoute(std::vector<std::string> const& path,
+                                                  int station_index) const
+  {
+    std::set<std::string> candidates = routes_of_stop_.at(path[station_index++]);
+    while (true)
+    {
+      if (station_index >= path.size())
+        return std::make_pair(*candidates.begin(), station_index);
+      std::set<std::string> new_candidates;
+      std::set<std::string> const& here = routes_of_stop_.at(path[station_index]);
+      std::set_intersection(candidates.begin(), candidates.end(), here.begin(), here.end(),
+                            std::inserter(new_candidates, new_candidates.begin()));
+      if (new_candidates.empty())
+        return std::make_pair(*candidates.begin(), station_index);
+      station_index++;
+      candidates = new_candidates;
+    }
+  }
+
+  std::unordered_map<std::string, std::vector<std::string>> adjacency_lists_;
+  std::unordered_map<std::string, std::set<std::string>> routes_of_stop_;
+};
+
+// How one engine's answers compared with ReferencePlanner's.
+struct DiffCounts
+{
+  uint64_t pairs = 0;
+  uint64_t reachability = 0; // one found a route and the other didn't
+  uint64_t longer = 0; // more stops on the path than the reference
+  uint64_t shorter = 0;
+  // Same path length, but more or fewer lines. Equally short paths can need
+  // different numbers of lines, so engines that break ties differently
+  // (matrix, ch) or pick lines differently (patterns) land here; it's
+  // reported, but not counted as a divergence.
+  uint64_t more_transfers = 0;
+  uint64_t fewer_transfers = 0;
+  uint64_t invalid = 0; // path doesn't run src -> dst along actual edges
+  std::vector<std::string> examples; // the first few divergences, spelled out
+
+  uint64_t divergences() const { return reachability + longer + shorter + invalid; }
+
+  void add(DiffCounts const& other)
+  {
+    pairs += other.pairs;
+    reachability += other.reachability;
+    longer += other.longer;
+    shorter += other.shorter;
+    more_transfers += other.more_transfers;
+    fewer_transfers += other.fewer_transfers;
+    invalid += other.invalid;
+    for (std::string const& example : other.examples)
+      if (examples.size() < 5)
+        examples.push_back(example);
+  }
+};
+
+// Every engine we have, built over 'topo', by name. Except LineGraph and
+// GeoAStar, which are out to minimize something else.
+std::vector<std::pair<std::string, std::unique_ptr<RoutePlanner>>> allEngines(Topology const& topo, int threads)
+{
+  std::vector<std::pair<std::string, std::unique_ptr<RoutePlanner>>> engines;
+  engines.emplace_back("bfs", std::make_unique<RoutePlanner>(topo));
+  std::string error;
+  if (std::shared_ptr<NextHopMatrix const> matrix = NextHopMatrix::build(topo, threads, &error))
+  {
+    engines.emplace_back("matrix", std::make_unique<RoutePlanner>(topo));
+    engines.back().second->useNextHopMatrix(matrix);
+  }
+  else
+    std::cerr << "difftest: skipping the next-hop matrix: " << error << std::endl;
+  engines.emplace_back("patterns", std::make_unique<RoutePlanner>(topo));
+  engines.back().second->useTransferPatterns(TransferPatterns::build(topo, threads));
+  engines.emplace_back("ch", std::make_unique<RoutePlanner>(topo));
+  engines.back().second->useContractionHierarchy(ContractionHierarchy::build(topo, threads));
+  return engines;
+}
+
+// Plans 'pairs' (src != dst) with ReferencePlanner and with every engine,
+// adding each engine's comparison into (*counts)[engine name].
+void diffTopology(Topology const& topo, std::vector<std::pair<StopID, StopID>> const& pairs,
+                  int threads, std::map<std::string, DiffCounts>* counts)
 {
-  std::ifstream t(path);
-  std::string s((std::istreambuf_iterator<char>(t)),
-                     std::istreambuf_iterator<char>());
-  while (!s.empty() && s.back() == '\n')
-    s.pop_back();
-  return s;
+  ReferencePlanner reference(topo);
+  auto engines = allEngines(topo, threads);
+  std::mutex mutex;
+  size_t constexpr kChunk = 256;
+  parallelFor((pairs.size() + kChunk - 1) / kChunk, threads, [&](size_t chunk)
+  {
+    std::vector<DiffCounts> mine(engines.size());
+    std::vector<std::string> ref_routes, ref_path;
+    std::vector<RouteID> routes;
+    std::vector<StopID> path;
+    for (size_t i = chunk * kChunk; i < std::min(pairs.size(), (chunk + 1) * kChunk); i++)
+    {
+      auto [src, dst] = pairs[i];
+      bool ref_found = reference.plotRouteFromTo(topo.stop_ids[src], topo.stop_ids[dst], &ref_routes, &ref_path);
+      for (size_t e = 0; e < engines.size(); e++)
+      {
+        DiffCounts& diff = mine[e];
+        diff.pairs++;
+        bool found = engines[e].second->planRoute(src, dst, &routes, &path);
+        std::string problem;
+        bool valid = !found || (!path.empty() && path.front() == src && path.back() == dst);
+        for (size_t j = 1; valid && j < path.size(); j++)
+        {
+          std::span<StopID const> next = topo.neighbors(path[j - 1]);
+          valid = std::find(next.begin(), next.end(), path[j]) != next.end();
+        }
+        if (found != ref_found)
+          diff.reachability++, problem = found ? "reference found no route" : "no route found";
+        else if (!valid)
+          diff.invalid++, problem = "invalid path";
+        else if (!found)
+          continue;
+        else if (path.size() != ref_path.size())
+        {
+          (path.size() > ref_path.size() ? diff.longer : diff.shorter)++;
+          problem = std::to_string(path.size()) + " stops vs the reference's " + std::to_string(ref_path.size());
+        }
+        else if (routes.size() != ref_routes.size())
+          (routes.size() > ref_routes.size() ? diff.more_transfers : diff.fewer_transfers)++;
+        if (problem.empty() || diff.examples.size() >= 5)
+          continue;
+        std::string example = topo.stop_ids[src] + " -> " + topo.stop_ids[dst] + ": " + problem + " (";
+        for (RouteID route : routes)
+          example += topo.route_names[route] + " ";
+        example += "vs ";
+        for (std::string const& route : ref_routes)
+          example += route + " ";
+        example.back() = ')';
+        diff.examples.push_back(example);
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t e = 0; e < engines.size(); e++)
+      (*counts)[engines[e].first].add(mine[e]);
+  });
 }
 
-std::string apiKey()
+void printDiffCounts(std::string const& title, std::map<std::string, DiffCounts> const& counts)
 {
-  // to avoid static init order fiasco - obviously overkill here, but it's the
-  // type of thing you want to just have a blanket policy for.
-  static std::string* key = new std::string;
-  try
+  std::printf("%s\n%-10s %12s %8s %8s %8s %8s %8s %8s\n", title.c_str(), "engine", "pairs",
+              "reach", "longer", "shorter", "invalid", "+lines", "-lines");
+  for (auto const& [engine, diff] : counts)
   {
-    if (key->empty())
-      *key = readStringFile("api_key.txt");
+    std::printf("%-10s %12llu %8llu %8llu %8llu %8llu %8llu %8llu\n", engine.c_str(),
+                (unsigned long long)diff.pairs, (unsigned long long)diff.reachability,
+                (unsigned long long)diff.longer, (unsigned long long)diff.shorter,
+                (unsigned long long)diff.invalid, (unsigned long long)diff.more_transfers,
+                (unsigned long long)diff.fewer_transfers);
+    for (std::string const& example : diff.examples)
+      std::printf("    %s\n", example.c_str());
   }
-  catch(const std::exception& e) {} // should still work even without a key
-  if (key->empty())
-    std::cerr << "Couldn't read api_key.txt. That's ok; we'll just be rate limited." << std::endl;
-  return *key;
+  std::printf("\n");
 }
 
-static size_t curlWriteCallback(void* data, size_t size, size_t nmemb, void* usr)
+// A random network: up to 12 routes over up to 64 stops, each route a
+// random walk through them, so there are loops, branches, stops shared by
+// many routes, and unreachable pairs - more of the odd cases than the MBTA
+// has.
+Topology randomTopology(std::mt19937_64& rng)
 {
-  ((std::string*)usr)->append((char*)data, size * nmemb);
-  return size * nmemb;
+  TopologyBuilder builder;
+  int num_stops = 5 + rng() % 60;
+  int num_routes = 1 + rng() % 12;
+  for (int r = 0; r < num_routes; r++)
+  {
+    std::vector<StopInfo> stops(2 + rng() % 10);
+    for (StopInfo& stop : stops)
+      stop.id = stop.name = "s" + std::to_string(rng() % num_stops);
+    builder.addRoute("r" + std::to_string(r), stops);
+  }
+  return builder.build();
 }
 
-std::string curlMBTA(std::string url)
+// --difftest: every engine against ReferencePlanner on the loaded network
+// (every pair, or a random max_pairs of them), then on 'graphs' random
+// networks (every pair). Prints a table per engine of pairs where it
+// disagrees on reachability or path length or returns a broken path (with
+// examples), and of line count differences on equally long paths (see
+// DiffCounts). Returns whether there were no divergences.
+bool runDiffTest(Topology const& topo, int threads, size_t max_pairs, int graphs)
 {
-  CURL* curl = curl_easy_init();
-  if (!curl)
-    crash("curl_easy_init() in curlMBTA() failed!");
+  std::mt19937_64 rng(42);
+  size_t n = topo.numStops();
+  std::vector<std::pair<StopID, StopID>> pairs;
+  if (n * (n - 1) <= max_pairs)
+  {
+    for (StopID src = 0; src < n; src++)
+      for (StopID dst = 0; dst < n; dst++)
+        if (src != dst)
+          pairs.emplace_back(src, dst);
+  }
+  else
+    while (pairs.size() < max_pairs)
+      if (StopID src = rng() % n, dst = rng() % n; src != dst)
+        pairs.emplace_back(src, dst);
+  std::map<std::string, DiffCounts> network_counts;
+  diffTopology(topo, pairs, threads, &network_counts);
+  printDiffCounts("Loaded network: " + std::to_string(n) + " stops, " + std::to_string(topo.numRoutes()) +
+                  " routes", network_counts);
 
-  std::string auth_header = "Authorization: " + apiKey();
-  struct curl_slist* list = NULL;
-  list = curl_slist_append(list, "Accept: application/json");
-  if (!apiKey().empty())
-    list = curl_slist_append(list, auth_header.c_str());
-  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, list);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curlWriteCallback);
-  std::string response_body;
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response_body);
-  CURLcode res = curl_easy_perform(curl);
-  curl_easy_cleanup(curl);
-  curl_slist_free_all(list);
+  std::map<std::string, DiffCounts> random_counts;
+  for (int graph = 0; graph < graphs; graph++)
+  {
+    Topology random = randomTopology(rng);
+    pairs.clear();
+    for (StopID src = 0; src < random.numStops(); src++)
+      for (StopID dst = 0; dst < random.numStops(); dst++)
+        if (src != dst)
+          pairs.emplace_back(src, dst);
+    diffTopology(random, pairs, 1, &random_counts);
+  }
+  printDiffCounts(std::to_string(graphs) + " random networks", random_counts);
 
-  return response_body;
+  uint64_t divergences = 0;
+  for (auto const* counts : {&network_counts, &random_counts})
+    for (auto const& [engine, diff] : *counts)
+      divergences += diff.divergences();
+  std::printf(divergences ? "%llu divergences\n" : "No divergences.\n", (unsigned long long)divergences);
+  return divergences == 0;
 }
 
-nlohmann::json queryAndParse(std::string url)
+// ================= END differential testing ================================
+
+// ================= BEGIN load replay ========================================
+
+// Answers one replayed query (stops by ID): 0 ok, 1 unknown stop, 2
+// unreachable, 3 failed (connection or protocol trouble).
+using ReplayTarget = std::function<int(std::string const& src, std::string const& dst)>;
+
+// In-process: straight into a PlannerService, cache and all.
+ReplayTarget inProcessTarget(PlannerService& service)
 {
-  std::string response_body = curlMBTA(url);
-  nlohmann::json ret;
-  try
+  return [&service](std::string const& src, std::string const& dst)
   {
-    ret = nlohmann::json::parse(response_body);
-  }
-  catch(const std::exception& e)
+    std::shared_ptr<PlannerSnapshot const> snapshot = service.current();
+    Topology const& topo = snapshot->planner.topology();
+    auto src_it = topo.stop_of_id.find(src);
+    auto dst_it = topo.stop_of_id.find(dst);
+    if (src_it == topo.stop_of_id.end() || dst_it == topo.stop_of_id.end())
+      return 1;
+    static thread_local std::vector<RouteID> routes;
+    return service.plan(*snapshot, src_it->second, dst_it->second, &routes) ? 0 : 2;
+  };
+}
+
+// Over a --uds server's socket: one connection per target, one kPlanNames
+// request in flight at a time.
+ReplayTarget unixSocketTarget(std::string const& path)
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+    crash("unix socket path too long: " + path);
+  std::copy(path.begin(), path.end(), addr.sun_path);
+  if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+    crash("couldn't connect to " + path);
+  auto connection = std::shared_ptr<int>(new int(fd), [](int* fd) { close(*fd); delete fd; });
+  return [connection, request_id = uint32_t(0)](std::string const& src, std::string const& dst) mutable
   {
-    crash("failed to parse queryAndParse() JSON response: " + response_body);
+    int fd = *connection;
+    std::string frame;
+    appendBinary<uint32_t>(&frame, 0);
+    appendBinary<uint32_t>(&frame, ++request_id);
+    appendBinary<uint8_t>(&frame, BinaryPlannerProtocol::kPlanNames);
+    appendBinary<uint16_t>(&frame, 1);
+    for (std::string const& stop : {src, dst})
+    {
+      appendBinary<uint16_t>(&frame, stop.size());
+      frame += stop;
+    }
+    uint32_t length = frame.size() - 4;
+    memcpy(frame.data(), &length, 4);
+    for (size_t sent = 0; sent < frame.size(); )
+    {
+      ssize_t n = send(fd, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return 3;
+      sent += n;
+    }
+    auto receive = [fd](void* into, size_t bytes)
+    {
+      for (size_t got = 0; got < bytes; )
+      {
+        ssize_t n = read(fd, (char*)into + got, bytes - got);
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n <= 0)
+          return false;
+        got += n;
+      }
+      return true;
+    };
+    std::string response;
+    if (!receive(&length, 4) || length < 8 || length > BinaryPlannerProtocol::kMaxFrameBytes)
+      return 3;
+    response.resize(length);
+    if (!receive(response.data(), length))
+      return 3;
+    uint32_t echoed_id;
+    memcpy(&echoed_id, response.data(), 4);
+    uint8_t status = response[4];
+    if (echoed_id != request_id || status != 0 || length < 8)
+      return 3;
+    return std::min<int>((uint8_t)response[7], 2); // u16 n, then the first result
+  };
+}
+
+// --replay F: plays back a --query-log, in order of timestamp, on 'threads'
+// threads that each take the next query as soon as they're free. At speed
+// 1 queries go out at the pace they were logged, at speed N N times
+// faster, and at speed 0 as fast as they'll go. Latency is from when each
+// query was due, not when a thread got to it, so falling behind shows up
+// in the tail instead of being hidden. Prints throughput, outcomes and
+// latency percentiles; returns false if any query failed outright.
+bool runReplay(QueryLog::Contents log, std::function<ReplayTarget()> make_target, double speed,
+               int threads)
+{
+  std::stable_sort(log.records.begin(), log.records.end(),
+                   [](QueryLog::Record const& a, QueryLog::Record const& b) { return a.unix_us < b.unix_us; });
+  size_t n = log.records.size();
+  if (n == 0)
+  {
+    std::printf("The log is empty.\n");
+    return true;
   }
-  return ret;
+  uint64_t first_us = log.records.front().unix_us;
+  std::vector<LogHistogram> latency_ns(threads);
+  std::atomic<uint64_t> outcomes[4] = {};
+  std::atomic<size_t> next = 0;
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++)
+    workers.emplace_back([&, t]()
+    {
+      ReplayTarget target = make_target();
+      for (size_t i; (i = next++) < n; )
+      {
+        QueryLog::Record const& record = log.records[i];
+        auto due = std::chrono::steady_clock::now();
+        if (speed > 0)
+        {
+          due = start + std::chrono::nanoseconds((uint64_t)((record.unix_us - first_us) * 1e3 / speed));
+          std::this_thread::sleep_until(due);
+        }
+        outcomes[target(log.stops[record.src], log.stops[record.dst])].fetch_add(1, std::memory_order_relaxed);
+        latency_ns[t].record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - due).count());
+      }
+    });
+  for (std::thread& worker : workers)
+    worker.join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::vector<uint64_t> counts;
+  uint64_t count = 0, sum = 0, max = 0;
+  for (LogHistogram const& histogram : latency_ns)
+    histogram.mergeInto(&counts, &count, &sum, &max);
+  nlohmann::json latency = LogHistogram::summarize(counts, count, sum, max, 1e-3);
+  char pace[32] = "max";
+  if (speed > 0)
+    std::snprintf(pace, sizeof(pace), "%gx", speed);
+  std::printf("Replayed %zu queries (%.1fs of log) at %s speed on %d threads in %.3fs: %.0f queries/s\n",
+              n, (log.records.back().unix_us - first_us) / 1e6, pace, threads, seconds, n / seconds);
+  std::printf("  %llu ok, %llu unknown stop, %llu unreachable, %llu failed\n",
+              (unsigned long long)outcomes[0].load(), (unsigned long long)outcomes[1].load(),
+              (unsigned long long)outcomes[2].load(), (unsigned long long)outcomes[3].load());
+  std::printf("  latency us: mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+              latency["mean"].get<double>(), latency["p50"].get<double>(), latency["p90"].get<double>(),
+              latency["p99"].get<double>(), latency["p999"].get<double>(), latency["max"].get<double>());
+  return outcomes[3] == 0;
 }
 
-// ================= END boring mechanical stuff =============================
+// ================= END load replay ==========================================
 
-void printRouteLongNames(nlohmann::json routes_json)
+// ================= BEGIN network analytics ==================================
+
+// How much the network leans on one stop.
+struct StopImportance
 {
-  std::cout << "The 'long name' of each route in the MBTA subway system:" << std::endl;
-  for (auto const& item : routes_json["data"])
-    std::cout << item["attributes"]["long_name"].get<std::string>() << std::endl;
-  std::cout << std::endl;
+  // Shortest paths through it, summed over unordered pairs of other stops
+  // (a pair with k shortest paths, j of them through here, adds j/k).
+  double betweenness = 0;
+  // Ordered pairs of other stops that can't reach each other without it.
+  uint64_t cut_pairs = 0;
+  // Extra stops it takes to get between two of its neighbors without it,
+  // over neighbor pairs that still can.
+  double mean_detour = 0;
+  uint32_t max_detour = 0;
+  // Roughly, the extra stops summed over every trip that used to go through
+  // it and still can if it closes: (betweenness - the pairs it cuts off) *
+  // mean_detour.
+  double impact = 0;
+  // From hopSummary(): how far the farthest stop is, and the average one.
+  uint32_t eccentricity = 0;
+  double mean_hops = 0;
+};
+
+// Brandes' algorithm: one BFS per source, then dependencies accumulated back
+// up the BFS order. Sources are spread over 'threads' threads, each adding
+// into its own array, summed at the end.
+std::vector<double> betweennessCentrality(Topology const& topo, int threads)
+{
+  size_t n = topo.numStops();
+  threads = std::max(1, std::min<int>(threads, n));
+  std::vector<std::vector<double>> per_thread(threads);
+  std::atomic<size_t> next_source = 0;
+  parallelFor(threads, threads, [&](size_t t)
+  {
+    std::vector<double>& centrality = per_thread[t];
+    centrality.assign(n, 0);
+    std::vector<double> paths(n), dependency(n);
+    std::vector<int32_t> depth(n, -1);
+    std::vector<StopID> order;
+    for (StopID src; (src = next_source++) < n; )
+    {
+      order.assign(1, src);
+      depth[src] = 0;
+      paths[src] = 1;
+      for (size_t head = 0; head < order.size(); head++)
+      {
+        StopID cur = order[head];
+        for (StopID neighbor : topo.neighbors(cur))
+        {
+          if (depth[neighbor] < 0)
+          {
+            depth[neighbor] = depth[cur] + 1;
+            paths[neighbor] = 0;
+            order.push_back(neighbor);
+          }
+          if (depth[neighbor] == depth[cur] + 1)
+            paths[neighbor] += paths[cur];
+        }
+      }
+      // Unweighted, so a stop's predecessors are just its neighbors one
+      // shallower; no need to keep lists of them.
+      for (StopID stop : order)
+        dependency[stop] = 0;
+      for (size_t i = order.size(); i-- > 1; )
+      {
+        StopID cur = order[i];
+        double share = (1 + dependency[cur]) / paths[cur];
+        for (StopID neighbor : topo.neighbors(cur))
+          if (depth[neighbor] == depth[cur] - 1)
+            dependency[neighbor] += paths[neighbor] * share;
+        centrality[cur] += dependency[cur];
+      }
+      for (StopID stop : order)
+        depth[stop] = -1;
+    }
+  });
+  std::vector<double> centrality(n, 0);
+  for (std::vector<double> const& partial : per_thread)
+    for (size_t s = 0; s < n; s++)
+      centrality[s] += partial[s] / 2; // every unordered pair was counted from both ends
+  return centrality;
 }
 
-std::vector<std::string> getRouteIDs(nlohmann::json routes_json)
+// For every stop: how many ordered pairs of other stops it disconnects, by
+// Tarjan's articulation points. Removing v splits its component into the
+// DFS subtrees of children that can't climb above v, plus whatever's left
+// (the part holding v's parent).
+std::vector<uint64_t> cutPairs(Topology const& topo)
 {
-  std::vector<std::string> ret;
-  for (auto const& item : routes_json["data"])
-    ret.push_back(item["id"].get<std::string>());
+  size_t n = topo.numStops();
+  std::vector<int32_t> discovered(n, -1), low(n), component(n);
+  std::vector<uint64_t> subtree(n, 1), split_off(n, 0), split_off_squares(n, 0);
+  std::vector<StopID> parent(n);
+  std::vector<uint64_t> component_size;
+  std::vector<std::pair<StopID, uint32_t>> stack; // (stop, next neighbor to look at)
+  int32_t time = 0;
+  for (StopID root = 0; root < n; root++)
+  {
+    if (discovered[root] >= 0)
+      continue;
+    uint64_t size = 0;
+    discovered[root] = low[root] = time++;
+    parent[root] = root;
+    stack.assign(1, {root, 0});
+    while (!stack.empty())
+    {
+      auto& [cur, next] = stack.back();
+      std::span<StopID const> neighbors = topo.neighbors(cur);
+      if (next < neighbors.size())
+      {
+        StopID neighbor = neighbors[next++];
+        if (discovered[neighbor] < 0)
+        {
+          discovered[neighbor] = low[neighbor] = time++;
+          parent[neighbor] = cur;
+          stack.push_back({neighbor, 0});
+        }
+        else if (neighbor != parent[cur])
+          low[cur] = std::min(low[cur], discovered[neighbor]);
+        continue;
+      }
+      StopID done = cur;
+      stack.pop_back();
+      component[done] = component_size.size();
+      size++;
+      if (done == root)
+        continue;
+      StopID up = parent[done];
+      low[up] = std::min(low[up], low[done]);
+      subtree[up] += subtree[done];
+      if (low[done] >= discovered[up])
+      {
+        split_off[up] += subtree[done];
+        split_off_squares[up] += subtree[done] * subtree[done];
+      }
+    }
+    component_size.push_back(size);
+  }
+  std::vector<uint64_t> ret(n);
+  for (StopID s = 0; s < n; s++)
+  {
+    uint64_t others = component_size[component[s]] - 1;
+    uint64_t rest = others - split_off[s];
+    ret[s] = others * others - split_off_squares[s] - rest * rest;
+  }
   return ret;
 }
 
-// NOTE: in addition to item["attributes"]["name"], there is also item["id"],
-// which looks like e.g. place-dwnxg for Downtown Crossing. I assume it is the
-// MBTA's canonical unique ID for these stops. So, that would be the best thing
-// to track throughout the code, in case you wanted to further interact with
-// the MBTA's system. However, for our purposes the display name actually works
-// fine, and keeping track of both would make the code uglier (since the human
-// input will use the display names). So I'm using display names for everything.
-// (I tested that stops always keep the same display name when they appear in
-// multiple routes).
-std::vector<std::string> getStops(nlohmann::json stops_json)
+// --analytics: betweenness, cut pairs, detours and hop distances (see
+// StopImportance) for every stop. Most important first: closures that strand
+// people (by pairs cut off), then ones that make them go around (by impact).
+std::vector<std::pair<StopID, StopImportance>> stopImportance(Topology const& topo, HopSummary const& hops,
+                                                              int threads)
 {
-  std::vector<std::string> ret;
-  for (auto const& item : stops_json["data"])
-    ret.push_back(item["attributes"]["name"].get<std::string>());
+  size_t n = topo.numStops();
+  std::vector<double> centrality = betweennessCentrality(topo, threads);
+  std::vector<uint64_t> cut = cutPairs(topo);
+  std::vector<std::pair<StopID, StopImportance>> ret(n);
+  // Detours: a BFS from each neighbor but the last that steers around the
+  // stop, until it has found the rest of the neighbors (or run out).
+  parallelFor(n, threads, [&](size_t stop)
+  {
+    static thread_local std::vector<uint32_t> seen, depth;
+    static thread_local std::vector<StopID> queue;
+    static thread_local uint32_t epoch = 0;
+    if (seen.size() < n)
+    {
+      seen.assign(n, 0);
+      depth.resize(n);
+      epoch = 0;
+    }
+    StopImportance importance;
+    importance.betweenness = centrality[stop];
+    importance.cut_pairs = cut[stop];
+    importance.eccentricity = hops.eccentricity[stop];
+    importance.mean_hops = hops.mean_hops[stop];
+    std::span<StopID const> neighbors = topo.neighbors(stop);
+    uint64_t detour_sum = 0, detour_pairs = 0;
+    for (size_t a = 0; a + 1 < neighbors.size(); a++)
+    {
+      if (++epoch == 0)
+      {
+        std::fill(seen.begin(), seen.end(), 0);
+        epoch = 1;
+      }
+      seen[stop] = seen[neighbors[a]] = epoch;
+      depth[neighbors[a]] = 0;
+      queue.assign(1, neighbors[a]);
+      size_t left = neighbors.size() - a - 1;
+      for (size_t head = 0; head < queue.size() && left > 0; head++)
+        for (StopID next : topo.neighbors(queue[head]))
+          if (seen[next] != epoch)
+          {
+            seen[next] = epoch;
+            depth[next] = depth[queue[head]] + 1;
+            queue.push_back(next);
+            if (std::find(neighbors.begin() + a + 1, neighbors.end(), next) != neighbors.end())
+              left--;
+          }
+      for (size_t b = a + 1; b < neighbors.size(); b++)
+        if (seen[neighbors[b]] == epoch)
+        {
+          uint32_t detour = depth[neighbors[b]] - std::min<uint32_t>(depth[neighbors[b]], 2);
+          detour_sum += detour;
+          detour_pairs++;
+          importance.max_detour = std::max(importance.max_detour, detour);
+        }
+    }
+    importance.mean_detour = detour_pairs ? double(detour_sum) / detour_pairs : 0;
+    importance.impact = std::max(0.0, importance.betweenness - importance.cut_pairs / 2.0) * importance.mean_detour;
+    ret[stop] = {(StopID)stop, importance};
+  });
+  std::sort(ret.begin(), ret.end(), [](auto const& a, auto const& b)
+  {
+    return std::tie(a.second.cut_pairs, a.second.impact, a.second.betweenness) >
+           std::tie(b.second.cut_pairs, b.second.impact, b.second.betweenness);
+  });
   return ret;
 }
 
-class RoutePlanner
+// CSV, one row per stop: stop_id,name,routes (joined with '|'),betweenness,
+// betweenness_normalized (share of all pairs' shortest paths),cut_pairs,
+// mean_detour,max_detour,impact,eccentricity,mean_hops.
+std::string stopImportanceCsv(Topology const& topo,
+                              std::vector<std::pair<StopID, StopImportance>> const& importance)
 {
-public:
-  RoutePlanner(std::unordered_map<std::string, std::vector<std::string>> adjacency_lists,
-               std::unordered_map<std::string, std::set<std::string>> routes_of_stop)
-  : adjacency_lists_(adjacency_lists),
-    routes_of_stop_(routes_of_stop) {}
-
-  // Returns the list of line names (e.g. Red, Orange) you should take to get
-  // from the station 'src' to 'dst'.
-  std::vector<std::string> plotRouteFromTo(std::string src, std::string dst)
+  double n = topo.numStops();
+  double pairs = std::max(1.0, (n - 1) * (n - 2) / 2);
+  std::string out = "stop_id,name,routes,betweenness,betweenness_normalized,cut_pairs,mean_detour,max_detour,impact,eccentricity,mean_hops\n";
+  char numbers[160];
+  for (auto const& [stop, stats] : importance)
   {
-    if (!routes_of_stop_.contains(src))
-      crash(src + ": no such stop.");
-    if (!routes_of_stop_.contains(dst))
-      crash(dst + ": no such stop.");
+    appendCsvField(&out, topo.stop_ids[stop]);
+    out += ',';
+    appendCsvField(&out, topo.stop_names[stop]);
+    out += ',';
+    std::string routes;
+    for (RouteID route : topo.routesOf(stop))
+      routes += (routes.empty() ? "" : "|") + topo.route_names[route];
+    appendCsvField(&out, routes);
+    std::snprintf(numbers, sizeof(numbers), ",%.2f,%.6f,%llu,%.3f,%u,%.2f,%u,%.3f\n", stats.betweenness,
+                  stats.betweenness / pairs, (unsigned long long)stats.cut_pairs, stats.mean_detour,
+                  stats.max_detour, stats.impact, stats.eccentricity, stats.mean_hops);
+    out += numbers;
+  }
+  return out;
+}
 
-    std::unordered_map<std::string, std::string> backlinks =
-        backlinksBFS(adjacency_lists_, src, dst);
+// ================= END network analytics ====================================
 
-    // assemble path from backlinks
-    std::vector<std::string> our_path;
-    std::string cur_hop = dst;
-    do
-    {
-      our_path.push_back(cur_hop);
-      cur_hop = backlinks[cur_hop];
-    } while (cur_hop != src);
-    our_path.push_back(cur_hop);
-    std::reverse(our_path.begin(), our_path.end());
+// What loadNetwork() gets from the API, before it's built into a Topology:
+// everything needed to rebuild exactly the same network offline.
+struct NetworkSource
+{
+  nlohmann::json routes_json;
+  std::vector<std::string> route_ids; // in API order
+  std::vector<std::vector<StopInfo>> stops_of_route;
+};
 
-    // We have our_path in stops. Now, to convert stops to routes, let's greedily
-    // stay on the same starting route as long as possible. Set intersection will
-    // tell us what routes are viable, as well as when we are forced to switch.
-    int station_index = 0;
-    std::vector<std::string> routes_to_travel;
-    while (station_index < our_path.size())
+struct LoadedNetwork
+{
+  nlohmann::json routes_json;
+  Topology topology;
+  // for question 2
+  int most_stops_count = 0;
+  std::string most_stops_route;
+  int fewest_stops_count = INT_MAX;
+  std::string fewest_stops_route;
+};
+
+// Fetches the routes of the given route types ('modes', as in filter[type])
+// and their stops. Returns nullopt rather than crashing if the API
+// misbehaves, so that a server reloading in the background can just keep
+// what it has.
+std::optional<NetworkSource> fetchNetwork(std::string const& modes, int fetch_threads)
+{
+  ScopedPhase phase("fetch network");
+  NetworkSource ret;
+  std::optional<nlohmann::json> routes_json = tryQueryAndParse(kApiBase + "routes?filter[type]=" + modes);
+  if (!routes_json)
+    return std::nullopt;
+  ret.routes_json = std::move(*routes_json);
+
+  // gathering and structuring data for questions 2 and 3
+  ret.route_ids = getRouteIDs(ret.routes_json);
+  std::string route_query_prefix = kApiBase + "stops?filter[route]=";
+  std::string route_query_suffix = "&include=parent_station";
+
+  // One request per route, several in flight at once. Each response is boiled
+  // down to its StopInfos right away, so we never hold every DOM at once.
+  ret.stops_of_route.resize(ret.route_ids.size());
+  phase.args["routes"] = ret.route_ids.size();
+  std::atomic<bool> failed = false;
+  parallelFor(ret.route_ids.size(), fetch_threads, [&](size_t i)
+  {
+    if (failed)
+      return;
+    std::optional<nlohmann::json> stops_json =
+        tryQueryAndParse(route_query_prefix + ret.route_ids[i] + route_query_suffix);
+    if (stops_json)
+      ret.stops_of_route[i] = getStops(*stops_json);
+    else
+      failed = true;
+  });
+  if (failed)
+    return std::nullopt;
+  return ret;
+}
+
+LoadedNetwork buildNetwork(NetworkSource source)
+{
+  ScopedPhase phase("build network");
+  LoadedNetwork ret;
+  ret.routes_json = std::move(source.routes_json);
+  TopologyBuilder builder;
+  for (size_t i = 0; i < source.route_ids.size(); i++)
+  {
+    // track the min/max counts for question 2
+    int num_stops = source.stops_of_route[i].size();
+    if (num_stops < ret.fewest_stops_count)
     {
-      auto [route_name, next_stop_ind] = greedilyStayOnRoute(our_path, station_index);
-      station_index = next_stop_ind;
-      routes_to_travel.push_back(route_name);
+      ret.fewest_stops_count = num_stops;
+      ret.fewest_stops_route = source.route_ids[i];
+    }
+    if (num_stops > ret.most_stops_count)
+    {
+      ret.most_stops_count = num_stops;
+      ret.most_stops_route = source.route_ids[i];
     }
-    return routes_to_travel;
+    builder.addRoute(source.route_ids[i], std::move(source.stops_of_route[i]));
   }
+  ret.topology = builder.build();
+  return ret;
+}
 
-private:
+std::optional<LoadedNetwork> loadNetwork(std::string const& modes, int fetch_threads)
+{
+  std::optional<NetworkSource> source = fetchNetwork(modes, fetch_threads);
+  if (!source)
+    return std::nullopt;
+  return buildNetwork(std::move(*source));
+}
 
-  // BFS, tracking backlinks. Returns a map of backlinks:
-  // backlinks[backlinks[...[dst]...]] gets you back to src.
-  std::unordered_map<std::string, std::string> backlinksBFS(
-      std::unordered_map<std::string, std::vector<std::string>>& adjacency_lists,
-      std::string src, std::string dst)
+// A frozen copy of a NetworkSource (--save-snapshot, --snapshot), so that
+// benchmarks and tests can run on a fixed network without the API:
+//   {"format": "mbta-network-snapshot", "version": 1, "routes": <routes response>,
+//    "route_stops": [{"route": "Red", "stops": [[id, name, parent_id, parent_name, lat, lon], ...]}, ...]}
+// Older snapshots don't have lat and lon; their stops just have no location.
+bool saveNetworkSnapshot(std::string const& path, NetworkSource const& source)
+{
+  nlohmann::json route_stops = nlohmann::json::array();
+  for (size_t i = 0; i < source.route_ids.size(); i++)
   {
-    std::unordered_map<std::string, std::string> backlinks;
-    std::unordered_set<std::string> visited;
-    std::queue<std::string> to_visit;
-    to_visit.push(src);
-    while (!to_visit.empty() && to_visit.front() != dst)
+    nlohmann::json stops = nlohmann::json::array();
+    for (StopInfo const& stop : source.stops_of_route[i])
+      stops.push_back({stop.id, stop.name, stop.parent_id, stop.parent_name, stop.location.lat, stop.location.lon});
+    route_stops.push_back({{"route", source.route_ids[i]}, {"stops", std::move(stops)}});
+  }
+  nlohmann::json snapshot = {{"format", "mbta-network-snapshot"}, {"version", 1},
+                             {"routes", source.routes_json}, {"route_stops", std::move(route_stops)}};
+  std::string text = snapshot.dump();
+  return writeFileAtomically(path, text.data(), text.size());
+}
+
+std::optional<NetworkSource> loadNetworkSnapshot(std::string const& path, std::string* error)
+{
+  std::ifstream file(path);
+  if (!file)
+  {
+    *error = "can't open " + path;
+    return std::nullopt;
+  }
+  MemoryScope memory(MemTag::kJson);
+  nlohmann::json snapshot = nlohmann::json::parse(file, nullptr, false);
+  if (snapshot.is_discarded() || !snapshot.is_object() ||
+      snapshot.value("format", "") != "mbta-network-snapshot" || snapshot.value("version", 0) != 1)
+  {
+    *error = path + " isn't a version 1 network snapshot";
+    return std::nullopt;
+  }
+  NetworkSource source;
+  source.routes_json = std::move(snapshot["routes"]);
+  try
+  {
+    for (nlohmann::json const& route : snapshot.at("route_stops"))
     {
-      std::string cur = to_visit.front();
-      to_visit.pop();
-      visited.insert(cur);
-      for (std::string const& neighbor : adjacency_lists[cur])
+      source.route_ids.push_back(route.at("route"));
+      source.stops_of_route.emplace_back();
+      for (nlohmann::json const& stop : route.at("stops"))
       {
-        if (visited.contains(neighbor))
-          continue;
-        to_visit.push(neighbor);
-        backlinks[neighbor] = cur;
+        StopInfo info;
+        info.id = stop.at(0);
+        info.name = stop.at(1);
+        info.parent_id = stop.at(2);
+        info.parent_name = stop.at(3);
+        if (stop.size() >= 6 && stop[4].is_number() && stop[5].is_number())
+          info.location = GeoPoint{stop[4], stop[5]};
+        source.stops_of_route.back().push_back(std::move(info));
       }
     }
-    if (to_visit.empty())
-      crash("Can't get to "+src+" from "+dst);
-    return backlinks;
   }
+  catch (nlohmann::json::exception const& e)
+  {
+    *error = path + " is malformed: " + e.what();
+    return std::nullopt;
+  }
+  return source;
+}
 
-  // Starting from path[station_index], return the name of the line that you can
-  // stay on for the most stations in this path. Also returns the index where
-  // you have to switch to a new line - meaning you should call this function
-  // again on that index.
-  std::pair<std::string, int> greedilyStayOnRoute(std::vector<std::string> const& path,
-                                                  int station_index)
+// Maps 'file' if it holds an Engine built from 'topo'; otherwise builds one
+// (and saves it to 'file', if given).
+template <typename Engine, typename Build>
+std::shared_ptr<Engine const> loadOrBuildEngine(std::string const& file, Topology const& topo,
+                                                std::string const& what, Build build)
+{
+  ScopedPhase phase(what.c_str());
+  std::string error;
+  if (!file.empty())
   {
-    std::set<std::string> candidates = routes_of_stop_[path[station_index++]];
-    while (true)
-    {
-      std::set<std::string> new_candidates;
-      std::set_intersection(candidates.begin(), candidates.end(),
-                            routes_of_stop_[path[station_index]].begin(),
-                            routes_of_stop_[path[station_index]].end(),
-                            std::inserter(new_candidates, new_candidates.begin()));
-      if (new_candidates.empty())
-        return std::make_pair(*candidates.begin(), station_index);
-      station_index++;
-      candidates = new_candidates;
-      if (station_index >= path.size())
-        return std::make_pair(*candidates.begin(), station_index);
-    }
+    if (std::shared_ptr<Engine const> loaded = Engine::load(file, topo, &error))
+      return loaded;
+    std::cerr << error << "; building new " << what << std::endl;
   }
+  auto start = std::chrono::steady_clock::now();
+  std::unique_ptr<Engine> built = build(&error);
+  if (!built)
+    crash("can't build the " + what + ": " + error);
+  std::cerr << "Built " << built->bytes() / 1e6 << " MB of " << what << " in "
+            << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+            << "s" << std::endl;
+  if (!file.empty() && !built->save(file))
+    std::cerr << "couldn't save the " << what << " to " << file << std::endl;
+  return built;
+}
 
-  // the edges of the MBTA graph (stops being nodes), as adjacency list.
-  std::unordered_map<std::string, std::vector<std::string>> adjacency_lists_;
-  // which routes does this stop appear in? e.g. Downtown Crossing maps to {red, orange}.
-  std::unordered_map<std::string, std::set<std::string>> routes_of_stop_;
-};
+// Builds the planner for 'topology', with whichever precomputed engine the
+// command line asks for:
+//   --engine bfs       search per query (the default)
+//   --engine matrix    NextHopMatrix; with --matrix-file F, mmap F if it was
+//                      built from this topology, else build and save it there
+//   --engine patterns  TransferPatterns; --patterns-file works the same way
+//   --engine ch        ContractionHierarchy, built here (it only takes seconds)
+//   --engine lines     LineGraph (fewest transfers rather than fewest stops)
+//   --engine astar     GeoAStar (shortest distance rather than fewest stops)
+std::shared_ptr<PlannerSnapshot const> makeSnapshot(Topology topology, uint64_t version,
+                                                    int argc, char** argv)
+{
+  std::shared_ptr<PlannerSnapshot> snapshot;
+  {
+    ScopedPhase phase("build planner and name index");
+    MemoryScope memory(MemTag::kTopology);
+    snapshot = std::make_shared<PlannerSnapshot>(std::move(topology), version);
+  }
+  MemoryScope memory(MemTag::kEngine);
+  Topology const& topo = snapshot->planner.topology();
+  std::string engine = flagValue(argc, argv, "engine", "bfs");
+  int threads = hardwareThreads();
+  if (engine == "matrix")
+    snapshot->planner.useNextHopMatrix(loadOrBuildEngine<NextHopMatrix>(
+        flagValue(argc, argv, "matrix-file"), topo, "next-hop matrix",
+        [&](std::string* error) { return NextHopMatrix::build(topo, threads, error); }));
+  else if (engine == "patterns")
+    snapshot->planner.useTransferPatterns(loadOrBuildEngine<TransferPatterns>(
+        flagValue(argc, argv, "patterns-file"), topo, "transfer patterns",
+        [&](std::string*) { return TransferPatterns::build(topo, threads); }));
+  else if (engine == "ch")
+  {
+    ScopedPhase phase("contraction hierarchy");
+    auto start = std::chrono::steady_clock::now();
+    std::shared_ptr<ContractionHierarchy const> ch = ContractionHierarchy::build(topo, threads);
+    std::cerr << "Built a contraction hierarchy (" << ch->numShortcuts() << " shortcuts, "
+              << ch->bytes() / 1e6 << " MB) in "
+              << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+              << "s" << std::endl;
+    snapshot->planner.useContractionHierarchy(ch);
+  }
+  else if (engine == "lines")
+  {
+    std::shared_ptr<LineGraph const> lines = LineGraph::build(topo);
+    std::cerr << "Built the line graph (" << topo.numRoutes() << " lines, " << lines->bytes() / 1e3
+              << " kB)" << std::endl;
+    snapshot->planner.useLineGraph(lines);
+  }
+  else if (engine == "astar")
+  {
+    std::string error;
+    std::shared_ptr<GeoAStar const> astar = GeoAStar::build(topo, &error);
+    if (!astar)
+      crash("can't use --engine astar: " + error);
+    snapshot->planner.useGeoAStar(astar);
+  }
+  else if (engine != "bfs")
+    crash("unknown --engine " + engine);
+  return snapshot;
+}
 
 int main(int argc, char** argv)
 {
-  nlohmann::json routes_json = queryAndParse("https://api-v3.mbta.com/routes?filter[type]=0,1");
+  // e.g. --stream="vehicles?filter[route]=Red" just mirrors that stream forever.
+  if (hasFlag(argc, argv, "stream"))
+  {
+    if (flagValue(argc, argv, "stream") == "true")
+      crash("--stream needs a resource to follow, e.g. --stream=\"vehicles?filter[route]=Red\"");
+    LiveStateStore store;
+    std::atomic<bool> stop = false;
+    streamMBTA(kApiBase + flagValue(argc, argv, "stream"), &store, &stop,
+               [&](std::string const& event)
+    {
+      std::cout << event << ": now tracking " << store.size()
+                << " resources (version " << store.version() << ")\n" << std::flush;
+    });
+    return 0;
+  }
 
-  // gathering and structuring data for questions 2 and 3
-  std::vector<std::string> route_ids = getRouteIDs(routes_json);
-  std::string route_query_prefix = "https://api-v3.mbta.com/stops?filter[route]=";
+  curl_global_init(CURL_GLOBAL_DEFAULT); // not thread-safe, so do it before any fetching threads
 
-  std::unordered_map<std::string, std::vector<std::string>> adjacency_lists;
-  std::unordered_map<std::string, std::set<std::string>> routes_of_stop;
+  // --timings prints where startup time went; --trace F also writes it as a
+  // Chrome trace (see Tracer).
+  std::string trace_file = flagValue(argc, argv, "trace");
+  if (!trace_file.empty() || hasFlag(argc, argv, "timings"))
+    Tracer::global().enable();
+  auto startup_phase = std::make_unique<ScopedPhase>("startup");
+  // --query-stats records per-query latency and search effort (see
+  // QueryStats); when serving, /stats?query_stats=on|off toggles it too.
+  if (hasFlag(argc, argv, "query-stats"))
+    QueryStats::enabled() = true;
 
-  int most_stops_count = 0;
-  std::string most_stops_route;
-  int fewest_stops_count = INT_MAX;
-  std::string fewest_stops_route;
-  for (std::string route_name : route_ids)
+  // Route types: 0 light rail, 1 subway, 2 commuter rail, 3 bus, 4 ferry.
+  std::string modes = flagValue(argc, argv, "modes", "0,1");
+  int fetch_threads = numberFlag(argc, argv, "fetch-threads", 8, 1);
+  // --snapshot F builds from a file saved by --save-snapshot F instead.
+  std::optional<NetworkSource> source;
+  if (std::string snapshot_file = flagValue(argc, argv, "snapshot"); !snapshot_file.empty())
   {
-    nlohmann::json stops_json = queryAndParse(route_query_prefix + route_name);
+    std::string error;
+    source = loadNetworkSnapshot(snapshot_file, &error);
+    if (!source)
+      crash(error);
+  }
+  else
+  {
+    source = fetchNetwork(modes, fetch_threads);
+    if (!source)
+      crash("couldn't load the network from the MBTA API");
+  }
+  if (std::string save_to = flagValue(argc, argv, "save-snapshot"); !save_to.empty() &&
+      !saveNetworkSnapshot(save_to, *source))
+    crash("couldn't save the network snapshot to " + save_to);
+  std::optional<LoadedNetwork> network = buildNetwork(std::move(*source));
+  nlohmann::json& routes_json = network->routes_json;
+  std::shared_ptr<PlannerSnapshot const> snapshot = makeSnapshot(std::move(network->topology), 1, argc, argv);
+  RoutePlanner const& planner = snapshot->planner;
+  Topology const& topo = planner.topology();
+  StopNameIndex const& name_index = snapshot->index;
+  startup_phase.reset();
+  if (Tracer::global().enabled())
+    Tracer::global().finish(trace_file, hasFlag(argc, argv, "timings"));
+  // --memstats: heap use by subsystem, now that everything's loaded.
+  if (hasFlag(argc, argv, "memstats"))
+    printMemoryStats();
 
-    // track the min/max counts for question 2
-    int num_stops = stops_json["data"].size();
-    if (num_stops < fewest_stops_count)
+  // --bench: see runBenchmarks(). --threads for the parallel throughput run.
+  if (hasFlag(argc, argv, "bench"))
+  {
+    runBenchmarks(planner, numberFlag(argc, argv, "threads", hardwareThreads(), 1));
+    return 0;
+  }
+
+  // --difftest: see runDiffTest(). Exits 1 if any engine disagrees with the
+  // reference planner.
+  if (hasFlag(argc, argv, "difftest"))
+    return runDiffTest(topo, numberFlag(argc, argv, "threads", hardwareThreads(), 1),
+                       numberFlag(argc, argv, "difftest-pairs", 1000000, 0, UINT32_MAX),
+                       numberFlag(argc, argv, "difftest-graphs", 200)) ? 0 : 1;
+
+  // --analytics [F]: per-stop importance (see stopImportance()) as CSV, to F
+  // or stdout.
+  if (hasFlag(argc, argv, "analytics"))
+  {
+    auto start = std::chrono::steady_clock::now();
+    int threads = numberFlag(argc, argv, "threads", hardwareThreads(), 1);
+    HopSummary hops = hopSummary(topo, threads);
+    std::string csv = stopImportanceCsv(topo, stopImportance(topo, hops, threads));
+    std::cerr << "Analyzed " << topo.numStops() << " stops in "
+              << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+              << "s; diameter " << hops.diameter << " hops (" << topo.stop_names[hops.diameter_from]
+              << " to " << topo.stop_names[hops.diameter_to] << ")" << std::endl;
+    std::string out_file = flagValue(argc, argv, "analytics");
+    if (out_file == "true")
+      std::cout << csv;
+    else if (!writeFileAtomically(out_file, csv.data(), csv.size()))
+      crash("couldn't write " + out_file);
+    return 0;
+  }
+
+  // --hop-matrix F: allPairsHops() as CSV, a header row of stop IDs and then
+  // a row per stop; blank where there's no path.
+  if (std::string matrix_file = flagValue(argc, argv, "hop-matrix"); !matrix_file.empty())
+  {
+    size_t n = topo.numStops();
+    std::vector<uint16_t> hops = allPairsHops(
+        topo, numberFlag(argc, argv, "threads", hardwareThreads(), 1));
+    std::string csv = "stop_id";
+    for (StopID stop = 0; stop < n; stop++)
     {
-      fewest_stops_count = num_stops;
-      fewest_stops_route = route_name;
+      csv += ',';
+      appendCsvField(&csv, topo.stop_ids[stop]);
     }
-    if (num_stops > most_stops_count)
+    csv += '\n';
+    for (StopID src = 0; src < n; src++)
     {
-      most_stops_count = num_stops;
-      most_stops_route = route_name;
+      appendCsvField(&csv, topo.stop_ids[src]);
+      for (StopID dst = 0; dst < n; dst++)
+      {
+        csv += ',';
+        if (uint16_t h = hops[src * n + dst]; h != kUnreachableHops)
+          csv += std::to_string(h);
+      }
+      csv += '\n';
     }
+    if (!writeFileAtomically(matrix_file, csv.data(), csv.size()))
+      crash("couldn't write " + matrix_file);
+    return 0;
+  }
+
+  // --replay F [--replay-speed 1|N|max] [--replay-uds PATH]: see runReplay().
+  // In-process by default (through a PlannerService, with --cache-entries),
+  // or against a running --uds server.
+  if (std::string replay_file = flagValue(argc, argv, "replay"); !replay_file.empty())
+  {
+    std::string error;
+    std::optional<QueryLog::Contents> log = QueryLog::read(replay_file, &error);
+    if (!log)
+      crash(error);
+    std::string speed = flagValue(argc, argv, "replay-speed", "1");
+    char* speed_end;
+    double speed_factor = speed == "max" ? 0 : std::strtod(speed.c_str(), &speed_end);
+    if (speed != "max" && (*speed_end || !(speed_factor > 0) || std::isinf(speed_factor)))
+      crash("--replay-speed must be max or a positive number, not '" + speed + "'");
+    int threads = numberFlag(argc, argv, "threads", hardwareThreads(), 1);
+    PlannerService service(snapshot, numberFlag(argc, argv, "cache-entries", 100000, 0, UINT32_MAX));
+    std::string uds = flagValue(argc, argv, "replay-uds");
+    std::function<ReplayTarget()> make_target = [&]() { return inProcessTarget(service); };
+    if (!uds.empty())
+      make_target = [&]() { return unixSocketTarget(uds); };
+    return runReplay(std::move(*log), make_target, speed_factor, threads) ? 0 : 1;
+  }
 
-    // track multi-route stops for question 2
-    std::vector<std::string> cur_route_stops = getStops(stops_json);
-    for (std::string stop_name : cur_route_stops)
-      routes_of_stop[stop_name].insert(route_name);
+  // --reachable [file] [--max-stops N] [--max-transfers N]: everything within
+  // budget of each origin in the file (or stdin), as JSON lines on stdout.
+  if (hasFlag(argc, argv, "reachable"))
+  {
+    std::string input = flagValue(argc, argv, "reachable");
+    uint32_t max_stops = numberFlag(argc, argv, "max-stops", kNoBudget, 0, kNoBudget - 1);
+    uint32_t max_transfers = numberFlag(argc, argv, "max-transfers", kNoBudget, 0, kNoBudget - 1);
+    int threads = numberFlag(argc, argv, "threads", hardwareThreads(), 1);
+    std::ios::sync_with_stdio(false);
+    std::ifstream file;
+    if (input != "true" && input != "-")
+    {
+      file.open(input);
+      if (!file)
+        crash("couldn't open " + input);
+    }
+    auto start = std::chrono::steady_clock::now();
+    uint64_t origins = runReachableBatch(planner, name_index, file.is_open() ? file : std::cin, STDOUT_FILENO,
+                                         max_stops, max_transfers, threads);
+    std::cerr << "Searched from " << origins << " origins in "
+              << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s"
+              << std::endl;
+    return 0;
+  }
 
-    // build adjacency lists
-    for (int i = 0; i < cur_route_stops.size(); i++)
+  // --batch [file]: plan every pair in the file (or stdin, for "-" or no file),
+  // writing --format jsonl|csv|binary to stdout, then a summary to stderr.
+  if (hasFlag(argc, argv, "batch"))
+  {
+    std::string input = flagValue(argc, argv, "batch");
+    std::string format_name = flagValue(argc, argv, "format", "jsonl");
+    BatchFormat format = format_name == "csv" ? BatchFormat::kCsv
+                       : format_name == "binary" ? BatchFormat::kBinary
+                       : format_name == "jsonl" ? BatchFormat::kJsonl
+                       : (crash("--format must be jsonl, csv or binary"), BatchFormat::kJsonl);
+    int threads = numberFlag(argc, argv, "threads", hardwareThreads(), 1);
+    std::ios::sync_with_stdio(false);
+    std::ifstream file;
+    if (input != "true" && input != "-")
     {
-      if (i > 0)
-        adjacency_lists[cur_route_stops[i]].push_back(cur_route_stops[i-1]);
-      if (i < cur_route_stops.size() - 1)
-        adjacency_lists[cur_route_stops[i]].push_back(cur_route_stops[i+1]);
+      file.open(input);
+      if (!file)
+        crash("couldn't open " + input);
     }
+    BatchSummary summary = runBatch(planner, name_index, file.is_open() ? file : std::cin,
+                                    STDOUT_FILENO, format, threads);
+    std::cerr << "Planned " << summary.pairs << " pairs (" << summary.planned << " ok, "
+              << summary.unresolved << " unresolved, " << summary.unreachable << " unreachable) in "
+              << summary.seconds << "s with " << threads << " threads: "
+              << (uint64_t)(summary.pairs / std::max(summary.seconds, 1e-9)) << " pairs/s, "
+              << summary.bytes_out / 1e6 << " MB written" << std::endl;
+    if (QueryStats::enabled())
+      std::cerr << "Query stats: " << QueryStats::snapshot().dump(2) << std::endl;
+    if (hasFlag(argc, argv, "memstats"))
+      printMemoryStats();
+    return 0;
   }
 
-  std::cout << "\n First, here's a list of all stop names, to help with "
-            << "getting the input for the shortest-path query mode right:\n";
-  for (auto const& [stop, junk] : routes_of_stop)
-    std::cout << stop << std::endl;
-  std::cout << "\n(end of list of all stop names)\n\n";
+  // Serving, instead of the interactive loop: --serve [port] for JSON over
+  // HTTP, --uds <path> for the binary protocol over a unix socket, or both.
+  if (hasFlag(argc, argv, "serve") || hasFlag(argc, argv, "uds"))
+  {
+    int threads = numberFlag(argc, argv, "threads", hardwareThreads(), 1);
+    // SIGINT and SIGTERM stop the servers (see below) so that everything gets
+    // cleaned up, the query log's last buffers included. Blocked here, before
+    // any serving thread exists, so that they all inherit it and the signals
+    // only ever go to sigwait().
+    sigset_t shutdown_signals;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &shutdown_signals, nullptr);
+    // --query-log F: record every plan request, for --replay.
+    std::unique_ptr<QueryLog> query_log;
+    if (std::string log_file = flagValue(argc, argv, "query-log"); !log_file.empty())
+    {
+      std::string error;
+      if (!(query_log = QueryLog::open(log_file, &error)))
+        crash(error);
+    }
+    PlannerService service(snapshot, numberFlag(argc, argv, "cache-entries", 100000, 0, UINT32_MAX));
+    service.setQueryLog(query_log.get());
+    PlannerHttpApi api(service);
+    BinaryPlannerProtocol binary_protocol(service);
+    std::vector<std::unique_ptr<EventLoopServer>> servers;
+    if (hasFlag(argc, argv, "serve"))
+    {
+      int port = flagValue(argc, argv, "serve") == "true" ? 8080 : numberFlag(argc, argv, "serve", 8080, 1, 65535);
+      servers.push_back(std::make_unique<EventLoopServer>(
+          listenTcp(port), threads, [&](std::string& in, std::string& out)
+      {
+        return serveHttpRequests(in, out, [&](HttpRequest const& request)
+                                 { return api.dispatch(request); });
+      }));
+      std::cerr << "Serving HTTP on port " << port << std::endl;
+    }
+    if (hasFlag(argc, argv, "uds"))
+    {
+      std::string path = flagValue(argc, argv, "uds");
+      servers.push_back(std::make_unique<EventLoopServer>(
+          listenUnix(path), threads, [&](std::string& in, std::string& out)
+      {
+        return binary_protocol.handle(in, out);
+      }));
+      std::cerr << "Serving the binary protocol on " << path << std::endl;
+    }
+    // --metrics-port N: GET /metrics for Prometheus, on its own one-thread
+    // listener so scrapes never queue behind plan requests.
+    if (hasFlag(argc, argv, "metrics-port"))
+    {
+      int port = numberFlag(argc, argv, "metrics-port", 0, 1, 65535);
+      servers.push_back(std::make_unique<EventLoopServer>(
+          listenTcp(port), 1, [&](std::string& in, std::string& out)
+      {
+        return serveHttpRequests(in, out, [&](HttpRequest const& request)
+        {
+          if (request.path != "/metrics")
+            return HttpResponse{404, "{\"error\":\"only /metrics is served here\"}"};
+          return HttpResponse{200, service.prometheusMetrics(), "text/plain; version=0.0.4; charset=utf-8"};
+        });
+      }));
+      std::cerr << "Serving Prometheus metrics on port " << port << std::endl;
+    }
+    std::cerr << topo.numStops() << " stops, " << threads << " threads per server" << std::endl;
+
+    // --reload-minutes N: refetch the network every N minutes and swap it in
+    // (or with --snapshot, reread the file, so a new one can be dropped in).
+    // If a reload fails, we keep serving the old one. Shutdown wakes it up
+    // and waits for it (and for a reload that's under way), since it uses
+    // service.
+    int reload_minutes = numberFlag(argc, argv, "reload-minutes", 0);
+    std::mutex reload_mutex;
+    std::condition_variable reload_cv;
+    bool reload_stopping = false;
+    std::thread reloader;
+    if (reload_minutes > 0)
+    {
+      std::string snapshot_file = flagValue(argc, argv, "snapshot");
+      reloader = std::thread([&, snapshot_file]()
+      {
+        std::unique_lock lock(reload_mutex);
+        while (!reload_cv.wait_for(lock, std::chrono::minutes(reload_minutes), [&]() { return reload_stopping; }))
+        {
+          lock.unlock();
+          std::optional<LoadedNetwork> reloaded;
+          if (snapshot_file.empty())
+            reloaded = loadNetwork(modes, fetch_threads);
+          else if (std::string error; std::optional<NetworkSource> source = loadNetworkSnapshot(snapshot_file, &error))
+            reloaded = buildNetwork(std::move(*source));
+          else
+            std::cerr << error << std::endl;
+          if (!reloaded)
+            std::cerr << "Reload failed; keeping the current topology." << std::endl;
+          else
+          {
+            uint64_t version = service.current()->version + 1;
+            service.swap(makeSnapshot(std::move(reloaded->topology), version, argc, argv));
+            std::cerr << "Reloaded topology (version " << version << ")" << std::endl;
+          }
+          lock.lock();
+        }
+      });
+    }
+
+    std::thread shutdown([&]()
+    {
+      int signal;
+      sigwait(&shutdown_signals, &signal);
+      std::cerr << "Got " << strsignal(signal) << "; shutting down" << std::endl;
+      for (auto& server : servers)
+        server->stop();
+      std::lock_guard lock(reload_mutex);
+      reload_stopping = true;
+      reload_cv.notify_one();
+    });
+    std::vector<std::thread> runners;
+    for (size_t i = 1; i < servers.size(); i++)
+      runners.emplace_back([&, i]() { servers[i]->run(); });
+    servers[0]->run();
+    for (auto& runner : runners)
+      runner.join();
+    shutdown.join();
+    if (reloader.joinable())
+      reloader.join();
+    return 0; // and ~QueryLog flushes the log
+  }
+  if (hasFlag(argc, argv, "list-stops"))
+  {
+    for (StopID stop = 0; stop < topo.numStops(); stop++)
+      std::cout << topo.displayName(stop) << "\n";
+    std::cout << "\n(end of list of all stop names)\n\n";
+  }
 
   // question 1
   printRouteLongNames(routes_json);
 
   // question 2
-  std::cout << most_stops_route << " has the most stops: " << most_stops_count << std::endl;
-  std::cout << fewest_stops_route << " has the fewest stops: " << fewest_stops_count << std::endl;
+  std::cout << network->most_stops_route << " has the most stops: "
+            << network->most_stops_count << std::endl;
+  std::cout << network->fewest_stops_route << " has the fewest stops: "
+            << network->fewest_stops_count << std::endl;
   // NOTE: I'm using an algorithmic interpretations of "connects the routes" rather
   // than human/intuitive, meaning that any green line stop that multiple sub-lines
   // flow through is considered a "connection" of all of them, rather than just
   // "Copley, Arlington etc are on the trunk of the green line."
   std::cout << "\nHere are all stops that connect routes:\n"
             << "================================================\n";
-  for (auto const& [stop, routes] : routes_of_stop)
+  for (StopID stop = 0; stop < topo.numStops(); stop++)
   {
-    if (routes.size() > 1)
+    if (topo.routesOf(stop).size() > 1)
     {
-      std::cout << stop << " connects: ";
-      for (std::string route : routes)
-        std::cout << route << ", ";
+      std::cout << topo.displayName(stop) << " connects: ";
+      for (RouteID route : topo.routesOf(stop))
+        std::cout << topo.route_names[route] << ", ";
       std::cout << std::endl;
     }
   }
 
   // question 3
-  RoutePlanner planner(adjacency_lists, routes_of_stop);
   std::cout << "================================================\n\n"
-            << "Now we'll plan some routes!\n";
+            << "Now we'll plan some routes! (Partial or misspelled stop names are fine.)\n";
   while (true)
   {
     std::cout << "Enter 'from' station: " << std::flush;
     std::string from_stop;
-    std::getline(std::cin, from_stop);
+    if (!std::getline(std::cin, from_stop))
+      break;
     std::cout << "Enter 'to' station: " << std::flush;
     std::string to_stop;
-    std::getline(std::cin, to_stop);
+    if (!std::getline(std::cin, to_stop))
+      break;
 
-    if (from_stop == to_stop)
+    std::optional<StopID> from_id = resolveTypedStop(topo, name_index, from_stop);
+    std::optional<StopID> to_id = resolveTypedStop(topo, name_index, to_stop);
+    if (!from_id || !to_id)
+      continue;
+    if (*from_id == *to_id)
     {
       std::cout << "If you're already there, then there's nowhere to go!" << std::endl;
       continue;
     }
 
-    std::vector<std::string> routes_to_travel = planner.plotRouteFromTo(from_stop, to_stop);
+    std::vector<RouteID> routes_to_travel;
+    if (!planner.planRoute(*from_id, *to_id, &routes_to_travel))
+    {
+      std::cout << "Can't get to " << to_stop << " from " << from_stop << std::endl;
+      continue;
+    }
     std::cout << from_stop << " to " << to_stop << " -> ";
-    for (std::string route : routes_to_travel)
-      std::cout << route << ", ";
+    for (RouteID route : routes_to_travel)
+      std::cout << topo.route_names[route] << ", ";
     std::cout << std::endl;
   }
   return 0;